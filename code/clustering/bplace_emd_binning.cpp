@@ -23,9 +23,18 @@
 
 #include "genesis/genesis.hpp"
 
+#include "../common/mass_trees.hpp"
+
+#include <algorithm>
+#include <cassert>
 #include <cmath>
 #include <chrono>
 #include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <random>
 #include <string>
 #include <unordered_map>
 
@@ -33,113 +42,332 @@ using namespace genesis;
 using namespace genesis::placement;
 using namespace genesis::utils;
 
-/**
- * Testing how binning affects the accuracy and speed of EMD calculations.
- */
-int main( int argc, char** argv )
+// =================================================================================================
+//      Helper Shit
+// =================================================================================================
+
+void matrix_stats( utils::Matrix<double> const& mat )
 {
+    auto const minmax = matrix_minmax(mat);
+    LOG_DBG1 << "min    " << minmax.min;
+    LOG_DBG1 << "max    " << minmax.max;
+    LOG_DBG1 << "avg    " << ( matrix_sum( mat ) / static_cast<double>( mat.size() ) );
+
+    auto const meanstddev = matrix_mean_stddev( mat );
+    LOG_DBG1 << "mean   " << meanstddev.mean;
+    LOG_DBG1 << "stddev " << meanstddev.stddev;
+
+    auto const quarts = matrix_quartiles(mat);
+    LOG_DBG1 << "q0     " << quarts.q0;
+    LOG_DBG1 << "q1     " << quarts.q1;
+    LOG_DBG1 << "q2     " << quarts.q2;
+    LOG_DBG1 << "q3     " << quarts.q3;
+    LOG_DBG1 << "q4     " << quarts.q4;
+}
 
-    // -------------------------------------------------------------------------
-    //     Input shit.
-    // -------------------------------------------------------------------------
+utils::Matrix<double> error_mat( utils::Matrix<double> const& mat, utils::Matrix<double> const& approx )
+{
+    auto err = matrix_subtraction( mat, approx );
+    for( size_t r = 0; r < mat.rows(); ++r ) {
+        for( size_t c = 0; c < mat.cols(); ++c ) {
+            err( r, c ) /= mat( r, c );
+            err( r, c ) = std::abs( err( r, c ));
+        }
+    }
+    return err;
+}
 
-    // Activate logging.
-    utils::Logging::log_to_stdout();
-    utils::Logging::details.time = true;
+/**
+ * @brief Return the value at quantile @p q of all positive off-diagonal entries of a
+ * symmetric distance matrix, or 0.0 if there are none.
+ */
+double positive_distance_quantile( utils::Matrix<double> const& mat, double q )
+{
+    std::vector<double> vals;
+    for( size_t r = 0; r < mat.rows(); ++r ) {
+        for( size_t c = r + 1; c < mat.cols(); ++c ) {
+            if( mat( r, c ) > 0.0 ) {
+                vals.push_back( mat( r, c ));
+            }
+        }
+    }
+    if( vals.empty() ) {
+        return 0.0;
+    }
+    std::sort( vals.begin(), vals.end() );
+    auto const pos = static_cast<size_t>( q * static_cast<double>( vals.size() - 1 ));
+    return vals[ pos ];
+}
 
-    utils::Options::get().number_of_threads( 40 );
-    LOG_BOLD << utils::Options::get().info();
-    LOG_BOLD;
+/**
+ * @brief Copy a random subset of at most @p subset_size of the @p mass_trees, in their
+ * original order.
+ */
+std::vector<tree::MassTree> random_mass_tree_subset(
+    std::vector<tree::MassTree> const& mass_trees,
+    size_t subset_size
+) {
+    auto indices = std::vector<size_t>( mass_trees.size() );
+    std::iota( indices.begin(), indices.end(), 0 );
+    std::shuffle( indices.begin(), indices.end(), utils::Options::get().random_engine() );
+    indices.resize( std::min( subset_size, indices.size() ));
+    std::sort( indices.begin(), indices.end() );
+
+    auto subset = std::vector<tree::MassTree>();
+    subset.reserve( indices.size() );
+    for( auto i : indices ) {
+        subset.push_back( mass_trees[i] );
+    }
+    return subset;
+}
 
-    LOG_INFO << "Started";
+// =================================================================================================
+//      Adaptive Binning
+// =================================================================================================
 
-    // Check if the command line contains the right number of arguments.
-    if (argc != 3) {
-        throw std::runtime_error(
-            "Need to provide three arguments.\n"
-        );
+/**
+ * @brief Choose the number of bins per edge so that binning moves no sample by more than
+ * @p max_mass_shift in EMD units.
+ *
+ * Binning an edge of length `L` into `b` bins moves each mass on it by at most `L / (2b)`.
+ * With `M` the largest mass any sample has on that edge, the shift of every sample is thus
+ * bounded by the sum of `M L / (2b)` over all edges. Minimizing the total number of bins under
+ * that budget yields `b ~ sqrt( M L )`, scaled so that the sum exactly meets the budget.
+ *
+ * A bin count of 0 means that the edge has so few distinct mass positions that binning would
+ * not speed anything up, so it is left untouched (and contributes no error at all).
+ */
+std::vector<size_t> adaptive_bins_per_edge(
+    std::vector<tree::MassTree> const& mass_trees,
+    double max_mass_shift
+) {
+    if( mass_trees.empty() ) {
+        return {};
+    }
+    if( max_mass_shift <= 0.0 ) {
+        throw std::invalid_argument( "Adaptive binning needs a positive error bound." );
+    }
+    auto const edge_count = mass_trees[0].edge_count();
+
+    // Per edge: maximum mass over all samples, and maximum number of mass positions.
+    auto max_mass  = std::vector<double>( edge_count, 0.0 );
+    auto max_count = std::vector<size_t>( edge_count, 0 );
+    for( auto const& tree : mass_trees ) {
+        if( tree.edge_count() != edge_count ) {
+            throw std::runtime_error( "Mass trees have different numbers of edges." );
+        }
+        for( size_t e = 0; e < edge_count; ++e ) {
+            auto const& masses = tree.edge_at(e).data<tree::MassTreeEdgeData>().masses;
+            double sum = 0.0;
+            for( auto const& mass : masses ) {
+                sum += mass.second;
+            }
+            max_mass[e]  = std::max( max_mass[e], sum );
+            max_count[e] = std::max( max_count[e], masses.size() );
+        }
     }
 
-    // In out dirs.
-    auto epadir = utils::dir_normalize_path( std::string( argv[1] ));
-    auto outdir = utils::dir_normalize_path( std::string( argv[2] ));
-    utils::dir_create(outdir);
+    // Weight of each edge in the budget, and their total.
+    auto weights = std::vector<double>( edge_count, 0.0 );
+    double weight_sum = 0.0;
+    for( size_t e = 0; e < edge_count; ++e ) {
+        auto const bl = mass_trees[0].edge_at(e).data<tree::MassTreeEdgeData>().branch_length;
+        weights[e] = std::sqrt( max_mass[e] * bl );
+        weight_sum += weights[e];
+    }
 
-    // -------------------------------------------------------------------------
-    //     Read shit.
-    // -------------------------------------------------------------------------
+    auto bins = std::vector<size_t>( edge_count, 0 );
+    for( size_t e = 0; e < edge_count; ++e ) {
+        if( weights[e] == 0.0 ) {
+            continue;
+        }
+        auto const b = std::ceil( weights[e] * weight_sum / ( 2.0 * max_mass_shift ));
+        if( b < static_cast<double>( max_count[e] )) {
+            bins[e] = std::max<size_t>( 1, static_cast<size_t>( b ));
+        }
+    }
+    return bins;
+}
 
-    // Get all bplace files, either in the epa dir, or in its subdirs
-    auto bplace_filenames = utils::dir_list_files( epadir, ".*\\.bplace" );
-    std::sort( bplace_filenames.begin(), bplace_filenames.end() );
+/**
+ * @brief Bin the masses of each edge into its own number of bins, as given by
+ * adaptive_bins_per_edge(). Same as `mass_tree_binify_masses()`, but per edge.
+ *
+ * Returns the total distance that mass was moved, which is an upper bound of the EMD between
+ * the tree before and after binning.
+ */
+double mass_tree_binify_masses_per_edge(
+    tree::MassTree& tree,
+    std::vector<size_t> const& bins_per_edge
+) {
+    if( bins_per_edge.size() != tree.edge_count() ) {
+        throw std::invalid_argument( "Bins per edge do not fit the mass tree." );
+    }
 
-    // Output list of samples in the order that we use them for the matrix
-    std::ofstream bplace_files_of( outdir + "bplace_order.list" );
-    for( auto const& elem : bplace_filenames ) {
-        bplace_files_of << elem << "\n";
+    double tot_mass_shift = 0.0;
+    for( size_t e = 0; e < tree.edge_count(); ++e ) {
+        auto const nb = bins_per_edge[e];
+        if( nb == 0 ) {
+            continue;
+        }
+        auto& edge_data = tree.edge_at(e).data<tree::MassTreeEdgeData>();
+        auto const bl = edge_data.branch_length;
+        auto const bw = bl / static_cast<double>( nb );
+
+        auto new_masses = std::map<double, double>();
+        for( auto const& mass : edge_data.masses ) {
+            auto bin_num = static_cast<size_t>( mass.first / bw );
+            bin_num = std::min( bin_num, nb - 1 );
+            auto const bin_pos = ( static_cast<double>( bin_num ) + 0.5 ) * bw;
+
+            new_masses[ bin_pos ] += mass.second;
+            tot_mass_shift += mass.second * std::abs( bin_pos - mass.first );
+        }
+        edge_data.masses = new_masses;
     }
-    bplace_files_of.close();
+    return tot_mass_shift;
+}
 
-    SampleSet sample_set;
-    SampleSerializer bplace_loader;
+// =================================================================================================
+//      Binning Benchmark
+// =================================================================================================
 
-    // Process all jplace files.
-    LOG_INFO << "reading " << bplace_filenames.size() << " bplace sample files";
-    for( auto const& bplace_filename : bplace_filenames ) {
-        sample_set.add( bplace_loader.load( bplace_filename ), bplace_filename );
-    }
+struct BinningBenchmarkResult
+{
+    std::string name;
+    size_t      total_bins     = 0;
+    double      seconds        = 0.0;
+    double      mean_rel_error = 0.0;
+    double      max_rel_error  = 0.0;
 
-    // Final output for jplace reading
-    assert( sample_set.size() == bplace_filenames.size() );
-    LOG_INFO << "reading done";
-    LOG_INFO;
+    // Guaranteed maximal relative error, only available for adaptive binning.
+    double      rel_error_bound = std::numeric_limits<double>::quiet_NaN();
+};
 
-    // -------------------------------------------------------------------------
-    //     Helper shit.
-    // -------------------------------------------------------------------------
+/**
+ * @brief Compare timing and accuracy of fixed and adaptive binning on a random subset of
+ * @p subset_size samples, instead of on the full matrix.
+ *
+ * The full resolution EMD is only computed for the pairs in the subset, and serves as the
+ * reference for the error of each binning variant. The adaptive error bounds in
+ * @p rel_errors are relative to the 5% quantile of the subset distances.
+ */
+std::vector<BinningBenchmarkResult> binning_benchmark(
+    std::vector<tree::MassTree> const& mass_trees,
+    size_t subset_size,
+    std::vector<size_t> const& fixed_bins,
+    std::vector<double> const& rel_errors
+) {
+    std::vector<BinningBenchmarkResult> result;
+
+    auto const subset = random_mass_tree_subset( mass_trees, subset_size );
+    LOG_INFO << "Benchmark on a subset of " << subset.size() << " samples";
+
+    // Time a matrix calculation on a binned copy of the subset, and compare to the reference.
+    auto run = [&](
+        std::string const& name,
+        std::function<double( tree::MassTree& )> binify,
+        utils::Matrix<double> const& reference
+    ){
+        BinningBenchmarkResult res;
+        res.name = name;
+
+        auto binned = subset;
+        for( auto& tree : binned ) {
+            binify( tree );
+        }
+        for( auto const& tree : binned ) {
+            for( size_t e = 0; e < tree.edge_count(); ++e ) {
+                res.total_bins += tree.edge_at(e).data<tree::MassTreeEdgeData>().masses.size();
+            }
+        }
 
-    auto matrix_stats = []( utils::Matrix<double> const& mat ){
-        auto const minmax = matrix_minmax(mat);
-        LOG_DBG1 << "min    " << minmax.min;
-        LOG_DBG1 << "max    " << minmax.max;
-        LOG_DBG1 << "avg    " << ( matrix_sum( mat ) / static_cast<double>( mat.size() ) );
-
-        auto const meanstddev = matrix_mean_stddev( mat );
-        LOG_DBG1 << "mean   " << meanstddev.mean;
-        LOG_DBG1 << "stddev " << meanstddev.stddev;
-
-        auto const quarts = matrix_quartiles(mat);
-        LOG_DBG1 << "q0     " << quarts.q0;
-        LOG_DBG1 << "q1     " << quarts.q1;
-        LOG_DBG1 << "q2     " << quarts.q2;
-        LOG_DBG1 << "q3     " << quarts.q3;
-        LOG_DBG1 << "q4     " << quarts.q4;
-    };
+        auto const c_start = std::chrono::steady_clock::now();
+        auto const emd_mat = tree::earth_movers_distance( binned );
+        res.seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - c_start
+        ).count();
+
+        if( reference.size() == 0 ) {
+            return std::make_pair( res, emd_mat );
+        }
 
-    auto error_mat = []( utils::Matrix<double> const& mat, utils::Matrix<double> const& approx ){
-        auto err = matrix_subtraction( mat, approx );
-        for( size_t r = 0; r < mat.rows(); ++r ) {
-            for( size_t c = 0; c < mat.cols(); ++c ) {
-                err( r, c ) /= mat( r, c );
-                err( r, c ) = std::abs( err( r, c ));
+        // Relative error of all pairs with a non-zero reference distance.
+        size_t cnt = 0;
+        for( size_t r = 0; r < reference.rows(); ++r ) {
+            for( size_t c = r + 1; c < reference.cols(); ++c ) {
+                if( reference( r, c ) <= 0.0 ) {
+                    continue;
+                }
+                auto const err = std::abs( reference( r, c ) - emd_mat( r, c )) / reference( r, c );
+                res.mean_rel_error += err;
+                res.max_rel_error = std::max( res.max_rel_error, err );
+                ++cnt;
             }
         }
-        return err;
+        if( cnt > 0 ) {
+            res.mean_rel_error /= static_cast<double>( cnt );
+        }
+        return std::make_pair( res, emd_mat );
     };
 
-    // -------------------------------------------------------------------------
-    //     Calcualte shit.
-    // -------------------------------------------------------------------------
+    // Reference at full resolution.
+    auto const full = run( "full", []( tree::MassTree& ){ return 0.0; }, {} );
+    auto const& reference = full.second;
+    result.push_back( full.first );
+    LOG_INFO << "full: " << full.first.seconds << "s";
+
+    for( auto bin : fixed_bins ) {
+        auto const res = run( "fixed_" + std::to_string( bin ), [&]( tree::MassTree& tree ){
+            return tree::mass_tree_binify_masses( tree, bin );
+        }, reference ).first;
+        result.push_back( res );
+        LOG_INFO << res.name << ": " << res.seconds << "s, mean rel error " << res.mean_rel_error
+                 << ", max rel error " << res.max_rel_error;
+    }
 
-    LOG_INFO << "Using " << utils::Options::get().number_of_threads() << " threads.";
+    // The adaptive bounds are relative to the 5% quantile of the subset distances. They are thus
+    // only guaranteed for pairs at least that far apart; closer pairs can have larger relative
+    // errors, which are included in the reported mean and max errors.
+    auto const scale = positive_distance_quantile( reference, 0.05 );
+    for( auto rel_error : rel_errors ) {
+        auto const bins = adaptive_bins_per_edge( mass_trees, rel_error * scale / 2.0 );
+        auto res = run( "adaptive_" + utils::to_string( rel_error ), [&]( tree::MassTree& tree ){
+            return mass_tree_binify_masses_per_edge( tree, bins );
+        }, reference ).first;
+        res.rel_error_bound = rel_error;
+        result.push_back( res );
+        LOG_INFO << res.name << ": " << res.seconds << "s, mean rel error " << res.mean_rel_error
+                 << ", max rel error " << res.max_rel_error;
+    }
+
+    return result;
+}
+
+void write_benchmark( std::vector<BinningBenchmarkResult> const& results, std::string const& filename )
+{
+    std::ofstream out;
+    utils::file_output_stream( filename, out );
+    out << "name\ttotal_bins\ttime_s\tspeedup\tmean_rel_error\tmax_rel_error\trel_error_bound\n";
+    for( auto const& res : results ) {
+        out << res.name << "\t" << res.total_bins << "\t" << res.seconds << "\t";
+        out << ( results[0].seconds / res.seconds ) << "\t";
+        out << res.mean_rel_error << "\t" << res.max_rel_error << "\t" << res.rel_error_bound << "\n";
+    }
+}
 
-    LOG_INFO << "Convert to mass trees";
-    auto const mass_trees = convert_sample_set_to_mass_trees( sample_set );
-    LOG_INFO << "Convert done.";
+// =================================================================================================
+//      Run Modes
+// =================================================================================================
 
+/**
+ * @brief Original test: full matrix, then fixed bin counts, with errors against the full matrix.
+ */
+void run_fixed( std::vector<tree::MassTree> const& mass_trees, std::string const& outdir )
+{
     LOG_INFO << "Full Matrix calculation";
     auto const c_start = std::chrono::steady_clock::now();
-    auto const emd_mat = tree::earth_movers_distance( mass_trees.first );
+    auto const emd_mat = tree::earth_movers_distance( mass_trees );
     auto const c_duration = std::chrono::duration_cast<std::chrono::seconds>(
         std::chrono::steady_clock::now() - c_start
     );
@@ -158,13 +386,13 @@ int main( int argc, char** argv )
 
         // Make copy and binify it.
         auto binned_trees = mass_trees;
-        for( auto& tree : binned_trees.first ) {
+        for( auto& tree : binned_trees ) {
             mass_tree_binify_masses( tree, bin );
         }
 
         LOG_INFO << "Matrix calculation";
         auto const c_start = std::chrono::steady_clock::now();
-        auto const emd_mat_binned = tree::earth_movers_distance( binned_trees.first );
+        auto const emd_mat_binned = tree::earth_movers_distance( binned_trees );
         auto const c_duration = std::chrono::duration_cast<std::chrono::seconds>(
             std::chrono::steady_clock::now() - c_start
         );
@@ -184,6 +412,150 @@ int main( int argc, char** argv )
         matrix_stats( error_mat( emd_mat, emd_mat_binned ));
         LOG_INFO;
     }
+}
+
+/**
+ * @brief Binned matrix only, with per edge bins chosen for a maximal relative error.
+ *
+ * The scale of the distances is estimated from the full resolution EMD on a subset of samples.
+ * Each sample is then moved by at most `rel_error * scale / 2` through binning, so that, by the
+ * triangle inequality, every pair with a distance of at least `scale` has a relative error of
+ * at most `rel_error`. The actual shifts are reported, so the bound can be checked afterwards.
+ */
+void run_adaptive(
+    std::vector<tree::MassTree> mass_trees,
+    double rel_error,
+    size_t subset_size,
+    std::string const& outdir
+) {
+    LOG_INFO << "Estimating distance scale on a subset of " << subset_size << " samples";
+    auto subset = random_mass_tree_subset( mass_trees, subset_size );
+    auto const scale = positive_distance_quantile( tree::earth_movers_distance( subset ), 0.05 );
+    subset.clear();
+    LOG_INFO << "Distance scale (5% quantile): " << scale;
+
+    auto const max_shift = rel_error * scale / 2.0;
+    auto const bins = adaptive_bins_per_edge( mass_trees, max_shift );
+    LOG_INFO << "Max mass shift per sample: " << max_shift;
+    LOG_INFO << "Total bins: " << std::accumulate( bins.begin(), bins.end(), size_t( 0 ));
+    utils::file_write( utils::join( bins, "\n" ) + "\n", outdir + "emd_adaptive_bins.list" );
+
+    double worst_shift = 0.0;
+    for( auto& tree : mass_trees ) {
+        worst_shift = std::max( worst_shift, mass_tree_binify_masses_per_edge( tree, bins ));
+    }
+    LOG_INFO << "Largest actual mass shift: " << worst_shift;
+
+    LOG_INFO << "Matrix calculation";
+    auto const c_start = std::chrono::steady_clock::now();
+    auto const emd_mat_binned = tree::earth_movers_distance( mass_trees );
+    auto const c_duration = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now() - c_start
+    );
+    LOG_INFO << "Matrix calculation done";
+    LOG_INFO << "Time: " << c_duration.count() << "s";
+    utils::file_write( utils::to_string( emd_mat_binned ), outdir + "emd_adaptive.mat" );
+    LOG_INFO;
+
+    matrix_stats( emd_mat_binned );
+    LOG_INFO;
+}
+
+// =================================================================================================
+//      Main
+// =================================================================================================
+
+/**
+ * Testing how binning affects the accuracy and speed of EMD calculations.
+ *
+ * Modes, given as optional third argument:
+ *
+ *  - (none):                          Full matrix and all fixed bin counts, as before.
+ *  - `adaptive <rel_error> [subset]`: Only the binned matrix, with per edge bins for the error bound.
+ *  - `bench [subset]`:                Time versus error of all variants, on a subset of samples.
+ */
+int main( int argc, char** argv )
+{
+
+    // -------------------------------------------------------------------------
+    //     Input shit.
+    // -------------------------------------------------------------------------
+
+    // Activate logging.
+    utils::Logging::log_to_stdout();
+    utils::Logging::details.time = true;
+
+    utils::Options::get().number_of_threads( 40 );
+    LOG_BOLD << utils::Options::get().info();
+    LOG_BOLD;
+
+    LOG_INFO << "Started";
+
+    // Check if the command line contains the right number of arguments.
+    if( argc < 3 || argc > 6 ) {
+        throw std::runtime_error(
+            "Need to provide arguments: epadir outdir [adaptive rel_error [subset] | bench [subset]]\n"
+        );
+    }
+
+    // In out dirs.
+    auto epadir = utils::dir_normalize_path( std::string( argv[1] ));
+    auto outdir = utils::dir_normalize_path( std::string( argv[2] ));
+    utils::dir_create(outdir);
+
+    auto const mode = ( argc > 3 ? std::string( argv[3] ) : std::string( "fixed" ));
+    if( mode != "fixed" && mode != "adaptive" && mode != "bench" ) {
+        throw std::runtime_error( "Unknown mode " + mode );
+    }
+    if( mode == "adaptive" && argc < 5 ) {
+        throw std::runtime_error( "Adaptive mode needs a relative error bound." );
+    }
+
+    // -------------------------------------------------------------------------
+    //     Read shit.
+    // -------------------------------------------------------------------------
+
+    // Get all bplace files, either in the epa dir, or in its subdirs
+    auto bplace_filenames = utils::dir_list_files( epadir, ".*\\.bplace" );
+    std::sort( bplace_filenames.begin(), bplace_filenames.end() );
+
+    // Output list of samples in the order that we use them for the matrix
+    std::ofstream bplace_files_of( outdir + "bplace_order.list" );
+    for( auto const& elem : bplace_filenames ) {
+        bplace_files_of << elem << "\n";
+    }
+    bplace_files_of.close();
+
+    // Process all bplace files, directly converting them to mass trees.
+    LOG_INFO << "reading " << bplace_filenames.size() << " bplace sample files";
+    auto data = load_bplace_mass_trees( epadir, bplace_filenames );
+    assert( data.trees.size() == bplace_filenames.size() );
+    LOG_INFO << "reading done";
+    LOG_INFO;
+
+    // -------------------------------------------------------------------------
+    //     Calcualte shit.
+    // -------------------------------------------------------------------------
+
+    LOG_INFO << "Using " << utils::Options::get().number_of_threads() << " threads.";
+
+    if( mode == "fixed" ) {
+        run_fixed( data.trees, outdir );
+
+    } else if( mode == "adaptive" ) {
+        auto const rel_error   = std::stod( argv[4] );
+        auto const subset_size = ( argc > 5 ? std::stoul( argv[5] ) : 200 );
+        run_adaptive( std::move( data.trees ), rel_error, subset_size, outdir );
+
+    } else if( mode == "bench" ) {
+        auto const subset_size = ( argc > 4 ? std::stoul( argv[4] ) : 200 );
+        auto const results = binning_benchmark(
+            data.trees, subset_size,
+            { 1, 2, 4, 8, 16, 32, 64, 128, 256 },
+            { 0.1, 0.05, 0.01, 0.005, 0.001 }
+        );
+        write_benchmark( results, outdir + "binning_bench.csv" );
+    }
 
     LOG_INFO << "Finished";
     return 0;
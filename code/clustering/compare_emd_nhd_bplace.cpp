@@ -23,6 +23,10 @@
 
 #include "genesis/genesis.hpp"
 
+#include "../common/nn_chain_squash_clustering.hpp"
+
+#include <algorithm>
+#include <cassert>
 #include <fstream>
 #include <string>
 #include <unordered_map>
@@ -31,7 +35,11 @@ using namespace genesis;
 using namespace genesis::placement;
 using namespace genesis::tree;
 
-void merge_order_rec( SquashClustering const& sc, size_t index, std::vector<size_t>& result )
+// =================================================================================================
+//      Merge Order
+// =================================================================================================
+
+void merge_order_rec( NnChainSquashClustering const& sc, size_t index, std::vector<size_t>& result )
 {
     auto const& merger = sc.mergers()[ index ];
 
@@ -52,7 +60,7 @@ void merge_order_rec( SquashClustering const& sc, size_t index, std::vector<size
     }
 }
 
-std::vector<size_t> merge_order( SquashClustering const& sc )
+std::vector<size_t> merge_order( NnChainSquashClustering const& sc )
 {
     auto result = std::vector<size_t>();
     merge_order_rec( sc, sc.mergers().size() - 1, result );
@@ -136,10 +144,17 @@ int main( int argc, char** argv )
     SampleSet sset;
     SampleSerializer bplace_loader;
 
-    // Process all bplace files.
+    // Process all bplace files, in parallel. We need the full samples here for the NHD.
     LOG_INFO << "reading " << bplace_filenames.size() << " bplace sample files";
-    for( auto const& bplace_filename : bplace_filenames ) {
-        sset.add( bplace_loader.load( epadir + bplace_filename ), bplace_filename );
+    {
+        auto tmp = std::vector<Sample>( bplace_filenames.size() );
+        #pragma omp parallel for schedule(dynamic)
+        for( size_t i = 0; i < bplace_filenames.size(); ++i ) {
+            tmp[ i ] = bplace_loader.load( epadir + bplace_filenames[i] );
+        }
+        for( size_t i = 0; i < bplace_filenames.size(); ++i ) {
+            sset.add( std::move( tmp[i] ), bplace_filenames[i] );
+        }
     }
 
     // Final output for bplace reading
@@ -164,7 +179,6 @@ int main( int argc, char** argv )
 
     LOG_INFO << "Converting Trees";
     auto mass_trees = convert_sample_set_to_mass_trees( sset );
-    // sset.clear();
 
     // -------------------------------------------------------------------------
     //     Do the calculations.
@@ -175,16 +189,20 @@ int main( int argc, char** argv )
     utils::file_write( utils::to_string( nhd_matrix ), outdir + "nhd_unordered.mat" );
     LOG_INFO << "Done";
 
+    // The samples are not needed any more. The EMD works on the mass trees that we already have,
+    // instead of converting the samples a second time.
+    sset.clear();
 
     LOG_INFO << "EMD Matrix calculation started";
-    auto const emd_matrix = earth_movers_distance( sset );
+    auto const emd_matrix = tree::earth_movers_distance( mass_trees.first );
     utils::file_write( utils::to_string( emd_matrix ), outdir + "emd_unordered.mat" );
     LOG_INFO << "Done";
 
 
+    // Re-use the EMD matrix as initial squash distances, as it was calculated on the same trees.
     LOG_INFO << "Starting squash clustering";
-    auto sc = tree::SquashClustering();
-    sc.run(  std::move( mass_trees.first ) );
+    auto sc = NnChainSquashClustering();
+    sc.run( std::move( mass_trees.first ), emd_matrix );
     LOG_INFO << "Finished squash clustering";
 
     LOG_INFO << "Writing cluster results";
@@ -195,7 +213,6 @@ int main( int argc, char** argv )
     for( size_t i = 0; i < sc.clusters().size(); ++i ) {
         file_clust_results << i << ": " << ( sc.clusters()[i].active ? "act " : "dea " )
                  << sc.clusters()[i].count << " "
-                 << sc.clusters()[i].distances.size() << " "
                  << sc.clusters()[i].tree.node_count()
                  << "\n";
     }
@@ -228,6 +245,13 @@ int main( int argc, char** argv )
     }
     file_clust_results << "\n";
 
+    // Also write the order on its own, for drawing the unordered matrices with mat_to_bmp.
+    std::ofstream file_order;
+    utils::file_output_stream( outdir + "sc-order.list", file_order );
+    for( auto const index : order ) {
+        file_order << index << "\n";
+    }
+
     LOG_INFO << "Finished";
     return 0;
 }
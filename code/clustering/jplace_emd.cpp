@@ -23,15 +23,512 @@
 
 #include "genesis/genesis.hpp"
 
+#include "../common/edge_matrix_cache.hpp"
+#include "../common/fast_jplace_reader.hpp"
+#include "../common/matrix_io.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
 #include <fstream>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 
 using namespace genesis;
 using namespace genesis::placement;
+using namespace genesis::utils;
+
+// =================================================================================================
+//     Read Order List
+// =================================================================================================
+
+/**
+ * @brief Read a sample order list as written by our programs, e.g., `bplace_order.list`,
+ * and return the sample names without path and file extension.
+ */
+std::vector<std::string> read_order_list( std::string const& filename )
+{
+    std::vector<std::string> result;
+    for( auto const& line : utils::file_read_lines( filename )) {
+        if( ! line.empty() ) {
+            result.push_back( utils::file_filename( utils::file_basename( line )));
+        }
+    }
+    return result;
+}
+
+void write_order_list( std::vector<std::string> const& names, std::string const& filename )
+{
+    std::ofstream order_of;
+    utils::file_output_stream( filename, order_of );
+    for( auto const& name : names ) {
+        order_of << name << "\n";
+    }
+}
+
+// =================================================================================================
+//     EMD State
+// =================================================================================================
+
+/**
+ * @brief Everything that is needed to extend an EMD matrix by new samples later.
+ *
+ * All mass trees are on the same fixed reference tree, which is the average branch length tree
+ * of the samples of the first run. It is not updated when samples are added later, so that the
+ * distances that are already in the matrix stay valid.
+ */
+struct EmdState
+{
+    PlacementTree               reference_tree;
+    std::vector<std::string>    names;
+    std::vector<uint64_t>       file_sizes;
+    std::vector<int64_t>        file_mtimes;
+    std::vector<tree::MassTree> mass_trees;
+    Matrix<double>              emd;
+};
+
+// File layout, using the binary helpers of the edge matrix cache:
+//
+//     header:     char[8] magic, uint64 version, uint64 samples, uint64 edges
+//     tree:       newick string with edge nums, of the reference tree
+//     samples:    per sample name, uint64 file size, int64 file mtime in ns, and per edge num
+//                 uint64 count of its masses, followed by that many pairs of doubles
+//                 (position, mass)
+//     matrix:     samples x samples doubles, row-major
+//
+// The masses are stored by edge num, as the edge indices of the tree that is read back from the
+// newick string might differ from the ones of the jplace files.
+char const emd_state_magic[8] = { 'P', 'M', 'E', 'M', 'D', 'S', 'T', 'A' };
+uint64_t const emd_state_version = 1;
+
+/**
+ * @brief Per edge num of the @p tree, the name of the leaf at its end, or an empty string for
+ * inner edges. Two trees with the same leaf names per edge num have the same topology.
+ */
+std::vector<std::string> leaf_names_by_edge_num( PlacementTree const& tree )
+{
+    auto const columns = edge_matrix_cache_columns( tree );
+    auto result = std::vector<std::string>( tree.edge_count() );
+    for( size_t e = 0; e < tree.edge_count(); ++e ) {
+        auto const& node = tree.edge_at( e ).secondary_node();
+        if( tree::is_leaf( node )) {
+            result[ columns[e] ] = node.data<PlacementNodeData>().name;
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Mass tree of the @p sample on the @p reference tree.
+ *
+ * Same as `convert_sample_set_to_mass_trees()` does for each sample, that is, each mass keeps its
+ * relative position on its edge, and the masses are normalized. The edges are however matched via
+ * their edge nums.
+ */
+tree::MassTree mass_tree_on_reference( Sample const& sample, PlacementTree const& reference )
+{
+    auto const ref_columns = edge_matrix_cache_columns( reference );
+    auto ref_index = std::vector<size_t>( reference.edge_count() );
+    for( size_t e = 0; e < reference.edge_count(); ++e ) {
+        ref_index[ ref_columns[e] ] = e;
+    }
+
+    auto result = tree::convert_default_tree_to_mass_tree( reference );
+    for( auto const& pquery : sample ) {
+        auto const mult = total_multiplicity( pquery );
+        for( auto const& placement : pquery.placements() ) {
+            auto const& edge_data = placement.edge().data<PlacementEdgeData>();
+            auto& ref_data = result.edge_at( ref_index[ edge_data.edge_num() ] ).data<tree::MassTreeEdgeData>();
+            auto const position = edge_data.branch_length > 0.0
+                ? placement.proximal_length / edge_data.branch_length * ref_data.branch_length
+                : 0.0
+            ;
+            ref_data.masses[ position ] += placement.like_weight_ratio * mult;
+        }
+    }
+    tree::mass_tree_normalize_masses( result );
+    return result;
+}
+
+/**
+ * @brief Add the @p samples to the @p state, and calculate their distances to all samples.
+ *
+ * The distances of the new samples to all samples are calculated, which is O(N * D)
+ * instead of O(N^2) for D new samples.
+ */
+void add_samples_to_emd_state(
+    EmdState& state,
+    SampleSet const& samples,
+    std::vector<std::string> const& names,
+    std::vector<EdgeMatrixCacheEntry> const& entries
+) {
+    assert( samples.size() == names.size() && samples.size() == entries.size() );
+    auto const ref_leaves = leaf_names_by_edge_num( state.reference_tree );
+    auto const prev_size = state.names.size();
+    auto const size = prev_size + samples.size();
+
+    state.mass_trees.resize( size );
+    std::string error_msg;
+    #pragma omp parallel for schedule(dynamic)
+    for( size_t i = 0; i < samples.size(); ++i ) {
+        auto const& sample = samples[i].sample;
+        if(
+            sample.tree().edge_count() != state.reference_tree.edge_count() ||
+            leaf_names_by_edge_num( sample.tree() ) != ref_leaves
+        ) {
+            #pragma omp critical(jplace_emd_error)
+            {
+                error_msg = "Sample " + names[i] + " is placed on a different tree.";
+            }
+            continue;
+        }
+        state.mass_trees[ prev_size + i ] = mass_tree_on_reference( sample, state.reference_tree );
+    }
+    if( ! error_msg.empty() ) {
+        throw std::runtime_error( error_msg );
+    }
+
+    for( size_t i = 0; i < samples.size(); ++i ) {
+        state.names.push_back( names[i] );
+        state.file_sizes.push_back( entries[i].size );
+        state.file_mtimes.push_back( entries[i].mtime );
+    }
+
+    // Copy the previous block.
+    auto emd_matrix = Matrix<double>( size, size, 0.0 );
+    for( size_t i = 0; i < prev_size; ++i ) {
+        for( size_t j = 0; j < prev_size; ++j ) {
+            emd_matrix( i, j ) = state.emd( i, j );
+        }
+    }
+
+    // Calculate the new rows, which are of different length, hence the dynamic schedule.
+    #pragma omp parallel for schedule(dynamic)
+    for( size_t j = prev_size; j < size; ++j ) {
+        for( size_t i = 0; i < j; ++i ) {
+            auto const dist = tree::earth_movers_distance( state.mass_trees[i], state.mass_trees[j] );
+            emd_matrix( i, j ) = dist;
+            emd_matrix( j, i ) = dist;
+        }
+    }
+    state.emd = std::move( emd_matrix );
+}
+
+/**
+ * @brief Keep only the samples at the @p indices of the @p state, in that order.
+ */
+void select_emd_state_samples( EmdState& state, std::vector<size_t> const& indices )
+{
+    EmdState result;
+    result.reference_tree = state.reference_tree;
+    result.emd = Matrix<double>( indices.size(), indices.size() );
+    for( size_t i = 0; i < indices.size(); ++i ) {
+        result.names.push_back( state.names[ indices[i] ] );
+        result.file_sizes.push_back( state.file_sizes[ indices[i] ] );
+        result.file_mtimes.push_back( state.file_mtimes[ indices[i] ] );
+        result.mass_trees.push_back( std::move( state.mass_trees[ indices[i] ] ));
+        for( size_t j = 0; j < indices.size(); ++j ) {
+            result.emd( i, j ) = state.emd( indices[i], indices[j] );
+        }
+    }
+    state = std::move( result );
+}
+
+/**
+ * @brief Copy of the tree of the first of the @p samples, with the branch lengths averaged over
+ * all of them, as `convert_sample_set_to_mass_trees()` uses it.
+ */
+PlacementTree average_reference_tree( SampleSet const& samples )
+{
+    if( samples.size() == 0 ) {
+        throw std::runtime_error( "No samples to build the reference tree from." );
+    }
+    auto const& first = samples[0].sample.tree();
+    auto lengths = std::vector<double>( first.edge_count(), 0.0 );
+    for( size_t i = 0; i < samples.size(); ++i ) {
+        auto const& tree = samples[i].sample.tree();
+        if( ! compatible_trees( first, tree )) {
+            throw std::runtime_error( "Sample " + samples[i].name + " is placed on a different tree." );
+        }
+        for( size_t e = 0; e < first.edge_count(); ++e ) {
+            lengths[e] += tree.edge_at( e ).data<PlacementEdgeData>().branch_length;
+        }
+    }
+    for( auto& length : lengths ) {
+        length /= static_cast<double>( samples.size() );
+    }
+    return edge_matrix_cache_average_tree_( first, lengths );
+}
+
+void write_emd_state( EmdState const& state, std::string const& filename )
+{
+    auto const num_samples = state.names.size();
+    auto const num_edges = state.reference_tree.edge_count();
+    auto const columns = edge_matrix_cache_columns( state.reference_tree );
+
+    std::ofstream os( filename, std::ios::binary | std::ios::trunc );
+    if( ! os ) {
+        throw std::runtime_error( "Cannot write EMD state " + filename );
+    }
+    os.write( emd_state_magic, 8 );
+    edge_matrix_cache_write_( os, emd_state_version );
+    edge_matrix_cache_write_( os, static_cast<uint64_t>( num_samples ));
+    edge_matrix_cache_write_( os, static_cast<uint64_t>( num_edges ));
+    edge_matrix_cache_write_string_( os, PlacementTreeNewickWriter().to_string( state.reference_tree ));
+
+    auto edges_by_num = std::vector<size_t>( num_edges );
+    for( size_t e = 0; e < num_edges; ++e ) {
+        edges_by_num[ columns[e] ] = e;
+    }
+    for( size_t i = 0; i < num_samples; ++i ) {
+        edge_matrix_cache_write_string_( os, state.names[i] );
+        edge_matrix_cache_write_( os, state.file_sizes[i] );
+        edge_matrix_cache_write_( os, state.file_mtimes[i] );
+        for( auto const e : edges_by_num ) {
+            auto const& masses = state.mass_trees[i].edge_at( e ).data<tree::MassTreeEdgeData>().masses;
+            edge_matrix_cache_write_( os, static_cast<uint64_t>( masses.size() ));
+            for( auto const& mass : masses ) {
+                edge_matrix_cache_write_( os, mass.first );
+                edge_matrix_cache_write_( os, mass.second );
+            }
+        }
+    }
+    for( size_t i = 0; i < num_samples; ++i ) {
+        for( size_t j = 0; j < num_samples; ++j ) {
+            edge_matrix_cache_write_( os, state.emd( i, j ));
+        }
+    }
+    os.close();
+    if( ! os ) {
+        throw std::runtime_error( "Cannot write EMD state " + filename );
+    }
+}
+
+EmdState read_emd_state( std::string const& filename )
+{
+    std::ifstream is( filename, std::ios::binary );
+    auto const invalid = std::runtime_error( "Invalid EMD state " + filename );
+    if( ! is ) {
+        throw std::runtime_error( "Cannot read EMD state " + filename );
+    }
+
+    char magic[8];
+    uint64_t version, num_samples, num_edges;
+    std::string newick;
+    is.read( magic, 8 );
+    if(
+        ! is || ! std::equal( magic, magic + 8, emd_state_magic ) ||
+        ! edge_matrix_cache_read_( is, version ) || version != emd_state_version ||
+        ! edge_matrix_cache_read_( is, num_samples ) ||
+        ! edge_matrix_cache_read_( is, num_edges ) ||
+        ! edge_matrix_cache_read_string_( is, newick )
+    ) {
+        throw invalid;
+    }
+
+    EmdState state;
+    state.reference_tree = edge_matrix_cache_read_newick_( newick );
+    if( state.reference_tree.edge_count() != num_edges ) {
+        throw invalid;
+    }
+    auto const columns = edge_matrix_cache_columns( state.reference_tree );
+    auto edges_by_num = std::vector<size_t>( num_edges );
+    for( size_t e = 0; e < num_edges; ++e ) {
+        edges_by_num[ columns[e] ] = e;
+    }
+    auto const empty_mass_tree = tree::convert_default_tree_to_mass_tree( state.reference_tree );
+
+    state.names.resize( num_samples );
+    state.file_sizes.resize( num_samples );
+    state.file_mtimes.resize( num_samples );
+    state.mass_trees.resize( num_samples, empty_mass_tree );
+    for( size_t i = 0; i < num_samples; ++i ) {
+        if(
+            ! edge_matrix_cache_read_string_( is, state.names[i] ) ||
+            ! edge_matrix_cache_read_( is, state.file_sizes[i] ) ||
+            ! edge_matrix_cache_read_( is, state.file_mtimes[i] )
+        ) {
+            throw invalid;
+        }
+        for( auto const e : edges_by_num ) {
+            auto& masses = state.mass_trees[i].edge_at( e ).data<tree::MassTreeEdgeData>().masses;
+            uint64_t count;
+            if( ! edge_matrix_cache_read_( is, count )) {
+                throw invalid;
+            }
+            for( uint64_t k = 0; k < count; ++k ) {
+                double position, mass;
+                if( ! edge_matrix_cache_read_( is, position ) || ! edge_matrix_cache_read_( is, mass )) {
+                    throw invalid;
+                }
+                masses[ position ] = mass;
+            }
+        }
+    }
+    state.emd = Matrix<double>( num_samples, num_samples );
+    for( size_t i = 0; i < num_samples; ++i ) {
+        for( size_t j = 0; j < num_samples; ++j ) {
+            if( ! edge_matrix_cache_read_( is, state.emd( i, j ))) {
+                throw invalid;
+            }
+        }
+    }
+    return state;
+}
+
+// =================================================================================================
+//     Incremental EMD
+// =================================================================================================
+
+/**
+ * @brief Read the jplace files of the @p names, and add them to the @p state.
+ */
+void read_and_add_samples(
+    EmdState& state,
+    std::string const& epadir,
+    std::vector<std::string> const& names,
+    std::unordered_map<std::string, std::string>& current
+) {
+    std::vector<std::string> paths;
+    for( auto const& name : names ) {
+        paths.push_back( epadir + current[ name ] );
+    }
+    LOG_INFO << "reading " << paths.size() << " jplace sample files";
+    auto const sample_set = FastJplaceReader().from_files( paths );
+    assert( sample_set.size() == paths.size() );
+    LOG_INFO << "finished reading sample jplace files";
+
+    LOG_INFO << "Matrix update started";
+    add_samples_to_emd_state( state, sample_set, names, edge_matrix_cache_entries( paths ));
+    LOG_INFO << "Matrix update finished";
+}
+
+/**
+ * @brief Extend a previously calculated EMD matrix by the samples that were added since then.
+ *
+ * The previous run is given either as its `emd.state` file, or, for the first update, as a matrix
+ * and its order list, see main(). Previous samples whose files are not found any more, or whose
+ * files changed in size or modification time, are dropped from the matrix; the latter are then
+ * calculated again as new samples. The resulting order is the previous one (without dropped
+ * samples), followed by the new samples. Only the new files are read.
+ */
+void run_incremental( EmdState& state, std::string const& epadir, std::vector<std::string> const& jplace_filenames )
+{
+    // Map from sample names to the current files.
+    std::unordered_map<std::string, std::string> current;
+    for( auto const& fn : jplace_filenames ) {
+        current[ utils::file_filename( fn ) ] = fn;
+    }
+
+    // Previous samples that are still there and unchanged, in their previous order.
+    std::vector<size_t> prev_indices;
+    std::unordered_set<std::string> known;
+    for( size_t i = 0; i < state.names.size(); ++i ) {
+        auto const& name = state.names[i];
+        if( current.count( name ) == 0 ) {
+            LOG_WARN << "Dropping previous sample " << name << ", as its file is missing";
+            continue;
+        }
+        auto const entry = edge_matrix_cache_entries({ epadir + current[ name ] })[0];
+        if( entry.size != state.file_sizes[i] || entry.mtime != state.file_mtimes[i] ) {
+            LOG_WARN << "Previous sample " << name << " has changed, and is calculated again";
+            continue;
+        }
+        prev_indices.push_back( i );
+        known.insert( name );
+    }
+    select_emd_state_samples( state, prev_indices );
+
+    // All new samples, in file name order.
+    std::vector<std::string> new_names;
+    for( auto const& fn : jplace_filenames ) {
+        if( known.count( utils::file_filename( fn )) == 0 ) {
+            new_names.push_back( utils::file_filename( fn ));
+        }
+    }
+    LOG_INFO << "Previous samples: " << state.names.size() << ", new samples: " << new_names.size();
+    read_and_add_samples( state, epadir, new_names, current );
+}
+
+/**
+ * @brief Build the state of a previous run from its @p matrix_file and @p order_file, e.g.,
+ * `emd.mat` and `emd_order.list` of a run of this program before it wrote `emd.state`,
+ * or `emd_unordered.mat` and `bplace_order.list` of `compare_emd_nhd_bplace`.
+ *
+ * Both compute the distances on the average branch length tree of their samples. We hence read
+ * the previous samples that are still there once, and use their average branch length tree as
+ * the fixed reference from now on. The matrix is read from its text form, so its values are only
+ * as precise as they were printed there; the state that is written afterwards keeps the full
+ * precision for all later runs.
+ */
+EmdState emd_state_from_matrix(
+    std::string const& epadir,
+    std::vector<std::string> const& jplace_filenames,
+    std::string const& matrix_file,
+    std::string const& order_file
+) {
+    LOG_INFO << "Reading previous matrix and order";
+    auto const prev_order  = read_order_list( order_file );
+    auto const prev_matrix = read_double_matrix( matrix_file );
+    if( prev_matrix.rows() != prev_order.size() || prev_matrix.cols() != prev_order.size() ) {
+        throw std::runtime_error( "Previous matrix does not fit the previous order list." );
+    }
+
+    std::unordered_map<std::string, std::string> current;
+    for( auto const& fn : jplace_filenames ) {
+        current[ utils::file_filename( fn ) ] = fn;
+    }
+    std::vector<size_t>      prev_indices;
+    std::vector<std::string> paths;
+    for( size_t i = 0; i < prev_order.size(); ++i ) {
+        if( current.count( prev_order[i] ) > 0 ) {
+            prev_indices.push_back( i );
+            paths.push_back( epadir + current[ prev_order[i] ] );
+        } else {
+            LOG_WARN << "Dropping previous sample " << prev_order[i] << ", as its file is missing";
+        }
+    }
+    if( prev_indices.size() < prev_order.size() ) {
+        LOG_WARN << "The reference tree is averaged over the remaining previous samples only, "
+                 << "and hence differs from the one of the previous matrix";
+    }
+
+    LOG_INFO << "reading " << paths.size() << " previous jplace sample files";
+    auto const sample_set = FastJplaceReader().from_files( paths );
+    assert( sample_set.size() == paths.size() );
+
+    EmdState state;
+    state.reference_tree = average_reference_tree( sample_set );
+    auto const entries = edge_matrix_cache_entries( paths );
+    state.mass_trees.resize( paths.size() );
+    #pragma omp parallel for schedule(dynamic)
+    for( size_t i = 0; i < paths.size(); ++i ) {
+        state.mass_trees[i] = mass_tree_on_reference( sample_set[i].sample, state.reference_tree );
+    }
+    state.emd = Matrix<double>( paths.size(), paths.size() );
+    for( size_t i = 0; i < paths.size(); ++i ) {
+        state.names.push_back( prev_order[ prev_indices[i] ] );
+        state.file_sizes.push_back( entries[i].size );
+        state.file_mtimes.push_back( entries[i].mtime );
+        for( size_t j = 0; j < paths.size(); ++j ) {
+            state.emd( i, j ) = prev_matrix( prev_indices[i], prev_indices[j] );
+        }
+    }
+    return state;
+}
+
+// =================================================================================================
+//     Main
+// =================================================================================================
 
 /**
  * Simple program to calculate the pairwise EMD matrix for a set of jplace files.
+ *
+ * Besides the matrix and its order list, the program writes an `emd.state` file. If that file
+ * is given as third argument in a later run, only the distances of samples that are new (or have
+ * changed) are calculated, and the matrix is extended by them. For the first update of a matrix
+ * without state file, the matrix and its order list can be given instead.
  */
 int main( int argc, char** argv )
 {
@@ -47,9 +544,10 @@ int main( int argc, char** argv )
     LOG_INFO << "Started";
 
     // Check if the command line contains the right number of arguments.
-    if (argc != 3) {
+    if( argc < 3 || argc > 5 ) {
         throw std::runtime_error(
-            "Need to provide three arguments.\n"
+            "Need to provide two to four arguments: "
+            "epadir outdir [prev_state | prev_matrix prev_order_list]\n"
         );
     }
 
@@ -66,23 +564,49 @@ int main( int argc, char** argv )
     auto jplace_filenames = utils::dir_list_files( epadir, ".*\\.jplace" );
     std::sort( jplace_filenames.begin(), jplace_filenames.end() );
 
-    LOG_INFO << "reading " << jplace_filenames.size() << " jplace sample files";
-    auto const sample_set = JplaceReader().from_files( jplace_filenames );
-    assert( sample_set.size() == jplace_filenames.size() );
-    LOG_INFO << "finished reading sample jplace files";
-    LOG_INFO;
+    LOG_INFO << "Using " << utils::Options::get().number_of_threads() << " threads.";
 
-    // -------------------------------------------------------------------------
-    //     Calc.
-    // -------------------------------------------------------------------------
+    EmdState state;
+    if( argc == 3 ) {
+        std::vector<std::string> paths;
+        std::vector<std::string> order;
+        for( auto const& fn : jplace_filenames ) {
+            paths.push_back( epadir + fn );
+            order.push_back( utils::file_filename( fn ));
+        }
 
-    LOG_INFO << "Using " << utils::Options::get().number_of_threads() << " threads.";
+        LOG_INFO << "reading " << jplace_filenames.size() << " jplace sample files";
+        auto const sample_set = FastJplaceReader().from_files( paths );
+        assert( sample_set.size() == jplace_filenames.size() );
+        LOG_INFO << "finished reading sample jplace files";
+        LOG_INFO;
 
-    LOG_INFO << "Matrix calculation started";
-    auto emd_matrix = earth_movers_distance( sample_set );
-    LOG_INFO << "Matrix calculation finished";
+        // -------------------------------------------------------------------------
+        //     Calc.
+        // -------------------------------------------------------------------------
+
+        // Same as earth_movers_distance( sample_set ), but we keep the reference tree and the
+        // mass trees for later incremental runs.
+        LOG_INFO << "Matrix calculation started";
+        state.reference_tree = average_reference_tree( sample_set );
+        add_samples_to_emd_state( state, sample_set, order, edge_matrix_cache_entries( paths ));
+        LOG_INFO << "Matrix calculation finished";
+
+    } else {
+        if( argc == 4 ) {
+            LOG_INFO << "Reading previous state";
+            state = read_emd_state( std::string( argv[3] ));
+        } else {
+            state = emd_state_from_matrix(
+                epadir, jplace_filenames, std::string( argv[3] ), std::string( argv[4] )
+            );
+        }
+        run_incremental( state, epadir, jplace_filenames );
+    }
 
-    utils::file_write( utils::to_string( emd_matrix ), outdir + "emd.mat" );
+    utils::file_write( utils::to_string( state.emd ), outdir + "emd.mat" );
+    write_order_list( state.names, outdir + "emd_order.list" );
+    write_emd_state( state, outdir + "emd.state" );
     // utils::file_write( utils::to_string( nhd_matrix ), outdir + "nhd.mat" );
 
     LOG_INFO << "Finished";
@@ -23,6 +23,12 @@
 
 #include "genesis/genesis.hpp"
 
+#include "../common/mass_trees.hpp"
+#include "../common/raster_tree_layout.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
 #include <fstream>
 #include <string>
 #include <unordered_map>
@@ -245,21 +251,20 @@ int main( int argc, char** argv )
     auto bplace_filenames = utils::dir_list_files( epadir, ".*\\.bplace" );
     std::sort( bplace_filenames.begin(), bplace_filenames.end() );
 
-    SampleSet sset;
-    SampleSerializer bplace_loader;
-
-    // Read all bplace files.
+    // Read all bplace files, and directly convert them to mass trees and imbalances.
     LOG_INFO << "Reading " << bplace_filenames.size() << " bplace sample files";
-    size_t file_cnt = 0;
-    for( auto const& bplace_filename : bplace_filenames ) {
-        // LOG_INFO << "File " << file_cnt << " : " << bplace_filename;
-        sset.add( bplace_loader.load( epadir + bplace_filename ), bplace_filename );
-        ++file_cnt;
-    }
-    // auto const sset_size = total_pquery_count( sset );
+    auto const data = load_bplace_mass_trees( epadir, bplace_filenames, true );
     LOG_INFO << "Finished reading sample bplace files";
     LOG_INFO;
 
+    // Raster quick-look layouts of the circular and rectangular centroid trees, computed once.
+    auto const raster_layout_c = make_raster_tree_layout(
+        data.reference_tree, true, tree::LayoutType::kPhylogram
+    );
+    auto const raster_layout_r = make_raster_tree_layout(
+        data.reference_tree, false, tree::LayoutType::kPhylogram
+    );
+
     // -------------------------------------------------------------------------
     //     Tree Kmeans
     // -------------------------------------------------------------------------
@@ -269,12 +274,9 @@ int main( int argc, char** argv )
 
     // Options::get().random_seed( 1623390399 );
 
-    LOG_INFO << "Converting Trees";
-    auto mass_trees = convert_sample_set_to_mass_trees( sset );
-
     LOG_INFO << "Kmeans started";
     auto mkmeans = tree::MassTreeKmeans();
-    mkmeans.run( mass_trees.first, k );
+    mkmeans.run( data.trees, k );
     LOG_INFO << "Kmeans finished";
 
     // utils::file_write( utils::to_string( emd_matrix ), outdir + "emd.mat" );
@@ -291,11 +293,11 @@ int main( int argc, char** argv )
 
     auto pqry_cnts = std::vector<size_t>( mkmeans.centroids().size(), 0 );
     for( size_t i = 0; i < massignments.size(); ++i ) {
-        file_mkmeans_ass << file_filename( sset[i].name );
+        file_mkmeans_ass << file_filename( data.names[i] );
         file_mkmeans_ass << "\t" << massignments[i];
         file_mkmeans_ass << "\n";
 
-        pqry_cnts[ massignments[i] ] += sset[i].sample.size();
+        pqry_cnts[ massignments[i] ] += data.pquery_counts[i];
     }
     file_mkmeans_ass.close();
 
@@ -315,8 +317,10 @@ int main( int argc, char** argv )
         // auto colors_per_branch = counts_to_colors( mass_tree_mass_per_edge( cent ));
 
         auto colors_per_branch = counts_to_colors( masses );
-        write_color_tree_to_nexus( sset[0].sample.tree(), colors_per_branch, outdir + "tree_emd_" + std::to_string(i) + ".nexus" );
-        write_color_tree_to_svg( sset[0].sample.tree(), colors_per_branch, outdir + "tree_emd_" + std::to_string(i) );
+        write_color_tree_to_nexus( data.reference_tree, colors_per_branch, outdir + "tree_emd_" + std::to_string(i) + ".nexus" );
+        write_color_tree_to_svg( data.reference_tree, colors_per_branch, outdir + "tree_emd_" + std::to_string(i) );
+        write_color_tree_to_bmp( raster_layout_c, colors_per_branch, outdir + "tree_emd_" + std::to_string(i) + "_c.bmp" );
+        write_color_tree_to_bmp( raster_layout_r, colors_per_branch, outdir + "tree_emd_" + std::to_string(i) + "_r.bmp" );
 
         // file_mkmeans_cent << i;
         for( auto const& mass : masses ) {
@@ -375,11 +379,11 @@ int main( int argc, char** argv )
 
     // Prepare
     LOG_INFO << "Calculating Matrix";
-    auto edge_imb_mat = epca_imbalance_matrix( sset, true );
+    auto edge_imb_mat = data.imbalances;
     auto const columns = epca_filter_constant_columns( edge_imb_mat, 0.001 );
 
     auto edge_imb_vec = std::vector<std::vector<double>>();
-    edge_imb_vec.resize( sset.size() );
+    edge_imb_vec.resize( data.names.size() );
 
     for( size_t i = 0; i < edge_imb_mat.rows(); ++i ) {
         edge_imb_vec[i].resize( edge_imb_mat.cols() );
@@ -406,7 +410,7 @@ int main( int argc, char** argv )
     file_output_stream( outdir + "/imbalance_assignments.csv",  file_ikmeans_ass );
     auto const& iassignments = ikmeans.assignments();
     for( size_t i = 0; i < iassignments.size(); ++i ) {
-        file_ikmeans_ass << file_filename( sset[i].name );
+        file_ikmeans_ass << file_filename( data.names[i] );
         file_ikmeans_ass << "\t" << iassignments[i];
         file_ikmeans_ass << "\n";
     }
@@ -429,7 +433,7 @@ int main( int argc, char** argv )
     for( size_t i = 0; i < icentroids.size(); ++i ) {
         auto const& cent = icentroids[i];
 
-        auto col_vec = std::vector<utils::Color>( sset[0].sample.tree().edge_count(), base_color );
+        auto col_vec = std::vector<utils::Color>( data.reference_tree.edge_count(), base_color );
         assert( columns.size() == cent.size() );
         for( size_t j = 0; j < columns.size(); ++j ) {
             assert( -1.0 <= cent[ j ] && cent[ j ] <= 1.0 );
@@ -439,8 +443,10 @@ int main( int argc, char** argv )
                 col_vec[ columns[j] ] = utils::gradient( n_gradient, - cent[ j ] );
             }
         }
-        write_color_tree_to_nexus( sset[0].sample.tree(), col_vec, outdir + "tree_imb_" + std::to_string(i) + ".nexus" );
-        write_color_tree_to_svg( sset[0].sample.tree(), col_vec, outdir + "tree_imb_" + std::to_string(i) );
+        write_color_tree_to_nexus( data.reference_tree, col_vec, outdir + "tree_imb_" + std::to_string(i) + ".nexus" );
+        write_color_tree_to_svg( data.reference_tree, col_vec, outdir + "tree_imb_" + std::to_string(i) );
+        write_color_tree_to_bmp( raster_layout_c, col_vec, outdir + "tree_imb_" + std::to_string(i) + "_c.bmp" );
+        write_color_tree_to_bmp( raster_layout_r, col_vec, outdir + "tree_imb_" + std::to_string(i) + "_r.bmp" );
 
         for( auto const& v : cent ) {
             if( &v != &cent[0] ) {
@@ -23,9 +23,12 @@
 
 #include "genesis/genesis.hpp"
 
+#include "../common/edge_matrices.hpp"
+
 #include <fstream>
 #include <string>
 #include <unordered_map>
+#include <utility>
 
 using namespace genesis;
 using namespace genesis::placement;
@@ -260,8 +263,16 @@ int main( int argc, char** argv )
 
     // Options::get().random_seed( 1623390399 );
 
+    // Mass trees and edge imbalances, both in one pass over the samples.
     LOG_INFO << "Converting Trees";
-    auto mass_trees = convert_sample_set_to_mass_trees( sset );
+    auto edge_mats_settings = EdgeMatricesSettings();
+    edge_mats_settings.average_tree = false;
+    edge_mats_settings.weights = false;
+    edge_mats_settings.mass_trees = true;
+    auto edge_mats = edge_matrices( sset, edge_mats_settings );
+    auto mass_trees = std::make_pair(
+        std::move( edge_mats.mass_trees ), std::move( edge_mats.total_masses )
+    );
 
     LOG_INFO << "Kmeans started";
     auto mkmeans = tree::MassTreeKmeans();
@@ -366,7 +377,7 @@ int main( int argc, char** argv )
 
     // Prepare
     LOG_INFO << "Calculating Matrix";
-    auto edge_imb_mat = epca_imbalance_matrix( sset, true );
+    auto edge_imb_mat = std::move( edge_mats.imbalances );
     auto const columns = epca_filter_constant_columns( edge_imb_mat, 0.001 );
 
     auto edge_imb_vec = std::vector<std::vector<double>>();
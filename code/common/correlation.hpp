@@ -0,0 +1,253 @@
+#ifndef PLACEMENT_METHODS_COMMON_CORRELATION_H_
+#define PLACEMENT_METHODS_COMMON_CORRELATION_H_
+
+/*
+    Genesis - A toolkit for working with phylogenetic data.
+    Copyright (C) 2014-2018 Lucas Czech and HITS gGmbH
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lucas.czech@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+/*
+    Correlation of many columns at once, shared by correlation_trees, jplace_analysis_server and
+    the phylofactor programs. Include this after genesis.
+*/
+
+#include "genesis/genesis.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+// =================================================================================================
+//     Standardized Columns
+// =================================================================================================
+
+/**
+ * @brief Indices of the rows that are set in a @p mask.
+ */
+inline std::vector<size_t> valid_mask_rows( std::vector<uint64_t> const& mask )
+{
+    std::vector<size_t> result;
+    for( size_t w = 0; w < mask.size(); ++w ) {
+        for( size_t b = 0; b < 64; ++b ) {
+            if( mask[w] & ( uint64_t( 1 ) << b )) {
+                result.push_back( w * 64 + b );
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Values and fractional ranks of the columns of a matrix, restricted to some rows,
+ * and standardized, as used for Pearson's and Spearman's correlation, respectively.
+ *
+ * Both are transposed, with one row per column of the input, so that the correlation
+ * between two columns is a dot product of two contiguous rows, divided by the number of rows.
+ * Columns with zero variance are set to NaN, as their correlation is undefined.
+ */
+struct StandardizedColumns
+{
+    genesis::utils::Matrix<double> values;
+    genesis::utils::Matrix<double> ranks;
+};
+
+/**
+ * @brief Replace the @p n values by their fractional ranks, with ties getting the average of
+ * their ranks. The @p order is scratch space.
+ */
+inline void fractional_ranks( double const* values, double* ranks, size_t n, std::vector<size_t>& order )
+{
+    order.resize( n );
+    std::iota( order.begin(), order.end(), 0 );
+    std::sort( order.begin(), order.end(), [&]( size_t l, size_t r ){
+        return values[l] < values[r];
+    });
+    size_t i = 0;
+    while( i < n ) {
+        size_t j = i + 1;
+        while( j < n && values[ order[j] ] == values[ order[i] ] ) {
+            ++j;
+        }
+        auto const rank = static_cast<double>( i + j + 1 ) / 2.0;
+        for( size_t k = i; k < j; ++k ) {
+            ranks[ order[k] ] = rank;
+        }
+        i = j;
+    }
+}
+
+/**
+ * @brief Center the @p n values, and scale them to unit (population) standard deviation,
+ * or set them to NaN if they are constant.
+ */
+inline void standardize_values( double* values, size_t n )
+{
+    double mean = 0.0;
+    for( size_t i = 0; i < n; ++i ) {
+        mean += values[i];
+    }
+    mean /= static_cast<double>( n );
+    double var = 0.0;
+    for( size_t i = 0; i < n; ++i ) {
+        values[i] -= mean;
+        var += values[i] * values[i];
+    }
+    auto const stddev = std::sqrt( var / static_cast<double>( n ));
+    for( size_t i = 0; i < n; ++i ) {
+        values[i] = ( stddev > 0.0 ? values[i] / stddev : std::numeric_limits<double>::quiet_NaN() );
+    }
+}
+
+/**
+ * @brief Standardized values and ranks of @p num_cols columns, whose values in the given
+ * @p rows are gathered by @p get_value( column, row ).
+ */
+template<class GetValue>
+StandardizedColumns standardized_columns(
+    size_t num_cols,
+    std::vector<size_t> const& rows,
+    GetValue get_value
+) {
+    auto const n = rows.size();
+    StandardizedColumns result;
+    result.values = genesis::utils::Matrix<double>( num_cols, n );
+    result.ranks  = genesis::utils::Matrix<double>( num_cols, n );
+    if( n == 0 ) {
+        return result;
+    }
+
+    #pragma omp parallel
+    {
+        std::vector<size_t> order;
+
+        #pragma omp for
+        for( size_t c = 0; c < num_cols; ++c ) {
+            auto values = &result.values( c, 0 );
+            auto ranks  = &result.ranks( c, 0 );
+            for( size_t i = 0; i < n; ++i ) {
+                values[i] = get_value( c, rows[i] );
+            }
+            fractional_ranks( values, ranks, n, order );
+            standardize_values( values, n );
+            standardize_values( ranks, n );
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Standardized values and ranks of all columns of @p data, using only the given @p rows.
+ */
+inline StandardizedColumns standardized_columns(
+    genesis::utils::Matrix<double> const& data,
+    std::vector<size_t> const& rows
+) {
+    return standardized_columns( data.cols(), rows, [&]( size_t c, size_t r ){
+        return data( r, c );
+    });
+}
+
+// =================================================================================================
+//     Correlation
+// =================================================================================================
+
+/**
+ * @brief Correlation coefficients between all rows of @p xs and all rows of @p ys, which are
+ * standardized columns, as a `xs.rows() x ys.rows()` matrix.
+ *
+ * As the rows are standardized, each coefficient is the dot product of two rows, divided by their
+ * length. This is a plain triple loop, parallel over blocks of 64 rows of @p xs, so that a block
+ * stays in cache while it is multiplied with all rows of @p ys.
+ */
+inline genesis::utils::Matrix<double> standardized_correlations(
+    genesis::utils::Matrix<double> const& xs,
+    genesis::utils::Matrix<double> const& ys
+) {
+    if( xs.cols() != ys.cols() ) {
+        throw std::runtime_error( "Cannot correlate matrices with different number of rows." );
+    }
+    auto const len = xs.cols();
+    auto const n = static_cast<double>( len );
+
+    auto result = genesis::utils::Matrix<double>( xs.rows(), ys.rows(), 0.0 );
+    size_t const block_size = 64;
+    auto const num_blocks = ( xs.rows() + block_size - 1 ) / block_size;
+
+    #pragma omp parallel for schedule(dynamic)
+    for( size_t b = 0; b < num_blocks; ++b ) {
+        auto const beg = b * block_size;
+        auto const end = std::min( beg + block_size, xs.rows() );
+        for( size_t j = 0; j < ys.rows(); ++j ) {
+            for( size_t i = beg; i < end; ++i ) {
+                double sum = 0.0;
+                for( size_t k = 0; k < len; ++k ) {
+                    sum += xs( i, k ) * ys( j, k );
+                }
+                result( i, j ) = sum / n;
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Correlation coefficients between all columns of @p x and all columns of @p y,
+ * using only the given @p rows, as a `x.cols() x y.cols()` matrix.
+ *
+ * Pearson's correlation, or Spearman's rank correlation if @p use_ranks is set. Each column is
+ * ranked and standardized only once, instead of once per pair of columns.
+ */
+inline genesis::utils::Matrix<double> correlation_matrix(
+    genesis::utils::Matrix<double> const& x,
+    genesis::utils::Matrix<double> const& y,
+    std::vector<size_t> const& rows,
+    bool use_ranks
+) {
+    if( x.rows() != y.rows() ) {
+        throw std::runtime_error( "Cannot correlate matrices with different number of rows." );
+    }
+    auto const xs = standardized_columns( x, rows );
+    auto const ys = standardized_columns( y, rows );
+    if( use_ranks ) {
+        return standardized_correlations( xs.ranks, ys.ranks );
+    }
+    return standardized_correlations( xs.values, ys.values );
+}
+
+/**
+ * @brief Correlation coefficients between all columns of @p x and all columns of @p y,
+ * using all rows.
+ */
+inline genesis::utils::Matrix<double> correlation_matrix(
+    genesis::utils::Matrix<double> const& x,
+    genesis::utils::Matrix<double> const& y,
+    bool use_ranks
+) {
+    auto rows = std::vector<size_t>( x.rows() );
+    std::iota( rows.begin(), rows.end(), 0 );
+    return correlation_matrix( x, y, rows, use_ranks );
+}
+
+#endif // include guard
@@ -0,0 +1,181 @@
+#ifndef PLACEMENT_METHODS_COMMON_EDGE_MATRICES_H_
+#define PLACEMENT_METHODS_COMMON_EDGE_MATRICES_H_
+
+/*
+    Genesis - A toolkit for working with phylogenetic data.
+    Copyright (C) 2014-2018 Lucas Czech and HITS gGmbH
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lucas.czech@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+/*
+    Per-edge quantities of a SampleSet in one pass, shared by the kmeans, squash and correlation
+    programs, and jplace_analysis_server. Include this after genesis.
+*/
+
+#include "genesis/genesis.hpp"
+
+#include "mass_trees.hpp"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+//     Edge Matrices
+// =================================================================================================
+
+/**
+ * @brief Select which of the per-edge quantities edge_matrices() computes.
+ */
+struct EdgeMatricesSettings
+{
+    bool average_tree = true;
+    bool imbalances   = true;
+    bool weights      = true;
+    bool mass_trees   = false;
+};
+
+/**
+ * @brief Per-edge quantities of all samples of a SampleSet.
+ */
+struct EdgeMatrices
+{
+    // Tree with the branch lengths averaged over all samples, as average_branch_length_tree().
+    genesis::tree::Tree average_tree;
+
+    // Samples x edges, as epca_imbalance_matrix( sample_set, true ).
+    genesis::utils::Matrix<double> imbalances;
+
+    // Samples x edges, as placement_weight_per_edge( sample_set ).
+    genesis::utils::Matrix<double> weights;
+
+    // Per sample, as convert_sample_set_to_mass_trees( sample_set ), that is, all on the
+    // average branch length tree.
+    std::vector<genesis::tree::MassTree> mass_trees;
+    std::vector<double> total_masses;
+};
+
+/**
+ * @brief Compute the selected per-edge quantities of all samples in one parallel pass over
+ * the samples, instead of one full pass per quantity, filling the matrices directly.
+ *
+ * The mass trees are converted per sample first, and moved to the average branch lengths at
+ * the end, so that they are the same as the ones of convert_sample_set_to_mass_trees().
+ */
+inline EdgeMatrices edge_matrices(
+    genesis::placement::SampleSet const& sample_set,
+    EdgeMatricesSettings const& settings = EdgeMatricesSettings()
+) {
+    EdgeMatrices result;
+    if( sample_set.size() == 0 ) {
+        return result;
+    }
+
+    auto const& first_tree = sample_set[0].sample.tree();
+    auto const num_samples = sample_set.size();
+    auto const num_edges = first_tree.edge_count();
+
+    if( settings.imbalances ) {
+        result.imbalances = genesis::utils::Matrix<double>( num_samples, num_edges, 0.0 );
+    }
+    if( settings.weights ) {
+        result.weights = genesis::utils::Matrix<double>( num_samples, num_edges, 0.0 );
+    }
+    if( settings.mass_trees ) {
+        result.mass_trees.resize( num_samples );
+        result.total_masses.resize( num_samples );
+    }
+    // The mass trees need the average branch lengths as well.
+    bool const with_lengths = settings.average_tree || settings.mass_trees;
+    auto branch_length_sums = std::vector<double>( with_lengths ? num_edges : 0, 0.0 );
+
+    // We cannot throw from within the parallel region, so just note the sample that went wrong.
+    std::string error_name;
+
+    #pragma omp parallel
+    {
+        // Branch length sums per thread, which are added up at the end.
+        auto local_sums = std::vector<double>( branch_length_sums.size(), 0.0 );
+
+        #pragma omp for schedule(dynamic)
+        for( size_t i = 0; i < num_samples; ++i ) {
+            auto const& smp = sample_set[i];
+            if( ! genesis::placement::compatible_trees( first_tree, smp.sample.tree() )) {
+                #pragma omp critical(edge_matrices_error)
+                {
+                    error_name = smp.name;
+                }
+                continue;
+            }
+
+            if( with_lengths ) {
+                for( size_t e = 0; e < num_edges; ++e ) {
+                    auto const& edge = smp.sample.tree().edge_at( e );
+                    local_sums[e] += edge.data<genesis::tree::DefaultEdgeData>().branch_length;
+                }
+            }
+            if( settings.imbalances ) {
+                auto const imbalance_vec = genesis::placement::epca_imbalance_vector( smp.sample, true );
+                for( size_t e = 0; e < num_edges; ++e ) {
+                    result.imbalances( i, e ) = imbalance_vec[e];
+                }
+            }
+            if( settings.weights ) {
+                for( auto const& pquery : smp.sample ) {
+                    for( auto const& placement : pquery.placements() ) {
+                        result.weights( i, placement.edge().index() ) += placement.like_weight_ratio;
+                    }
+                }
+            }
+            if( settings.mass_trees ) {
+                auto mass_tree = genesis::placement::convert_sample_to_mass_tree( smp.sample );
+                result.mass_trees[i]   = std::move( mass_tree.first );
+                result.total_masses[i] = mass_tree.second;
+            }
+        }
+
+        #pragma omp critical(edge_matrices_sums)
+        {
+            for( size_t e = 0; e < local_sums.size(); ++e ) {
+                branch_length_sums[e] += local_sums[e];
+            }
+        }
+    }
+    if( ! error_name.empty() ) {
+        throw std::runtime_error( "Sample " + error_name + " is placed on a different tree." );
+    }
+
+    for( auto& sum : branch_length_sums ) {
+        sum /= static_cast<double>( num_samples );
+    }
+    if( settings.average_tree ) {
+        result.average_tree = first_tree;
+        for( size_t e = 0; e < num_edges; ++e ) {
+            auto& edge_data = result.average_tree.edge_at( e ).data<genesis::tree::DefaultEdgeData>();
+            edge_data.branch_length = branch_length_sums[e];
+        }
+    }
+    if( settings.mass_trees ) {
+        mass_trees_to_branch_lengths( result.mass_trees, branch_length_sums );
+    }
+    return result;
+}
+
+#endif // include guard
@@ -0,0 +1,584 @@
+#ifndef PLACEMENT_METHODS_COMMON_EDGE_MATRIX_CACHE_H_
+#define PLACEMENT_METHODS_COMMON_EDGE_MATRIX_CACHE_H_
+
+/*
+    Genesis - A toolkit for working with phylogenetic data.
+    Copyright (C) 2014-2018 Lucas Czech and HITS gGmbH
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lucas.czech@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+/*
+    Persistent cache of the per-sample edge matrices of a set of jplace files,
+    shared by the programs that work on the same files.
+    Include this after genesis; it works with genesis v0.19 as well as v0.21.
+*/
+
+#include "genesis/genesis.hpp"
+
+#include "fast_jplace_reader.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+// =================================================================================================
+//     Edge Matrix Cache
+// =================================================================================================
+
+/**
+ * @brief Per-sample edge matrices of a set of jplace files, as stored in the edge matrix cache.
+ *
+ * The cache is shared by the programs that work on the same jplace files (phylo_factor,
+ * correlation_trees, dispersion_trees, jplace_epca_vis), so that the files only need to be read
+ * and reduced to their per-edge values once. All of them include this header, so that they
+ * agree on the file layout; change edge_matrix_cache_version when changing it.
+ */
+struct EdgeMatrixCache
+{
+    // Reference tree of the first sample, with its original branch lengths.
+    genesis::placement::PlacementTree tree;
+
+    // Same tree, but with the branch lengths averaged over all samples.
+    genesis::placement::PlacementTree average_tree;
+
+    // File names of the samples, without directory and extension, in the order of the rows.
+    std::vector<std::string> sample_names;
+
+    // Samples x edges, for the edge indices of the tree:
+    // Placement masses, that is, like_weight_ratio times the multiplicity of the pquery,
+    // placement weights (like_weight_ratio only) as placement_weight_per_edge(),
+    // and edge imbalances including the leaf edges, as epca_imbalance_vector().
+    genesis::utils::Matrix<double> masses;
+    genesis::utils::Matrix<double> weights;
+    genesis::utils::Matrix<double> imbalances;
+};
+
+/**
+ * @brief Select which of the matrices edge_matrix_cache() loads.
+ */
+struct EdgeMatrixCacheSelection
+{
+    bool masses     = true;
+    bool weights    = true;
+    bool imbalances = true;
+};
+
+// File layout. All integers and doubles are in native byte order, and all sections start at
+// offsets that are multiples of 8, so that the matrices can be mapped into memory directly.
+//
+//     header:     char[8] magic, uint64 version, uint64 samples, uint64 edges,
+//                 uint64 offsets of the tree, branch lengths, masses, weights,
+//                 and imbalances sections
+//     samples:    per sample uint64 file size, int64 file mtime in ns, uint64 path length, path
+//     tree:       uint64 length, newick string with edge nums, of the first sample
+//     lengths:    edges doubles, the branch lengths averaged over all samples, ordered by edge num
+//     matrices:   samples x edges doubles each, row-major, columns ordered by edge num
+//
+// The sample entries are the key of the cache: if any input file changes in path, size, or
+// modification time, or files are added or removed, the cache is rebuilt.
+char const edge_matrix_cache_magic[8] = { 'P', 'M', 'E', 'D', 'G', 'M', 'A', 'T' };
+uint64_t const edge_matrix_cache_version = 2;
+
+struct EdgeMatrixCacheEntry
+{
+    std::string path;
+    uint64_t    size;
+    int64_t     mtime;
+};
+
+inline std::vector<EdgeMatrixCacheEntry> edge_matrix_cache_entries( std::vector<std::string> const& files )
+{
+    auto result = std::vector<EdgeMatrixCacheEntry>( files.size() );
+    for( size_t i = 0; i < files.size(); ++i ) {
+        struct stat st;
+        if( stat( files[i].c_str(), &st ) != 0 ) {
+            throw std::runtime_error( "Cannot stat file " + files[i] );
+        }
+
+        // Use the full resolution of the modification time, so that files that are rewritten
+        // within the same second with the same size are still noticed.
+#if defined( __APPLE__ )
+        auto const& mtime = st.st_mtimespec;
+#else
+        auto const& mtime = st.st_mtim;
+#endif
+        result[i].path  = files[i];
+        result[i].size  = static_cast<uint64_t>( st.st_size );
+        result[i].mtime = static_cast<int64_t>( mtime.tv_sec ) * 1000000000 + mtime.tv_nsec;
+    }
+    return result;
+}
+
+/**
+ * @brief Path of the cache file for the jplace @p files, or an empty string if caching is off.
+ *
+ * The cache is only used if the environment variable `EDGE_MATRIX_CACHE_DIR` is set, and never
+ * written to the directory of the jplace files. The file name contains a hash of the list of
+ * files, so that programs that read different files from the same directory, for instance
+ * recursively or not, each get their own cache, instead of overwriting each other's.
+ */
+inline std::string edge_matrix_cache_file( std::vector<std::string> const& files )
+{
+    auto const dir = std::getenv( "EDGE_MATRIX_CACHE_DIR" );
+    if( ! dir || ! *dir ) {
+        return std::string();
+    }
+
+    // 64 bit FNV-1a hash of the file paths, each terminated by a newline.
+    uint64_t hash = 14695981039346656037ull;
+    for( auto const& file : files ) {
+        for( auto const c : file + "\n" ) {
+            hash ^= static_cast<unsigned char>( c );
+            hash *= 1099511628211ull;
+        }
+    }
+    char name[40];
+    std::snprintf(
+        name, sizeof( name ), "edge_matrix_%016llx.cache", static_cast<unsigned long long>( hash )
+    );
+    return genesis::utils::dir_normalize_path( dir ) + name;
+}
+
+/**
+ * @brief Column of each edge index of the @p tree in the cache matrices, that is, its edge num.
+ */
+inline std::vector<size_t> edge_matrix_cache_columns( genesis::placement::PlacementTree const& tree )
+{
+    auto result = std::vector<size_t>( tree.edge_count() );
+    auto seen = std::vector<bool>( tree.edge_count(), false );
+    for( size_t e = 0; e < tree.edge_count(); ++e ) {
+        auto const num = tree.edge_at( e ).data<genesis::placement::PlacementEdgeData>().edge_num();
+        if( num < 0 || static_cast<size_t>( num ) >= tree.edge_count() || seen[ num ] ) {
+            throw std::runtime_error( "Edge nums of the reference tree are not consecutive." );
+        }
+        seen[ num ] = true;
+        result[e] = static_cast<size_t>( num );
+    }
+    return result;
+}
+
+template<typename T>
+void edge_matrix_cache_write_( std::ostream& os, T const& value )
+{
+    os.write( reinterpret_cast<char const*>( &value ), sizeof( T ));
+}
+
+template<typename T>
+bool edge_matrix_cache_read_( std::istream& is, T& value )
+{
+    is.read( reinterpret_cast<char*>( &value ), sizeof( T ));
+    return static_cast<bool>( is );
+}
+
+inline void edge_matrix_cache_write_string_( std::ostream& os, std::string const& str )
+{
+    edge_matrix_cache_write_( os, static_cast<uint64_t>( str.size() ));
+    os.write( str.data(), str.size() );
+    auto const padding = ( 8 - str.size() % 8 ) % 8;
+    os.write( "\0\0\0\0\0\0\0", padding );
+}
+
+inline bool edge_matrix_cache_read_string_( std::istream& is, std::string& str )
+{
+    uint64_t size;
+    if( ! edge_matrix_cache_read_( is, size ) || size > ( 1ull << 32 )) {
+        return false;
+    }
+    str.resize( size );
+    is.read( &str[0], size );
+    is.ignore(( 8 - size % 8 ) % 8 );
+    return static_cast<bool>( is );
+}
+
+inline genesis::placement::PlacementTree edge_matrix_cache_read_newick_( std::string const& newick )
+{
+    // See fast_jplace_reader.hpp for the two genesis versions.
+#if defined( GENESIS_UTILS_IO_INPUT_SOURCE_H_ )
+    return genesis::placement::PlacementTreeNewickReader().read( genesis::utils::from_string( newick ));
+#else
+    return genesis::placement::PlacementTreeNewickReader().from_string( newick );
+#endif
+}
+
+/**
+ * @brief Copy of the @p tree, with the branch lengths set to the @p lengths of each edge index.
+ */
+inline genesis::placement::PlacementTree edge_matrix_cache_average_tree_(
+    genesis::placement::PlacementTree const& tree,
+    std::vector<double> const& lengths
+) {
+    assert( lengths.size() == tree.edge_count() );
+    auto result = tree;
+    for( size_t e = 0; e < result.edge_count(); ++e ) {
+        result.edge_at( e ).data<genesis::placement::PlacementEdgeData>().branch_length = lengths[e];
+    }
+    return result;
+}
+
+/**
+ * @brief Read the jplace @p files one by one in parallel, and reduce each of them to its
+ * rows of the cache matrices right away, so that only one sample per thread is in memory.
+ */
+inline EdgeMatrixCache build_edge_matrix_cache( std::vector<std::string> const& files )
+{
+    using namespace genesis::placement;
+    if( files.empty() ) {
+        throw std::runtime_error( "No jplace files given." );
+    }
+
+    // Use the first sample for the reference tree that is shared by all rows. The reader parses
+    // that tree only once, and copies it for all further samples that are placed on it.
+    FastJplaceReader reader;
+    EdgeMatrixCache result;
+    auto first = reader.from_file( files[0] );
+    result.tree = first.tree();
+    auto const num_edges = result.tree.edge_count();
+
+    result.sample_names = std::vector<std::string>( files.size() );
+    result.masses       = genesis::utils::Matrix<double>( files.size(), num_edges, 0.0 );
+    result.weights      = genesis::utils::Matrix<double>( files.size(), num_edges, 0.0 );
+    result.imbalances   = genesis::utils::Matrix<double>( files.size(), num_edges, 0.0 );
+    auto branch_length_sums = std::vector<double>( num_edges, 0.0 );
+
+    // Reduce a sample to its row i of the matrices, and add its branch lengths to the sums.
+    auto add_sample = [&]( size_t i, Sample const& sample, std::vector<double>& sums ){
+        result.sample_names[i] = genesis::utils::file_filename(
+            genesis::utils::file_basename( files[i] )
+        );
+        for( size_t e = 0; e < num_edges; ++e ) {
+            sums[e] += sample.tree().edge_at( e ).data<PlacementEdgeData>().branch_length;
+        }
+        for( auto const& pquery : sample ) {
+            auto const mult = total_multiplicity( pquery );
+            for( auto const& placement : pquery.placements() ) {
+                auto const eidx = placement.edge().index();
+                result.masses( i, eidx )  += placement.like_weight_ratio * mult;
+                result.weights( i, eidx ) += placement.like_weight_ratio;
+            }
+        }
+        // The imbalances are taken from genesis as they are, instead of a batch kernel over the
+        // masses matrix, so that they are exactly the ones that epca() uses.
+        auto const imbalance_vec = epca_imbalance_vector( sample, true );
+        for( size_t e = 0; e < num_edges; ++e ) {
+            result.imbalances( i, e ) = imbalance_vec[e];
+        }
+    };
+
+    // The first sample is already read, so we use it as the first row right away.
+    add_sample( 0, first, branch_length_sums );
+    first = Sample();
+
+    // We cannot throw from within the parallel region, so just note what went wrong.
+    std::string error_msg;
+
+    #pragma omp parallel
+    {
+        auto local_sums = std::vector<double>( num_edges, 0.0 );
+
+        #pragma omp for schedule(dynamic)
+        for( size_t i = 1; i < files.size(); ++i ) {
+            Sample sample;
+            try {
+                sample = reader.from_file( files[i] );
+            } catch( std::exception const& ex ) {
+                #pragma omp critical(edge_matrix_cache_error)
+                {
+                    error_msg = ex.what();
+                }
+                continue;
+            }
+            if( ! compatible_trees( result.tree, sample.tree() )) {
+                #pragma omp critical(edge_matrix_cache_error)
+                {
+                    error_msg = "Sample " + files[i] + " is placed on a different tree.";
+                }
+                continue;
+            }
+            add_sample( i, sample, local_sums );
+        }
+
+        #pragma omp critical(edge_matrix_cache_sums)
+        {
+            for( size_t e = 0; e < num_edges; ++e ) {
+                branch_length_sums[e] += local_sums[e];
+            }
+        }
+    }
+    if( ! error_msg.empty() ) {
+        throw std::runtime_error( error_msg );
+    }
+
+    for( auto& sum : branch_length_sums ) {
+        sum /= static_cast<double>( files.size() );
+    }
+    result.average_tree = edge_matrix_cache_average_tree_( result.tree, branch_length_sums );
+    return result;
+}
+
+/**
+ * @brief Create an empty temporary file next to @p cache_file, with a unique name, so that
+ * concurrent writers of the same cache do not write into the same temporary file.
+ */
+inline std::string edge_matrix_cache_temp_file_( std::string const& cache_file )
+{
+    auto name = std::vector<char>( cache_file.begin(), cache_file.end() );
+    std::string const suffix = ".tmp.XXXXXX";
+    name.insert( name.end(), suffix.begin(), suffix.end() );
+    name.push_back( '\0' );
+
+    // mkstemp() creates the file with mode 0600, but the cache is meant to be shared.
+    int const fd = mkstemp( name.data() );
+    if( fd < 0 ) {
+        throw std::runtime_error( "Cannot write edge matrix cache " + cache_file );
+    }
+    fchmod( fd, 0644 );
+    close( fd );
+    return std::string( name.data() );
+}
+
+/**
+ * @brief Write the cache file, via a temporary file, so that a concurrently running program
+ * never sees an incomplete cache.
+ */
+inline void write_edge_matrix_cache(
+    EdgeMatrixCache const& cache,
+    std::vector<EdgeMatrixCacheEntry> const& entries,
+    std::string const& cache_file
+) {
+    using namespace genesis::placement;
+    assert( entries.size() == cache.sample_names.size() );
+    auto const num_samples = cache.sample_names.size();
+    auto const num_edges = cache.tree.edge_count();
+    auto const columns = edge_matrix_cache_columns( cache.tree );
+
+    auto const tmp_file = edge_matrix_cache_temp_file_( cache_file );
+    std::ofstream os( tmp_file, std::ios::binary | std::ios::trunc );
+    if( ! os ) {
+        std::remove( tmp_file.c_str() );
+        throw std::runtime_error( "Cannot write edge matrix cache " + tmp_file );
+    }
+
+    // Header, with the offsets filled in at the end.
+    os.write( edge_matrix_cache_magic, 8 );
+    edge_matrix_cache_write_( os, edge_matrix_cache_version );
+    edge_matrix_cache_write_( os, static_cast<uint64_t>( num_samples ));
+    edge_matrix_cache_write_( os, static_cast<uint64_t>( num_edges ));
+    auto const offsets_pos = os.tellp();
+    auto offsets = std::vector<uint64_t>( 5, 0 );
+    for( auto const offset : offsets ) {
+        edge_matrix_cache_write_( os, offset );
+    }
+
+    for( auto const& entry : entries ) {
+        edge_matrix_cache_write_( os, entry.size );
+        edge_matrix_cache_write_( os, entry.mtime );
+        edge_matrix_cache_write_string_( os, entry.path );
+    }
+
+    offsets[0] = static_cast<uint64_t>( os.tellp() );
+    edge_matrix_cache_write_string_( os, PlacementTreeNewickWriter().to_string( cache.tree ));
+
+    // Average branch lengths and matrices, with the columns ordered by edge num.
+    auto row = std::vector<double>( num_edges );
+    offsets[1] = static_cast<uint64_t>( os.tellp() );
+    for( size_t e = 0; e < num_edges; ++e ) {
+        row[ columns[e] ] = cache.average_tree.edge_at( e ).data<PlacementEdgeData>().branch_length;
+    }
+    os.write( reinterpret_cast<char const*>( row.data() ), num_edges * sizeof( double ));
+    size_t m = 2;
+    for( auto const* mat : { &cache.masses, &cache.weights, &cache.imbalances } ) {
+        assert( mat->rows() == num_samples && mat->cols() == num_edges );
+        offsets[ m++ ] = static_cast<uint64_t>( os.tellp() );
+        for( size_t r = 0; r < num_samples; ++r ) {
+            for( size_t e = 0; e < num_edges; ++e ) {
+                row[ columns[e] ] = (*mat)( r, e );
+            }
+            os.write( reinterpret_cast<char const*>( row.data() ), num_edges * sizeof( double ));
+        }
+    }
+
+    os.seekp( offsets_pos );
+    for( auto const offset : offsets ) {
+        edge_matrix_cache_write_( os, offset );
+    }
+    os.close();
+    if( ! os || std::rename( tmp_file.c_str(), cache_file.c_str() ) != 0 ) {
+        std::remove( tmp_file.c_str() );
+        throw std::runtime_error( "Cannot write edge matrix cache " + cache_file );
+    }
+}
+
+/**
+ * @brief Read the cache file, if it exists and was made from exactly the files of @p entries.
+ * Returns `false` otherwise, in which case the cache needs to be rebuilt.
+ */
+inline bool read_edge_matrix_cache(
+    std::string const& cache_file,
+    std::vector<EdgeMatrixCacheEntry> const& entries,
+    EdgeMatrixCacheSelection const& selection,
+    EdgeMatrixCache& cache
+) {
+    std::ifstream is( cache_file, std::ios::binary );
+    if( ! is ) {
+        return false;
+    }
+
+    // Header.
+    char magic[8];
+    uint64_t version, num_samples, num_edges;
+    auto offsets = std::vector<uint64_t>( 5 );
+    is.read( magic, 8 );
+    if(
+        ! is || ! std::equal( magic, magic + 8, edge_matrix_cache_magic ) ||
+        ! edge_matrix_cache_read_( is, version ) || version != edge_matrix_cache_version ||
+        ! edge_matrix_cache_read_( is, num_samples ) || num_samples != entries.size() ||
+        ! edge_matrix_cache_read_( is, num_edges )
+    ) {
+        return false;
+    }
+    for( auto& offset : offsets ) {
+        if( ! edge_matrix_cache_read_( is, offset ) || offset % 8 != 0 ) {
+            return false;
+        }
+    }
+
+    // Compare the sample entries to the current files.
+    for( auto const& entry : entries ) {
+        EdgeMatrixCacheEntry cached;
+        if(
+            ! edge_matrix_cache_read_( is, cached.size ) ||
+            ! edge_matrix_cache_read_( is, cached.mtime ) ||
+            ! edge_matrix_cache_read_string_( is, cached.path ) ||
+            cached.path != entry.path || cached.size != entry.size || cached.mtime != entry.mtime
+        ) {
+            return false;
+        }
+    }
+
+    // Tree. Its edge indices might differ from the ones of the tree that was written,
+    // so we get the matrix columns via the edge nums.
+    std::string newick;
+    is.seekg( offsets[0] );
+    if( ! edge_matrix_cache_read_string_( is, newick )) {
+        return false;
+    }
+    cache.tree = edge_matrix_cache_read_newick_( newick );
+    if( cache.tree.edge_count() != num_edges ) {
+        return false;
+    }
+    auto const columns = edge_matrix_cache_columns( cache.tree );
+
+    // Average branch lengths.
+    auto row = std::vector<double>( num_edges );
+    auto lengths = std::vector<double>( num_edges );
+    is.seekg( offsets[1] );
+    is.read( reinterpret_cast<char*>( row.data() ), num_edges * sizeof( double ));
+    if( ! is ) {
+        return false;
+    }
+    for( size_t e = 0; e < num_edges; ++e ) {
+        lengths[e] = row[ columns[e] ];
+    }
+    cache.average_tree = edge_matrix_cache_average_tree_( cache.tree, lengths );
+
+    // Matrices, only the selected ones.
+    auto read_matrix = [&]( uint64_t offset, genesis::utils::Matrix<double>& mat ){
+        is.seekg( offset );
+        mat = genesis::utils::Matrix<double>( num_samples, num_edges );
+        for( size_t r = 0; r < num_samples; ++r ) {
+            is.read( reinterpret_cast<char*>( row.data() ), num_edges * sizeof( double ));
+            for( size_t e = 0; e < num_edges; ++e ) {
+                mat( r, e ) = row[ columns[e] ];
+            }
+        }
+        return static_cast<bool>( is );
+    };
+    if(
+        ( selection.masses     && ! read_matrix( offsets[2], cache.masses )) ||
+        ( selection.weights    && ! read_matrix( offsets[3], cache.weights )) ||
+        ( selection.imbalances && ! read_matrix( offsets[4], cache.imbalances ))
+    ) {
+        return false;
+    }
+
+    cache.sample_names = std::vector<std::string>( entries.size() );
+    for( size_t i = 0; i < entries.size(); ++i ) {
+        cache.sample_names[i] = genesis::utils::file_filename(
+            genesis::utils::file_basename( entries[i].path )
+        );
+    }
+    return true;
+}
+
+/**
+ * @brief Get the edge matrices of the jplace @p files, from their cache file if it is up to
+ * date, or otherwise by reading the files, in which case the cache file is (re)written.
+ *
+ * See edge_matrix_cache_file() for where the cache is stored. If caching is off,
+ * the files are simply read.
+ */
+inline EdgeMatrixCache edge_matrix_cache(
+    std::vector<std::string> const& files,
+    EdgeMatrixCacheSelection const& selection = EdgeMatrixCacheSelection()
+) {
+    auto const cache_file = edge_matrix_cache_file( files );
+
+    EdgeMatrixCache result;
+    if( cache_file.empty() ) {
+        LOG_INFO << "Reading " << files.size() << " jplace files";
+        result = build_edge_matrix_cache( files );
+    } else {
+        auto const entries = edge_matrix_cache_entries( files );
+        if( read_edge_matrix_cache( cache_file, entries, selection, result )) {
+            LOG_INFO << "Using edge matrix cache " << cache_file;
+            return result;
+        }
+
+        LOG_INFO << "Reading " << files.size() << " jplace files into edge matrix cache " << cache_file;
+        result = build_edge_matrix_cache( files );
+        try {
+            write_edge_matrix_cache( result, entries, cache_file );
+        } catch( std::exception const& ex ) {
+            LOG_WARN << ex.what();
+        }
+    }
+
+    if( ! selection.masses ) {
+        result.masses = genesis::utils::Matrix<double>();
+    }
+    if( ! selection.weights ) {
+        result.weights = genesis::utils::Matrix<double>();
+    }
+    if( ! selection.imbalances ) {
+        result.imbalances = genesis::utils::Matrix<double>();
+    }
+    return result;
+}
+
+#endif // include guard
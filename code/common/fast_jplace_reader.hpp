@@ -0,0 +1,694 @@
+#ifndef PLACEMENT_METHODS_COMMON_FAST_JPLACE_READER_H_
+#define PLACEMENT_METHODS_COMMON_FAST_JPLACE_READER_H_
+
+/*
+    Genesis - A toolkit for working with phylogenetic data.
+    Copyright (C) 2014-2018 Lucas Czech and HITS gGmbH
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lucas.czech@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+/*
+    Fast reading of jplace files, shared by the programs that load many of them.
+    Include this after genesis; it works with genesis v0.19 as well as v0.21.
+*/
+
+#include "genesis/genesis.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// =================================================================================================
+//     Jplace Scanner
+// =================================================================================================
+
+/**
+ * @brief Minimal JSON scanner over the text of a jplace file.
+ *
+ * It offers just what is needed to read a jplace file without building a JSON document first:
+ * reading strings and numbers in place, and skipping the values that we are not interested in.
+ */
+class JplaceScanner
+{
+public:
+
+    JplaceScanner( std::string const& text, std::string const& source )
+        : text_( text )
+        , source_( source )
+    {}
+
+    size_t position() const
+    {
+        return pos_;
+    }
+
+    void position( size_t pos )
+    {
+        pos_ = pos;
+    }
+
+    std::string const& source() const
+    {
+        return source_;
+    }
+
+    char peek()
+    {
+        while( pos_ < text_.size() && std::isspace( static_cast<unsigned char>( text_[ pos_ ] ))) {
+            ++pos_;
+        }
+        return pos_ < text_.size() ? text_[ pos_ ] : '\0';
+    }
+
+    bool consume( char c )
+    {
+        if( peek() == c ) {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    void expect( char c )
+    {
+        if( ! consume( c )) {
+            fail( std::string( "Expecting '" ) + c + "'" );
+        }
+    }
+
+    void read_string( std::string& result )
+    {
+        expect( '"' );
+        result.clear();
+        while( true ) {
+            // Copy the plain characters up to the next quotation mark or escape in one go.
+            auto const end = text_.find_first_of( "\"\\", pos_ );
+            if( end == std::string::npos ) {
+                fail( "Unterminated string" );
+            }
+            result.append( text_, pos_, end - pos_ );
+            pos_ = end + 1;
+            if( text_[ end ] == '"' ) {
+                return;
+            }
+            if( pos_ >= text_.size() ) {
+                fail( "Unterminated string" );
+            }
+            auto const esc = text_[ pos_++ ];
+            switch( esc ) {
+                case '"':
+                case '\\':
+                case '/':
+                    result += esc;
+                    break;
+                case 'b':
+                    result += '\b';
+                    break;
+                case 'f':
+                    result += '\f';
+                    break;
+                case 'n':
+                    result += '\n';
+                    break;
+                case 'r':
+                    result += '\r';
+                    break;
+                case 't':
+                    result += '\t';
+                    break;
+                case 'u':
+                    append_utf8_( result, read_code_point_() );
+                    break;
+                default:
+                    fail( "Invalid escape sequence" );
+            }
+        }
+    }
+
+    double read_number()
+    {
+        peek();
+        char* end = nullptr;
+        auto const begin = text_.c_str() + pos_;
+        auto const result = std::strtod( begin, &end );
+        if( end == begin ) {
+            fail( "Expecting a number" );
+        }
+        pos_ += static_cast<size_t>( end - begin );
+        return result;
+    }
+
+    void skip_value()
+    {
+        size_t depth = 0;
+        do {
+            auto const c = peek();
+            if( c == '"' ) {
+                skip_string_();
+            } else if( c == '[' || c == '{' ) {
+                ++depth;
+                ++pos_;
+            } else if( c == ']' || c == '}' ) {
+                if( depth == 0 ) {
+                    fail( "Unexpected closing bracket" );
+                }
+                --depth;
+                ++pos_;
+            } else if( c == ',' || c == ':' ) {
+                if( depth == 0 ) {
+                    fail( "Expecting a value" );
+                }
+                ++pos_;
+            } else if( c == '\0' ) {
+                fail( "Unexpected end of file" );
+            } else {
+                // Numbers, true, false, and null.
+                while( pos_ < text_.size() && std::strchr( ",:]} \t\r\n", text_[ pos_ ] ) == nullptr ) {
+                    ++pos_;
+                }
+            }
+        } while( depth > 0 );
+    }
+
+    [[noreturn]] void fail( std::string const& what ) const
+    {
+        throw std::runtime_error(
+            "Invalid jplace file " + source_ + ": " + what + " at offset " + std::to_string( pos_ )
+        );
+    }
+
+private:
+
+    void skip_string_()
+    {
+        ++pos_;
+        while( true ) {
+            auto const end = text_.find_first_of( "\"\\", pos_ );
+            if( end == std::string::npos ) {
+                fail( "Unterminated string" );
+            }
+            pos_ = end + ( text_[ end ] == '"' ? 1 : 2 );
+            if( text_[ end ] == '"' ) {
+                return;
+            }
+        }
+    }
+
+    uint32_t read_hex_()
+    {
+        if( pos_ + 4 > text_.size() ) {
+            fail( "Invalid unicode escape sequence" );
+        }
+        uint32_t result = 0;
+        for( size_t i = 0; i < 4; ++i ) {
+            auto const c = text_[ pos_++ ];
+            result <<= 4;
+            if( c >= '0' && c <= '9' ) {
+                result |= static_cast<uint32_t>( c - '0' );
+            } else if( c >= 'a' && c <= 'f' ) {
+                result |= static_cast<uint32_t>( c - 'a' + 10 );
+            } else if( c >= 'A' && c <= 'F' ) {
+                result |= static_cast<uint32_t>( c - 'A' + 10 );
+            } else {
+                fail( "Invalid unicode escape sequence" );
+            }
+        }
+        return result;
+    }
+
+    uint32_t read_code_point_()
+    {
+        // Combine surrogate pairs, which encode code points outside of the basic plane.
+        auto result = read_hex_();
+        if( result >= 0xD800 && result < 0xDC00 && text_.compare( pos_, 2, "\\u" ) == 0 ) {
+            pos_ += 2;
+            auto const low = read_hex_();
+            if( low < 0xDC00 || low >= 0xE000 ) {
+                fail( "Invalid unicode surrogate pair" );
+            }
+            result = 0x10000 + (( result - 0xD800 ) << 10 ) + ( low - 0xDC00 );
+        }
+        return result;
+    }
+
+    static void append_utf8_( std::string& str, uint32_t cp )
+    {
+        if( cp < 0x80 ) {
+            str += static_cast<char>( cp );
+        } else if( cp < 0x800 ) {
+            str += static_cast<char>( 0xC0 | ( cp >> 6 ));
+            str += static_cast<char>( 0x80 | ( cp & 0x3F ));
+        } else if( cp < 0x10000 ) {
+            str += static_cast<char>( 0xE0 | ( cp >> 12 ));
+            str += static_cast<char>( 0x80 | (( cp >> 6 ) & 0x3F ));
+            str += static_cast<char>( 0x80 | ( cp & 0x3F ));
+        } else {
+            str += static_cast<char>( 0xF0 | ( cp >> 18 ));
+            str += static_cast<char>( 0x80 | (( cp >> 12 ) & 0x3F ));
+            str += static_cast<char>( 0x80 | (( cp >> 6 ) & 0x3F ));
+            str += static_cast<char>( 0x80 | ( cp & 0x3F ));
+        }
+    }
+
+    std::string const& text_;
+    std::string const& source_;
+    size_t pos_ = 0;
+};
+
+// =================================================================================================
+//     Fast Jplace Reader
+// =================================================================================================
+
+/**
+ * @brief Reader for jplace files that fills the Sample directly while scanning the text.
+ *
+ * The generic JplaceReader first builds a JSON document of the whole file, and then converts it.
+ * Here instead, the placements are read in place, using the `fields` header to know which
+ * value of a placement goes where. Each distinct reference tree is parsed only once, and then
+ * copied for all samples that use it; typically, all files share the same tree.
+ *
+ * Files of jplace versions other than 2 and 3 are handed over to the generic jplace_reader().
+ * Its invalid_number_behaviour() is also applied to the placements that are read here,
+ * so that configuring it has the same effect for all files.
+ *
+ * The reader can be used from several threads at once. from_files() reads the files in parallel.
+ */
+class FastJplaceReader
+{
+public:
+
+    using JplaceReader = genesis::placement::JplaceReader;
+    using InvalidNumberBehaviour = JplaceReader::InvalidNumberBehaviour;
+
+    /**
+     * @brief Generic reader, used for files of other jplace versions, and whose settings
+     * are used for all files.
+     */
+    JplaceReader& jplace_reader()
+    {
+        return jplace_reader_;
+    }
+
+    JplaceReader const& jplace_reader() const
+    {
+        return jplace_reader_;
+    }
+
+    genesis::placement::Sample from_file( std::string const& file )
+    {
+        using namespace genesis::placement;
+        auto const text = genesis::utils::file_read( file );
+        JplaceScanner scanner( text, file );
+
+        // Scan the top level object. The placements can come before the fields and the tree,
+        // so we only remember where they start, and read them once the rest is known.
+        std::string key;
+        std::string newick;
+        std::vector<std::string> fields;
+        double version = 0.0;
+        size_t placements_pos = std::string::npos;
+        scanner.expect( '{' );
+        if( ! scanner.consume( '}' )) {
+            do {
+                scanner.read_string( key );
+                scanner.expect( ':' );
+                if( key == "tree" ) {
+                    scanner.read_string( newick );
+                } else if( key == "fields" ) {
+                    scanner.expect( '[' );
+                    if( ! scanner.consume( ']' )) {
+                        do {
+                            fields.emplace_back();
+                            scanner.read_string( fields.back() );
+                        } while( scanner.consume( ',' ));
+                        scanner.expect( ']' );
+                    }
+                } else if( key == "version" && scanner.peek() != '"' ) {
+                    version = scanner.read_number();
+                } else if( key == "placements" ) {
+                    placements_pos = scanner.position();
+                    scanner.skip_value();
+                } else {
+                    scanner.skip_value();
+                }
+            } while( scanner.consume( ',' ));
+            scanner.expect( '}' );
+        }
+        if( version != 2.0 && version != 3.0 ) {
+            return read_generic_( file );
+        }
+        if( newick.empty() || placements_pos == std::string::npos ) {
+            throw std::runtime_error( "Invalid jplace file " + file + ": No tree or placements." );
+        }
+
+        auto const& reference = reference_tree_( newick );
+        auto const layout = field_layout_( fields, file );
+
+        Sample sample( reference.tree );
+        scanner.position( placements_pos );
+        read_pqueries_( scanner, layout, reference, sample );
+        return sample;
+    }
+
+    genesis::placement::SampleSet from_files( std::vector<std::string> const& files )
+    {
+        using namespace genesis::placement;
+        auto samples = std::vector<Sample>( files.size() );
+
+        // We cannot throw from within the parallel region, so just note the file that went wrong.
+        std::string error_msg;
+
+        #pragma omp parallel for schedule(dynamic)
+        for( size_t i = 0; i < files.size(); ++i ) {
+            try {
+                samples[i] = from_file( files[i] );
+            } catch( std::exception const& ex ) {
+                #pragma omp critical(fast_jplace_reader_error)
+                {
+                    error_msg = ex.what();
+                }
+            }
+        }
+        if( ! error_msg.empty() ) {
+            throw std::runtime_error( error_msg );
+        }
+
+        SampleSet result;
+        for( size_t i = 0; i < files.size(); ++i ) {
+            auto name = genesis::utils::file_filename( genesis::utils::file_basename( files[i] ));
+            result.add( std::move( samples[i] ), name );
+        }
+        return result;
+    }
+
+private:
+
+    enum Field : size_t
+    {
+        kIgnored,
+        kEdgeNum,
+        kLikelihood,
+        kLikeWeightRatio,
+        kProximalLength,
+        kDistalLength,
+        kPendantLength,
+        kFieldCount
+    };
+
+    struct FieldLayout
+    {
+        std::vector<Field> fields;
+        bool has_distal_length = false;
+    };
+
+    struct ReferenceTree
+    {
+        std::string newick;
+        genesis::placement::PlacementTree tree;
+        std::unordered_map<long, size_t> edge_indices;
+    };
+
+    // genesis v0.21, as used in phylofactor, reads from input sources,
+    // while v0.19, as used by all other programs here, has from_file() and from_string().
+#if defined( GENESIS_UTILS_IO_INPUT_SOURCE_H_ )
+
+    genesis::placement::Sample read_generic_( std::string const& file ) const
+    {
+        return jplace_reader_.read( genesis::utils::from_file( file ));
+    }
+
+    static genesis::placement::PlacementTree read_newick_( std::string const& newick )
+    {
+        return genesis::placement::PlacementTreeNewickReader().read(
+            genesis::utils::from_string( newick )
+        );
+    }
+
+#else
+
+    genesis::placement::Sample read_generic_( std::string const& file ) const
+    {
+        return jplace_reader_.from_file( file );
+    }
+
+    static genesis::placement::PlacementTree read_newick_( std::string const& newick )
+    {
+        return genesis::placement::PlacementTreeNewickReader().from_string( newick );
+    }
+
+#endif
+
+    static FieldLayout field_layout_( std::vector<std::string> const& fields, std::string const& file )
+    {
+        FieldLayout result;
+        bool has_edge_num = false;
+        for( auto const& field : fields ) {
+            if( field == "edge_num" ) {
+                result.fields.push_back( kEdgeNum );
+                has_edge_num = true;
+            } else if( field == "likelihood" ) {
+                result.fields.push_back( kLikelihood );
+            } else if( field == "like_weight_ratio" ) {
+                result.fields.push_back( kLikeWeightRatio );
+            } else if( field == "proximal_length" ) {
+                result.fields.push_back( kProximalLength );
+            } else if( field == "distal_length" ) {
+                result.fields.push_back( kDistalLength );
+                result.has_distal_length = true;
+            } else if( field == "pendant_length" ) {
+                result.fields.push_back( kPendantLength );
+            } else {
+                result.fields.push_back( kIgnored );
+            }
+        }
+        if( ! has_edge_num ) {
+            throw std::runtime_error( "Invalid jplace file " + file + ": No edge_num field." );
+        }
+        return result;
+    }
+
+    /**
+     * @brief Get the parsed reference tree for a @p newick string, parsing it if it is new.
+     *
+     * While one thread parses a tree, the others wait for it, as they most likely need the
+     * same tree anyway. The trees are never moved or changed once parsed, so the returned
+     * reference stays valid, and can be read without locking.
+     */
+    ReferenceTree const& reference_tree_( std::string const& newick )
+    {
+        using namespace genesis::placement;
+        ReferenceTree const* result = nullptr;
+        std::string error_msg;
+
+        #pragma omp critical(fast_jplace_reader_trees)
+        {
+            for( auto const& reference : trees_ ) {
+                if( reference->newick == newick ) {
+                    result = reference.get();
+                    break;
+                }
+            }
+            if( ! result ) {
+                try {
+                    auto reference = std::unique_ptr<ReferenceTree>( new ReferenceTree() );
+                    reference->newick = newick;
+                    reference->tree = read_newick_( newick );
+                    for( size_t e = 0; e < reference->tree.edge_count(); ++e ) {
+                        auto const& edge_data = reference->tree.edge_at( e ).data<PlacementEdgeData>();
+                        if( ! reference->edge_indices.emplace( edge_data.edge_num(), e ).second ) {
+                            throw std::runtime_error(
+                                "Edge num " + std::to_string( edge_data.edge_num() ) + " is not unique."
+                            );
+                        }
+                    }
+                    result = reference.get();
+                    trees_.push_back( std::move( reference ));
+                } catch( std::exception const& ex ) {
+                    error_msg = ex.what();
+                }
+            }
+        }
+        if( ! result ) {
+            throw std::runtime_error( "Invalid jplace reference tree: " + error_msg );
+        }
+        return *result;
+    }
+
+    void read_pqueries_(
+        JplaceScanner& scanner,
+        FieldLayout const& layout,
+        ReferenceTree const& reference,
+        genesis::placement::Sample& sample
+    ) const {
+        std::string key;
+        std::string name;
+        scanner.expect( '[' );
+        if( scanner.consume( ']' )) {
+            return;
+        }
+        do {
+            auto& pquery = sample.add();
+            scanner.expect( '{' );
+            if( scanner.consume( '}' )) {
+                continue;
+            }
+            do {
+                scanner.read_string( key );
+                scanner.expect( ':' );
+                if( key == "p" ) {
+                    scanner.expect( '[' );
+                    if( ! scanner.consume( ']' )) {
+                        do {
+                            read_placement_( scanner, layout, reference, sample, pquery );
+                        } while( scanner.consume( ',' ));
+                        scanner.expect( ']' );
+                    }
+                } else if( key == "n" && scanner.peek() == '"' ) {
+                    scanner.read_string( name );
+                    pquery.add_name( name, 1.0 );
+                } else if( key == "n" ) {
+                    scanner.expect( '[' );
+                    if( ! scanner.consume( ']' )) {
+                        do {
+                            scanner.read_string( name );
+                            pquery.add_name( name, 1.0 );
+                        } while( scanner.consume( ',' ));
+                        scanner.expect( ']' );
+                    }
+                } else if( key == "nm" ) {
+                    scanner.expect( '[' );
+                    if( ! scanner.consume( ']' )) {
+                        do {
+                            scanner.expect( '[' );
+                            scanner.read_string( name );
+                            scanner.expect( ',' );
+                            auto const multiplicity = scanner.read_number();
+                            scanner.expect( ']' );
+                            pquery.add_name( name, multiplicity );
+                        } while( scanner.consume( ',' ));
+                        scanner.expect( ']' );
+                    }
+                } else {
+                    scanner.skip_value();
+                }
+            } while( scanner.consume( ',' ));
+            scanner.expect( '}' );
+        } while( scanner.consume( ',' ));
+        scanner.expect( ']' );
+    }
+
+    void read_placement_(
+        JplaceScanner& scanner,
+        FieldLayout const& layout,
+        ReferenceTree const& reference,
+        genesis::placement::Sample& sample,
+        genesis::placement::Pquery& pquery
+    ) const {
+        using namespace genesis::placement;
+
+        // Collect the values first, as the edge num is not necessarily the first field.
+        // Fields that are not given keep the defaults of a placement, which are all zero.
+        std::array<double, kFieldCount> values;
+        values.fill( 0.0 );
+        size_t count = 0;
+        scanner.expect( '[' );
+        if( ! scanner.consume( ']' )) {
+            do {
+                if( count >= layout.fields.size() ) {
+                    scanner.fail( "Placement has more values than fields" );
+                }
+                if( layout.fields[ count ] == kIgnored ) {
+                    scanner.skip_value();
+                } else {
+                    values[ layout.fields[ count ]] = scanner.read_number();
+                }
+                ++count;
+            } while( scanner.consume( ',' ));
+            scanner.expect( ']' );
+        }
+        if( count != layout.fields.size() ) {
+            scanner.fail( "Placement has fewer values than fields" );
+        }
+
+        auto const edge_num = static_cast<long>( values[ kEdgeNum ] );
+        auto const edge_it = reference.edge_indices.find( edge_num );
+        if( static_cast<double>( edge_num ) != values[ kEdgeNum ] || edge_it == reference.edge_indices.end() ) {
+            scanner.fail( "Placement on invalid edge num" );
+        }
+        auto& edge = sample.tree().edge_at( edge_it->second );
+        auto const branch_length = edge.data<PlacementEdgeData>().branch_length;
+
+        auto& placement = pquery.add_placement( edge );
+        placement.likelihood        = values[ kLikelihood ];
+        placement.like_weight_ratio = values[ kLikeWeightRatio ];
+        placement.pendant_length    = values[ kPendantLength ];
+        placement.proximal_length   = layout.has_distal_length
+            ? branch_length - values[ kDistalLength ]
+            : values[ kProximalLength ]
+        ;
+
+        // Check the values in the same way as the JplaceReader, using its setting.
+        check_value_( scanner, placement.like_weight_ratio, 0.0, 1.0, "like_weight_ratio" );
+        check_value_(
+            scanner, placement.pendant_length, 0.0, std::numeric_limits<double>::infinity(),
+            "pendant_length"
+        );
+        check_value_( scanner, placement.proximal_length, 0.0, branch_length, "proximal_length" );
+    }
+
+    void check_value_(
+        JplaceScanner const& scanner, double& value, double min, double max, char const* name
+    ) const {
+        if( value >= min && value <= max ) {
+            return;
+        }
+        auto const behaviour = jplace_reader_.invalid_number_behaviour();
+        if( behaviour == InvalidNumberBehaviour::kThrow ) {
+            scanner.fail( std::string( "Invalid placement " ) + name + " " + std::to_string( value ));
+        }
+        if(
+            behaviour == InvalidNumberBehaviour::kLog ||
+            behaviour == InvalidNumberBehaviour::kLogAndCorrect
+        ) {
+            LOG_WARN << "Invalid placement with " << name << " " << value
+                     << " at offset " << scanner.position() << " of " << scanner.source();
+        }
+        if(
+            behaviour == InvalidNumberBehaviour::kCorrect ||
+            behaviour == InvalidNumberBehaviour::kLogAndCorrect
+        ) {
+            value = std::min( std::max( value, min ), max );
+        }
+    }
+
+    JplaceReader jplace_reader_;
+    std::vector<std::unique_ptr<ReferenceTree>> trees_;
+};
+
+#endif // include guard
@@ -0,0 +1,215 @@
+#ifndef PLACEMENT_METHODS_COMMON_MASS_TREES_H_
+#define PLACEMENT_METHODS_COMMON_MASS_TREES_H_
+
+/*
+    Genesis - A toolkit for working with phylogenetic data.
+    Copyright (C) 2014-2018 Lucas Czech and HITS gGmbH
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lucas.czech@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+/*
+    Loading mass trees that are comparable across samples, shared by the bplace programs and the
+    programs that use the edge matrices. Include this after genesis.
+*/
+
+#include "genesis/genesis.hpp"
+
+#include <cassert>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+//      Average Branch Lengths
+// =================================================================================================
+
+/**
+ * @brief Move all @p mass_trees onto a tree with the given branch @p lengths per edge index.
+ *
+ * Every mass keeps its relative position on its edge, scaled to the new branch length, which is
+ * how `placement::add_sample_to_mass_tree()` places the masses of a sample on another tree.
+ */
+inline void mass_trees_to_branch_lengths(
+    std::vector<genesis::tree::MassTree>& mass_trees,
+    std::vector<double> const& lengths
+) {
+    using namespace genesis::tree;
+
+    #pragma omp parallel for schedule(dynamic)
+    for( size_t i = 0; i < mass_trees.size(); ++i ) {
+        assert( mass_trees[i].edge_count() == lengths.size() );
+        for( size_t e = 0; e < lengths.size(); ++e ) {
+            auto& edge_data = mass_trees[i].edge_at( e ).data<MassTreeEdgeData>();
+            if( edge_data.branch_length == lengths[e] ) {
+                continue;
+            }
+
+            // An edge of length zero can only carry masses at its proximal end.
+            auto const scaler = edge_data.branch_length > 0.0
+                ? lengths[e] / edge_data.branch_length
+                : 0.0
+            ;
+            std::map<double, double> scaled;
+            for( auto const& mass : edge_data.masses ) {
+                scaled[ mass.first * scaler ] += mass.second;
+            }
+            edge_data.masses.swap( scaled );
+            edge_data.branch_length = lengths[e];
+        }
+    }
+}
+
+/**
+ * @brief Move all @p mass_trees onto the tree with the branch lengths averaged over all of them.
+ *
+ * This is what `placement::convert_sample_set_to_mass_trees()` does, but without needing the
+ * whole SampleSet in memory: Each mass tree is converted from its own sample, and afterwards
+ * moved to the average branch lengths. Without this, the EMD between samples with different
+ * branch lengths would also measure the difference of the branch lengths, and not only of the
+ * placements.
+ *
+ * The trees need to have the same topology, which the loaders check beforehand.
+ */
+inline void mass_trees_to_average_branch_lengths( std::vector<genesis::tree::MassTree>& mass_trees )
+{
+    using namespace genesis::tree;
+    if( mass_trees.empty() ) {
+        return;
+    }
+    auto const num_edges = mass_trees[0].edge_count();
+
+    auto average_lengths = std::vector<double>( num_edges, 0.0 );
+    for( auto const& mass_tree : mass_trees ) {
+        assert( mass_tree.edge_count() == num_edges );
+        for( size_t e = 0; e < num_edges; ++e ) {
+            average_lengths[e] += mass_tree.edge_at( e ).data<MassTreeEdgeData>().branch_length;
+        }
+    }
+    for( auto& length : average_lengths ) {
+        length /= static_cast<double>( mass_trees.size() );
+    }
+    mass_trees_to_branch_lengths( mass_trees, average_lengths );
+}
+
+// =================================================================================================
+//      Load Bplace Mass Trees
+// =================================================================================================
+
+struct BplaceMassTrees
+{
+    std::vector<std::string>               names;
+    std::vector<genesis::tree::MassTree>   trees;
+    std::vector<size_t>                    pquery_counts;
+    genesis::utils::Matrix<double>         imbalances;
+    genesis::placement::PlacementTree      reference_tree;
+};
+
+/**
+ * @brief Load bplace files in parallel, and immediately reduce each Sample to its mass tree
+ * (and, if requested, its edge imbalance vector), so that only one Sample per thread is in
+ * memory at a time, instead of a full SampleSet next to the mass trees.
+ *
+ * The mass trees are then moved to the average branch length tree, so that they are the same as
+ * the ones of `convert_sample_set_to_mass_trees()`. The tree of the first sample is kept as
+ * reference tree for drawing, and all other samples need to have a compatible tree.
+ */
+inline BplaceMassTrees load_bplace_mass_trees(
+    std::string const& epadir,
+    std::vector<std::string> const& bplace_filenames,
+    bool with_imbalances = false
+) {
+    using namespace genesis::placement;
+    auto const size = bplace_filenames.size();
+
+    BplaceMassTrees result;
+    result.names = bplace_filenames;
+    result.trees.resize( size );
+    result.pquery_counts.resize( size );
+    if( size == 0 ) {
+        return result;
+    }
+    auto imbalance_rows = std::vector<std::vector<double>>( with_imbalances ? size : 0 );
+
+    SampleSerializer bplace_loader;
+
+    // Reduce a sample to its entries i of the result.
+    auto add_sample = [&]( size_t i, Sample const& smp ){
+        result.trees[i] = convert_sample_to_mass_tree( smp ).first;
+        result.pquery_counts[i] = smp.size();
+        if( with_imbalances ) {
+            imbalance_rows[i] = epca_imbalance_vector( smp );
+        }
+    };
+
+    // The first sample provides the reference tree that all others are checked against.
+    {
+        auto const smp = bplace_loader.load( epadir + bplace_filenames[0] );
+        result.reference_tree = smp.tree();
+        add_sample( 0, smp );
+    }
+
+    // We cannot throw from within the parallel region, so just note what went wrong.
+    std::string error_msg;
+
+    // Parallel parsing and reduction.
+    #pragma omp parallel for schedule(dynamic)
+    for( size_t i = 1; i < size; ++i ) {
+        Sample smp;
+        try {
+            smp = bplace_loader.load( epadir + bplace_filenames[i] );
+        } catch( std::exception const& ex ) {
+            #pragma omp critical(bplace_mass_trees_error)
+            {
+                error_msg = ex.what();
+            }
+            continue;
+        }
+        if( ! compatible_trees( result.reference_tree, smp.tree() )) {
+            #pragma omp critical(bplace_mass_trees_error)
+            {
+                error_msg = "Sample " + bplace_filenames[i] + " is placed on a different tree.";
+            }
+            continue;
+        }
+        add_sample( i, smp );
+    }
+    if( ! error_msg.empty() ) {
+        throw std::runtime_error( error_msg );
+    }
+
+    mass_trees_to_average_branch_lengths( result.trees );
+
+    if( with_imbalances ) {
+        result.imbalances = genesis::utils::Matrix<double>( size, imbalance_rows[0].size() );
+        for( size_t i = 0; i < size; ++i ) {
+            assert( imbalance_rows[i].size() == result.imbalances.cols() );
+            for( size_t j = 0; j < result.imbalances.cols(); ++j ) {
+                result.imbalances( i, j ) = imbalance_rows[i][j];
+            }
+            imbalance_rows[i].clear();
+            imbalance_rows[i].shrink_to_fit();
+        }
+    }
+
+    return result;
+}
+
+#endif // include guard
@@ -0,0 +1,80 @@
+#ifndef PLACEMENT_METHODS_COMMON_MATRIX_IO_H_
+#define PLACEMENT_METHODS_COMMON_MATRIX_IO_H_
+
+/*
+    Genesis - A toolkit for working with phylogenetic data.
+    Copyright (C) 2014-2018 Lucas Czech and HITS gGmbH
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lucas.czech@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+/*
+    Reading matrices as written by `utils::to_string()`, shared by jplace_emd and
+    correlation_trees. Include this after genesis.
+*/
+
+#include "genesis/genesis.hpp"
+
+#include <stdexcept>
+#include <string>
+
+// =================================================================================================
+//     Read Matrix
+// =================================================================================================
+
+/**
+ * @brief Read a matrix of doubles with space separated columns and one row per line.
+ */
+inline genesis::utils::Matrix<double> read_double_matrix( std::string const& filename )
+{
+    auto reader = genesis::utils::CsvReader();
+    reader.separator_chars( " " );
+
+    // See fast_jplace_reader.hpp for the two genesis versions.
+#if defined( GENESIS_UTILS_IO_INPUT_SOURCE_H_ )
+    auto table  = reader.read( genesis::utils::from_file( filename ));
+#else
+    auto table  = reader.from_file( filename );
+#endif
+
+    if( table.size() == 0 ) {
+        return {};
+    }
+
+    // Get and check dimensions.
+    auto const row_num = table.size();
+    auto const col_num = table[0].size();
+    for( auto const& row : table ) {
+        if( row.size() != col_num ) {
+            throw std::invalid_argument( "Input is not a matrix." );
+        }
+    }
+
+    // Convert to double.
+    auto dmat = genesis::utils::Matrix<double>( row_num, col_num );
+    for( size_t i = 0; i < row_num; ++i ) {
+        for( size_t j = 0; j < col_num; ++j ) {
+            dmat( i, j ) = std::stod( table[i][j] );
+        }
+    }
+
+    return dmat;
+}
+
+#endif // include guard
@@ -0,0 +1,282 @@
+#ifndef PLACEMENT_METHODS_COMMON_META_DATA_TABLE_H_
+#define PLACEMENT_METHODS_COMMON_META_DATA_TABLE_H_
+
+/*
+    Genesis - A toolkit for working with phylogenetic data.
+    Copyright (C) 2014-2018 Lucas Czech and HITS gGmbH
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lucas.czech@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+/*
+    Columnar meta data table of the samples, and its masked correlation with edge matrices,
+    shared by correlation_trees, cluster_tree_metadata and jplace_analysis_server.
+    Include this after genesis.
+*/
+
+#include "genesis/genesis.hpp"
+
+#include "correlation.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// =================================================================================================
+//     Meta Data Table
+// =================================================================================================
+
+/**
+ * @brief Columnar table of numeric meta data, with one row per sample.
+ *
+ * The first column of the table file contains the sample names, and is indexed, so that
+ * the rows of samples can be looked up by name. All other columns are parsed into one vector
+ * of doubles each. Missing values are stored as NaN, see meta_data_missing_value().
+ */
+struct MetaDataTable
+{
+    std::vector<std::string>                sample_names;
+    std::unordered_map<std::string, size_t> sample_index;
+
+    std::vector<std::string>         names;
+    std::vector<std::vector<double>> columns;
+
+    size_t rows() const
+    {
+        return sample_names.size();
+    }
+
+    size_t cols() const
+    {
+        return columns.size();
+    }
+
+    double operator()( size_t row, size_t col ) const
+    {
+        return columns[ col ][ row ];
+    }
+
+    bool missing( size_t row, size_t col ) const
+    {
+        return std::isnan( columns[ col ][ row ] );
+    }
+};
+
+/**
+ * @brief Return whether a table entry denotes a missing value: empty, NA, NaN, or 99999,
+ * which is what older meta data tables use.
+ *
+ * The entry from @p begin to @p end was parsed by strtod() into @p value, up to @p parsed.
+ * The number is compared as a value, so that for example "99999.0" is missing as well.
+ */
+inline bool meta_data_missing_value(
+    char const* begin, char const* end, char const* parsed, double value
+) {
+    if( begin != end && parsed == end ) {
+        return std::isnan( value ) || value == 99999.0;
+    }
+    auto const field = std::string( begin, end );
+    return field.empty() || field == "NA" || field == "na";
+}
+
+/**
+ * @brief Read a meta data table with a header line, parsing the values directly into columns.
+ *
+ * Columns that contain non-numeric values are skipped.
+ */
+inline MetaDataTable read_meta_data_table( std::string const& filename, char separator = '\t' )
+{
+    std::ifstream is( filename );
+    if( ! is ) {
+        throw std::runtime_error( "Cannot read meta data table " + filename );
+    }
+
+    // Split a line into fields, as pairs of begin and end pointers into the line.
+    auto fields = std::vector<std::pair<char const*, char const*>>();
+    auto split = [&]( std::string const& line ){
+        fields.clear();
+        char const* begin = line.c_str();
+        char const* line_end = begin + line.size();
+        if( line_end != begin && *( line_end - 1 ) == '\r' ) {
+            --line_end;
+        }
+        while( true ) {
+            auto const end = std::find( begin, line_end, separator );
+            fields.emplace_back( begin, end );
+            if( end == line_end ) {
+                break;
+            }
+            begin = end + 1;
+        }
+    };
+
+    // Header. The first field is the name of the sample name column.
+    std::string line;
+    if( ! std::getline( is, line )) {
+        throw std::runtime_error( "Meta data table " + filename + " is empty." );
+    }
+    split( line );
+
+    MetaDataTable result;
+    for( size_t i = 1; i < fields.size(); ++i ) {
+        result.names.emplace_back( fields[i].first, fields[i].second );
+    }
+    result.columns = std::vector<std::vector<double>>( result.names.size() );
+    auto numeric = std::vector<bool>( result.names.size(), true );
+
+    // Rows.
+    auto const nan = std::numeric_limits<double>::quiet_NaN();
+    while( std::getline( is, line )) {
+        if( line.empty() || line == "\r" ) {
+            continue;
+        }
+        split( line );
+        if( fields.size() != result.names.size() + 1 ) {
+            throw std::runtime_error(
+                "Meta data table has wrong line length at " +
+                std::to_string( result.sample_names.size() + 1 )
+            );
+        }
+
+        auto name = std::string( fields[0].first, fields[0].second );
+        if( ! result.sample_index.emplace( name, result.sample_names.size() ).second ) {
+            throw std::runtime_error( "Meta data table has duplicate sample " + name );
+        }
+        result.sample_names.push_back( std::move( name ));
+
+        for( size_t c = 0; c < result.columns.size(); ++c ) {
+            auto const begin = fields[ c + 1 ].first;
+            auto const end   = fields[ c + 1 ].second;
+            if( ! numeric[c] ) {
+                result.columns[c].push_back( nan );
+                continue;
+            }
+
+            // The field is not null-terminated in general, but strtod stops at the separator
+            // at the latest, so we only need to check that it consumed the whole field.
+            char* parsed;
+            auto const value = std::strtod( begin, &parsed );
+            if( meta_data_missing_value( begin, end, parsed, value )) {
+                result.columns[c].push_back( nan );
+                continue;
+            }
+            if( parsed != end ) {
+                numeric[c] = false;
+            }
+            result.columns[c].push_back( value );
+        }
+    }
+
+    // Remove the columns that are not numeric.
+    size_t keep = 0;
+    for( size_t c = 0; c < result.columns.size(); ++c ) {
+        if( ! numeric[c] ) {
+            LOG_WARN << "Skipping non-numeric meta data column " << result.names[c];
+            continue;
+        }
+        if( keep != c ) {
+            result.names[ keep ]   = std::move( result.names[c] );
+            result.columns[ keep ] = std::move( result.columns[c] );
+        }
+        ++keep;
+    }
+    result.names.resize( keep );
+    result.columns.resize( keep );
+
+    return result;
+}
+
+/**
+ * @brief Return the rows of the @p table in the given @p order of sample names.
+ */
+inline MetaDataTable reorder_meta_data_table(
+    MetaDataTable const& table,
+    std::vector<std::string> const& order
+) {
+    auto rows = std::vector<size_t>( order.size() );
+    for( size_t r = 0; r < order.size(); ++r ) {
+        auto const it = table.sample_index.find( order[r] );
+        if( it == table.sample_index.end() ) {
+            throw std::runtime_error( "Cannot find meta data table index for sample " + order[r] );
+        }
+        rows[r] = it->second;
+    }
+
+    MetaDataTable result;
+    result.sample_names = order;
+    for( size_t r = 0; r < order.size(); ++r ) {
+        if( ! result.sample_index.emplace( order[r], r ).second ) {
+            throw std::runtime_error( "Duplicate sample in order list: " + order[r] );
+        }
+    }
+    result.names = table.names;
+    result.columns = std::vector<std::vector<double>>( table.cols() );
+    for( size_t c = 0; c < table.cols(); ++c ) {
+        auto const& src = table.columns[c];
+        auto& dst = result.columns[c];
+        dst.resize( rows.size() );
+        for( size_t r = 0; r < rows.size(); ++r ) {
+            dst[r] = src[ rows[r] ];
+        }
+    }
+    return result;
+}
+
+// =================================================================================================
+//     Masked Correlation
+// =================================================================================================
+
+/**
+ * @brief Validity bitmask of a meta data column, with bit `i % 64` of word `i / 64` set
+ * if row `i` has a value.
+ */
+inline std::vector<uint64_t> meta_data_valid_mask( MetaDataTable const& meta, size_t col )
+{
+    auto result = std::vector<uint64_t>(( meta.rows() + 63 ) / 64, 0 );
+    for( size_t i = 0; i < meta.rows(); ++i ) {
+        if( ! meta.missing( i, col )) {
+            result[ i / 64 ] |= uint64_t( 1 ) << ( i % 64 );
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Standardized values and ranks of the given meta data columns, using only the
+ * given @p rows, read directly from the columnar table.
+ */
+inline StandardizedColumns standardized_columns(
+    MetaDataTable const& meta,
+    std::vector<size_t> const& cols,
+    std::vector<size_t> const& rows
+) {
+    return standardized_columns( cols.size(), rows, [&]( size_t c, size_t r ){
+        return meta.columns[ cols[c] ][ r ];
+    });
+}
+
+#endif // include guard
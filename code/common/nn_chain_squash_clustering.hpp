@@ -0,0 +1,287 @@
+#ifndef PLACEMENT_METHODS_COMMON_NN_CHAIN_SQUASH_CLUSTERING_H_
+#define PLACEMENT_METHODS_COMMON_NN_CHAIN_SQUASH_CLUSTERING_H_
+
+/*
+    Genesis - A toolkit for working with phylogenetic data.
+    Copyright (C) 2014-2018 Lucas Czech and HITS gGmbH
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lucas.czech@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+/*
+    Squash Clustering with nearest neighbour chains, shared by jplace_squash and
+    compare_emd_nhd_bplace. Include this after genesis.
+*/
+
+#include "genesis/genesis.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+//      Nearest Neighbour Chain Squash Clustering
+// =================================================================================================
+
+/**
+ * @brief Squash Clustering using nearest neighbour chains, with all pairwise distances between
+ * active clusters cached in a packed triangular buffer.
+ *
+ * Same interface and output as `tree::SquashClustering`, but instead of searching all pairs for
+ * the closest clusters after every merge, we follow a chain of nearest neighbours until two
+ * clusters are reciprocal nearest neighbours, and merge those. This needs O(n) distance lookups
+ * per step instead of O(n^2). After a merge, the merged cluster takes the buffer slot of its
+ * first child, and only its distances to the remaining active clusters are recalculated,
+ * in parallel.
+ *
+ * If a distance matrix of the input trees is already available (e.g., the EMD matrix), it can be
+ * given to run() in order to skip the initial pairwise distance calculation.
+ *
+ * Note that squash clustering averages the mass trees of merged clusters, which is not strictly
+ * reducible in the Lance-Williams sense. In rare cases, a cluster can thus be merged at a lower
+ * distance than one of its two children, which is an inversion in the cluster tree.
+ * Such inversions are counted and logged.
+ */
+class NnChainSquashClustering
+{
+public:
+
+    struct Cluster
+    {
+        genesis::tree::MassTree tree;
+        size_t         count;
+        bool           active;
+    };
+
+    struct Merger
+    {
+        size_t index_a;
+        double distance_a;
+
+        size_t index_b;
+        double distance_b;
+    };
+
+    void run(
+        std::vector<genesis::tree::MassTree>&& trees,
+        genesis::utils::Matrix<double> const& distances = genesis::utils::Matrix<double>()
+    ) {
+        auto const n = trees.size();
+        clusters_.clear();
+        mergers_.clear();
+        clusters_.reserve( 2 * n );
+        mergers_.reserve( n );
+        for( auto& tree : trees ) {
+            genesis::tree::mass_tree_normalize_masses( tree );
+            clusters_.push_back({ std::move( tree ), 1, true });
+        }
+        trees.clear();
+        if( n < 2 ) {
+            return;
+        }
+        if( distances.size() > 0 && ( distances.rows() != n || distances.cols() != n )) {
+            throw std::invalid_argument( "Distance matrix does not fit the number of trees." );
+        }
+
+        // Slot s holds the cluster with index slot_cluster[s]. Initially, slots are the input trees.
+        auto slot_cluster = std::vector<size_t>( n );
+        std::iota( slot_cluster.begin(), slot_cluster.end(), 0 );
+        auto slot_active = std::vector<bool>( n, true );
+        size_t active_count = n;
+
+        // Packed upper triangle of the distances between slots.
+        buffer_size_ = n;
+        dists_ = std::vector<double>( n * ( n - 1 ) / 2, 0.0 );
+        if( distances.size() > 0 ) {
+            for( size_t i = 0; i < n; ++i ) {
+                for( size_t j = i + 1; j < n; ++j ) {
+                    dist_( i, j ) = distances( i, j );
+                }
+            }
+        } else {
+            LOG_INFO << "Calculating initial distances";
+            #pragma omp parallel for schedule(dynamic)
+            for( size_t i = 0; i < n; ++i ) {
+                for( size_t j = i + 1; j < n; ++j ) {
+                    dist_( i, j ) = genesis::tree::earth_movers_distance(
+                        clusters_[i].tree, clusters_[j].tree
+                    );
+                }
+            }
+        }
+
+        // Scratch list of active slots, for the parallel update loop.
+        std::vector<size_t> active_slots;
+        active_slots.reserve( n );
+
+        std::vector<size_t> chain;
+        size_t inversions = 0;
+
+        // Merge distance of each cluster, which is zero for the input trees.
+        auto heights = std::vector<double>( n, 0.0 );
+
+        while( active_count > 1 ) {
+            if( chain.empty() ) {
+                for( size_t s = 0; s < n; ++s ) {
+                    if( slot_active[s] ) {
+                        chain.push_back( s );
+                        break;
+                    }
+                }
+            }
+
+            // Find the nearest neighbour of the chain top. Prefer the previous chain element on
+            // ties, so that the chain cannot cycle.
+            auto const a = chain.back();
+            auto const prev = ( chain.size() > 1 ? chain[ chain.size() - 2 ] : n );
+            size_t b = prev;
+            double b_dist = ( prev < n ? dist_( a, prev ) : std::numeric_limits<double>::infinity() );
+            for( size_t s = 0; s < n; ++s ) {
+                if( s == a || ! slot_active[s] ) {
+                    continue;
+                }
+                auto const d = dist_( a, s );
+                if( d < b_dist ) {
+                    b = s;
+                    b_dist = d;
+                }
+            }
+            assert( b < n );
+
+            if( b != prev ) {
+                chain.push_back( b );
+                continue;
+            }
+
+            // a and b are reciprocal nearest neighbours: merge them into slot a.
+            chain.pop_back();
+            chain.pop_back();
+            if( b_dist < std::max( heights[ slot_cluster[a] ], heights[ slot_cluster[b] ] )) {
+                ++inversions;
+            }
+            heights.push_back( b_dist );
+            merge_( slot_cluster[a], slot_cluster[b] );
+            slot_cluster[a] = clusters_.size() - 1;
+            slot_active[b] = false;
+            --active_count;
+
+            // Update the distances of the new cluster to all other active ones.
+            active_slots.clear();
+            for( size_t s = 0; s < n; ++s ) {
+                if( s != a && slot_active[s] ) {
+                    active_slots.push_back( s );
+                }
+            }
+            auto const& new_tree = clusters_.back().tree;
+            #pragma omp parallel for
+            for( size_t i = 0; i < active_slots.size(); ++i ) {
+                auto const s = active_slots[i];
+                dist_( a, s ) = genesis::tree::earth_movers_distance(
+                    new_tree, clusters_[ slot_cluster[s] ].tree
+                );
+            }
+
+            if( mergers_.size() % 100 == 0 ) {
+                LOG_DBG1 << "merged " << mergers_.size() << " of " << ( n - 1 );
+            }
+        }
+
+        dists_.clear();
+        dists_.shrink_to_fit();
+        if( inversions > 0 ) {
+            LOG_INFO << "Squash cluster tree has " << inversions << " inversions";
+        }
+    }
+
+    std::string tree_string( std::vector<std::string> const& labels ) const
+    {
+        if( labels.size() != clusters_.size() - mergers_.size() ) {
+            throw std::runtime_error( "List of labels does not have the correct size." );
+        }
+
+        auto list = std::vector<std::string>( clusters_.size() );
+        for( size_t i = 0; i < labels.size(); ++i ) {
+            list[i] = labels[i];
+        }
+        for( size_t i = 0; i < mergers_.size(); ++i ) {
+            auto const& cm = mergers_[i];
+            auto const cc = i + labels.size();
+            list[cc] = "(" + list[ cm.index_a ] + ":" + std::to_string( cm.distance_a ) + ","
+                     + list[ cm.index_b ] + ":" + std::to_string( cm.distance_b ) + ")"
+                     + std::to_string( cc );
+            list[ cm.index_a ].clear();
+            list[ cm.index_b ].clear();
+        }
+        return list.back() + ";";
+    }
+
+    std::vector<Cluster> const& clusters() const
+    {
+        return clusters_;
+    }
+
+    std::vector<Merger> const& mergers() const
+    {
+        return mergers_;
+    }
+
+private:
+
+    double& dist_( size_t i, size_t j )
+    {
+        assert( i != j );
+        if( i > j ) {
+            std::swap( i, j );
+        }
+        return dists_[ i * buffer_size_ - i * ( i + 1 ) / 2 + j - i - 1 ];
+    }
+
+    void merge_( size_t ca, size_t cb )
+    {
+        auto const wa = static_cast<double>( clusters_[ca].count );
+        auto const wb = static_cast<double>( clusters_[cb].count );
+        auto merged = genesis::tree::mass_tree_merge_trees(
+            clusters_[ca].tree, clusters_[cb].tree, wa, wb
+        );
+        genesis::tree::mass_tree_normalize_masses( merged );
+
+        Merger merger;
+        merger.index_a    = ca;
+        merger.distance_a = genesis::tree::earth_movers_distance( clusters_[ca].tree, merged );
+        merger.index_b    = cb;
+        merger.distance_b = genesis::tree::earth_movers_distance( clusters_[cb].tree, merged );
+        mergers_.push_back( merger );
+
+        clusters_[ca].active = false;
+        clusters_[cb].active = false;
+        clusters_.push_back({ std::move( merged ), clusters_[ca].count + clusters_[cb].count, true });
+    }
+
+    std::vector<Cluster> clusters_;
+    std::vector<Merger>  mergers_;
+
+    size_t              buffer_size_ = 0;
+    std::vector<double> dists_;
+};
+
+#endif // include guard
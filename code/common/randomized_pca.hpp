@@ -0,0 +1,295 @@
+#ifndef PLACEMENT_METHODS_COMMON_RANDOMIZED_PCA_H_
+#define PLACEMENT_METHODS_COMMON_RANDOMIZED_PCA_H_
+
+/*
+    Genesis - A toolkit for working with phylogenetic data.
+    Copyright (C) 2014-2018 Lucas Czech and HITS gGmbH
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lucas.czech@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+/*
+    Randomized PCA, shared by the phylofactor programs and jplace_epca_vis.
+    Include this after genesis.
+*/
+
+#include "genesis/genesis.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// =================================================================================================
+//     Randomized PCA
+// =================================================================================================
+
+/**
+ * @brief Eigenvalues and eigenvectors (as columns) of a small symmetric matrix,
+ * using cyclic Jacobi rotations, sorted by decreasing eigenvalue.
+ */
+inline std::pair<std::vector<double>, genesis::utils::Matrix<double>> symmetric_eigen_jacobi( genesis::utils::Matrix<double> a )
+{
+    auto const n = a.rows();
+    assert( a.cols() == n );
+
+    auto v = genesis::utils::Matrix<double>( n, n, 0.0 );
+    for( size_t i = 0; i < n; ++i ) {
+        v( i, i ) = 1.0;
+    }
+
+    for( size_t sweep = 0; sweep < 100; ++sweep ) {
+        double off = 0.0;
+        for( size_t p = 0; p < n; ++p ) {
+            for( size_t q = p + 1; q < n; ++q ) {
+                off += a( p, q ) * a( p, q );
+            }
+        }
+        if( off < 1e-30 ) {
+            break;
+        }
+
+        for( size_t p = 0; p < n; ++p ) {
+            for( size_t q = p + 1; q < n; ++q ) {
+                if( a( p, q ) == 0.0 ) {
+                    continue;
+                }
+
+                // Rotation that zeroes a(p,q).
+                auto const theta = ( a( q, q ) - a( p, p )) / ( 2.0 * a( p, q ));
+                auto const t = ( theta >= 0.0 ? 1.0 : -1.0 )
+                    / ( std::abs( theta ) + std::sqrt( theta * theta + 1.0 ))
+                ;
+                auto const c = 1.0 / std::sqrt( t * t + 1.0 );
+                auto const s = t * c;
+
+                for( size_t k = 0; k < n; ++k ) {
+                    auto const akp = a( k, p );
+                    auto const akq = a( k, q );
+                    a( k, p ) = c * akp - s * akq;
+                    a( k, q ) = s * akp + c * akq;
+                }
+                for( size_t k = 0; k < n; ++k ) {
+                    auto const apk = a( p, k );
+                    auto const aqk = a( q, k );
+                    a( p, k ) = c * apk - s * aqk;
+                    a( q, k ) = s * apk + c * aqk;
+                }
+                for( size_t k = 0; k < n; ++k ) {
+                    auto const vkp = v( k, p );
+                    auto const vkq = v( k, q );
+                    v( k, p ) = c * vkp - s * vkq;
+                    v( k, q ) = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
+
+    // Sort by decreasing eigenvalue.
+    auto order = std::vector<size_t>( n );
+    std::iota( order.begin(), order.end(), 0 );
+    std::sort( order.begin(), order.end(), [&]( size_t l, size_t r ){
+        return a( l, l ) > a( r, r );
+    });
+    auto values  = std::vector<double>( n );
+    auto vectors = genesis::utils::Matrix<double>( n, n );
+    for( size_t i = 0; i < n; ++i ) {
+        values[i] = a( order[i], order[i] );
+        for( size_t k = 0; k < n; ++k ) {
+            vectors( k, i ) = v( k, order[i] );
+        }
+    }
+    return { values, vectors };
+}
+
+/**
+ * @brief Orthonormalize the columns of a tall matrix in place (modified Gram-Schmidt).
+ * Columns that are (numerically) dependent on the previous ones are set to zero.
+ */
+inline void orthonormalize_cols( genesis::utils::Matrix<double>& m )
+{
+    for( size_t c = 0; c < m.cols(); ++c ) {
+        for( size_t p = 0; p < c; ++p ) {
+            double dot = 0.0;
+            for( size_t r = 0; r < m.rows(); ++r ) {
+                dot += m( r, p ) * m( r, c );
+            }
+            for( size_t r = 0; r < m.rows(); ++r ) {
+                m( r, c ) -= dot * m( r, p );
+            }
+        }
+        double norm = 0.0;
+        for( size_t r = 0; r < m.rows(); ++r ) {
+            norm += m( r, c ) * m( r, c );
+        }
+        norm = std::sqrt( norm );
+        for( size_t r = 0; r < m.rows(); ++r ) {
+            m( r, c ) = ( norm > 1e-12 ? m( r, c ) / norm : 0.0 );
+        }
+    }
+}
+
+/**
+ * @brief Product `a * b` of a large (n x p) with a thin (p x l) matrix, parallel over the rows.
+ */
+inline genesis::utils::Matrix<double> multiply_thin( genesis::utils::Matrix<double> const& a, genesis::utils::Matrix<double> const& b )
+{
+    assert( a.cols() == b.rows() );
+    auto result = genesis::utils::Matrix<double>( a.rows(), b.cols(), 0.0 );
+
+    #pragma omp parallel for
+    for( size_t i = 0; i < a.rows(); ++i ) {
+        for( size_t k = 0; k < a.cols(); ++k ) {
+            auto const aik = a( i, k );
+            for( size_t j = 0; j < b.cols(); ++j ) {
+                result( i, j ) += aik * b( k, j );
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Product `a^T * b` of a large (n x p) with a thin (n x l) matrix, parallel over blocks
+ * of columns of @p a, so that each thread reads contiguous parts of the rows.
+ */
+inline genesis::utils::Matrix<double> multiply_transposed_thin( genesis::utils::Matrix<double> const& a, genesis::utils::Matrix<double> const& b )
+{
+    assert( a.rows() == b.rows() );
+    auto result = genesis::utils::Matrix<double>( a.cols(), b.cols(), 0.0 );
+    size_t const block_size = 64;
+    auto const num_blocks = ( a.cols() + block_size - 1 ) / block_size;
+
+    #pragma omp parallel for schedule(dynamic)
+    for( size_t bl = 0; bl < num_blocks; ++bl ) {
+        auto const beg = bl * block_size;
+        auto const end = std::min( beg + block_size, a.cols() );
+        for( size_t i = 0; i < a.rows(); ++i ) {
+            for( size_t k = beg; k < end; ++k ) {
+                auto const aik = a( i, k );
+                for( size_t j = 0; j < b.cols(); ++j ) {
+                    result( k, j ) += aik * b( i, j );
+                }
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Truncated PCA of the covariance of the columns of @p data, using a randomized range
+ * finder with power iterations (Halko, Martinsson and Tropp, 2011).
+ *
+ * This only computes the top @p components eigenvectors and projections, with matrix products of
+ * the data with thin matrices of `components + oversampling` columns, instead of forming and
+ * decomposing the full covariance matrix over all columns.
+ */
+inline genesis::utils::PcaData randomized_principal_component_analysis(
+    genesis::utils::Matrix<double> const& data,
+    size_t components,
+    size_t oversampling = 10,
+    size_t power_iterations = 4
+) {
+    auto const n = data.rows();
+    auto const p = data.cols();
+    if( components == 0 || components > std::min( n, p )) {
+        throw std::runtime_error( "Invalid number of PCA components." );
+    }
+    auto const l = std::min( components + oversampling, std::min( n, p ));
+
+    // Center the columns.
+    auto centered = data;
+    #pragma omp parallel for
+    for( size_t c = 0; c < p; ++c ) {
+        double mean = 0.0;
+        for( size_t r = 0; r < n; ++r ) {
+            mean += centered( r, c );
+        }
+        mean /= static_cast<double>( n );
+        for( size_t r = 0; r < n; ++r ) {
+            centered( r, c ) -= mean;
+        }
+    }
+
+    // Random test matrix, and range finder with power iterations.
+    auto omega = genesis::utils::Matrix<double>( p, l );
+    std::normal_distribution<double> normal;
+    for( size_t r = 0; r < p; ++r ) {
+        for( size_t c = 0; c < l; ++c ) {
+            omega( r, c ) = normal( genesis::utils::Options::get().random_engine() );
+        }
+    }
+    auto q = multiply_thin( centered, omega );
+    orthonormalize_cols( q );
+    for( size_t it = 0; it < power_iterations; ++it ) {
+        auto z = multiply_transposed_thin( centered, q );
+        orthonormalize_cols( z );
+        q = multiply_thin( centered, z );
+        orthonormalize_cols( q );
+    }
+
+    // Project to the small space: bt = centered^T * q = B^T, with B = q^T * centered.
+    // The eigen decomposition of B * B^T yields the left singular vectors in that space.
+    auto const bt = multiply_transposed_thin( centered, q );
+    auto bbt = genesis::utils::Matrix<double>( l, l, 0.0 );
+    for( size_t i = 0; i < l; ++i ) {
+        for( size_t j = i; j < l; ++j ) {
+            double sum = 0.0;
+            for( size_t k = 0; k < p; ++k ) {
+                sum += bt( k, i ) * bt( k, j );
+            }
+            bbt( i, j ) = sum;
+            bbt( j, i ) = sum;
+        }
+    }
+    auto const eigen = symmetric_eigen_jacobi( bbt );
+
+    // Eigenvectors of the covariance are B^T u / sigma, the projections are q * u * sigma.
+    genesis::utils::PcaData result;
+    result.eigenvalues  = std::vector<double>( components );
+    result.eigenvectors = genesis::utils::Matrix<double>( p, components, 0.0 );
+    result.projection   = genesis::utils::Matrix<double>( n, components, 0.0 );
+    for( size_t c = 0; c < components; ++c ) {
+        auto const sq = std::max( eigen.first[c], 0.0 );
+        auto const sigma = std::sqrt( sq );
+        result.eigenvalues[c] = sq / static_cast<double>( n );
+
+        for( size_t k = 0; k < p; ++k ) {
+            double sum = 0.0;
+            for( size_t j = 0; j < l; ++j ) {
+                sum += bt( k, j ) * eigen.second( j, c );
+            }
+            result.eigenvectors( k, c ) = ( sigma > 0.0 ? sum / sigma : 0.0 );
+        }
+        for( size_t r = 0; r < n; ++r ) {
+            double sum = 0.0;
+            for( size_t j = 0; j < l; ++j ) {
+                sum += q( r, j ) * eigen.second( j, c );
+            }
+            result.projection( r, c ) = sum * sigma;
+        }
+    }
+    return result;
+}
+
+#endif // include guard
@@ -0,0 +1,268 @@
+#ifndef PLACEMENT_METHODS_COMMON_RASTER_TREE_LAYOUT_H_
+#define PLACEMENT_METHODS_COMMON_RASTER_TREE_LAYOUT_H_
+
+/*
+    Genesis - A toolkit for working with phylogenetic data.
+    Copyright (C) 2014-2018 Lucas Czech and HITS gGmbH
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lucas.czech@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+/*
+    Quick-look raster images of trees with colored branches, shared by kmeans_bplace,
+    correlation_trees and dispersion_trees. Include this after genesis.
+*/
+
+#include "genesis/genesis.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// =================================================================================================
+//     Write Color Tree To BMP
+// =================================================================================================
+
+/**
+ * @brief Pixel geometry of a tree drawing, for writing quick-look raster images of it with
+ * different branch colors, see write_color_tree_to_bmp().
+ */
+struct RasterTreeLayout
+{
+    size_t width  = 0;
+    size_t height = 0;
+    double stroke_width = 1.5;
+
+    // Line segments of each edge, as x1, y1, x2, y2 in pixels, indexed by edge index.
+    std::vector<std::vector<std::array<double, 4>>> edge_segments;
+};
+
+/**
+ * @brief Compute the pixel geometry of a circular or rectangular drawing of the ladderized tree,
+ * in the style of the genesis layouts: Each edge is drawn as an arc (or vertical line) at the
+ * distance of its parent node, and a radial (or horizontal) line out to its child node.
+ */
+inline RasterTreeLayout make_raster_tree_layout(
+    genesis::tree::Tree const& tree,
+    bool circular = true,
+    genesis::tree::LayoutType type = genesis::tree::LayoutType::kCladogram,
+    size_t size = 800,
+    double stroke_width = 1.5
+) {
+    auto copy = tree;
+    genesis::tree::ladderize( copy );
+
+    auto const num_nodes = copy.node_count();
+    auto const num_edges = copy.edge_count();
+
+    // Distances from the root, leaf order of the nodes (mean of their leaves for inner nodes),
+    // and height of the subtrees. Leaves are numbered in the order of an Euler tour, and the rest
+    // is computed when leaving an edge for the second time, that is, in postorder.
+    auto dist   = std::vector<double>( num_nodes, 0.0 );
+    auto spread = std::vector<double>( num_nodes, 0.0 );
+    auto lo     = std::vector<double>( num_nodes, std::numeric_limits<double>::max() );
+    auto hi     = std::vector<double>( num_nodes, std::numeric_limits<double>::lowest() );
+    auto height = std::vector<size_t>( num_nodes, 0 );
+    auto parent = std::vector<size_t>( num_nodes, num_nodes );
+    size_t leaves = 0;
+    {
+        auto visits = std::vector<size_t>( num_edges, 0 );
+        auto const& start = copy.root_node().link();
+        auto cur_link = &start;
+        do {
+            auto const& edge = cur_link->edge();
+            if( ++visits[ edge.index() ] == 1 ) {
+                auto const child = cur_link->outer().node().index();
+                parent[ child ] = cur_link->node().index();
+                auto const& edge_data = edge.data<genesis::tree::DefaultEdgeData>();
+                dist[ child ] = dist[ parent[ child ]] + edge_data.branch_length;
+                if( cur_link->outer().node().is_leaf() ) {
+                    spread[ child ] = static_cast<double>( leaves++ );
+                    lo[ child ] = hi[ child ] = spread[ child ];
+                }
+            } else {
+                auto const child = cur_link->node().index();
+                auto const par = parent[ child ];
+                spread[ child ] = ( lo[ child ] + hi[ child ] ) / 2.0;
+                lo[ par ] = std::min( lo[ par ], spread[ child ] );
+                hi[ par ] = std::max( hi[ par ], spread[ child ] );
+                height[ par ] = std::max( height[ par ], height[ child ] + 1 );
+            }
+            cur_link = &cur_link->outer().next();
+        } while( cur_link != &start );
+    }
+    auto const root = copy.root_node().index();
+    spread[ root ] = ( lo[ root ] + hi[ root ] ) / 2.0;
+
+    // Cladogram: all leaves at the same distance, inner nodes by the height of their subtrees.
+    if( type == genesis::tree::LayoutType::kCladogram ) {
+        for( size_t n = 0; n < num_nodes; ++n ) {
+            dist[n] = static_cast<double>( height[ root ] - height[n] );
+        }
+    }
+    auto const max_dist = std::max( *std::max_element( dist.begin(), dist.end() ), 1e-12 );
+    auto const two_pi = 2.0 * std::acos( -1.0 );
+
+    RasterTreeLayout result;
+    result.width  = size;
+    result.height = size;
+    result.stroke_width = stroke_width;
+    result.edge_segments.resize( num_edges );
+
+    auto const margin = 0.02 * static_cast<double>( size ) + stroke_width;
+    auto const extent = static_cast<double>( size ) - 2.0 * margin;
+    for( auto const& edge_it : copy.edges() ) {
+        auto const p = edge_it->primary_node().index();
+        auto const c = edge_it->secondary_node().index();
+        auto& segments = result.edge_segments[ edge_it->index() ];
+
+        if( circular ) {
+            auto const center = static_cast<double>( size ) / 2.0;
+            auto const radius = extent / 2.0;
+            auto const rp = radius * dist[p] / max_dist;
+            auto const rc = radius * dist[c] / max_dist;
+            auto const ap = two_pi * spread[p] / static_cast<double>( leaves );
+            auto const ac = two_pi * spread[c] / static_cast<double>( leaves );
+
+            // Arc at the parent distance, approximated by short lines, then the radial line.
+            auto const steps = std::max<size_t>( 1, std::ceil( std::abs( ac - ap ) * rp / 2.0 ));
+            for( size_t s = 0; s < steps; ++s ) {
+                auto const a1 = ap + ( ac - ap ) * static_cast<double>( s ) / steps;
+                auto const a2 = ap + ( ac - ap ) * static_cast<double>( s + 1 ) / steps;
+                segments.push_back({{
+                    center + rp * std::cos( a1 ), center + rp * std::sin( a1 ),
+                    center + rp * std::cos( a2 ), center + rp * std::sin( a2 )
+                }});
+            }
+            segments.push_back({{
+                center + rp * std::cos( ac ), center + rp * std::sin( ac ),
+                center + rc * std::cos( ac ), center + rc * std::sin( ac )
+            }});
+        } else {
+            auto const scale_y = extent / std::max( static_cast<double>( leaves ) - 1.0, 1.0 );
+            auto const xp = margin + extent * dist[p] / max_dist;
+            auto const xc = margin + extent * dist[c] / max_dist;
+            auto const yp = margin + scale_y * spread[p];
+            auto const yc = margin + scale_y * spread[c];
+            segments.push_back({{ xp, yp, xp, yc }});
+            segments.push_back({{ xp, yc, xc, yc }});
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Draw an anti-aliased line with round caps into the @p image.
+ *
+ * The coverage of each pixel is the overlap of the pixel with the stroke, approximated by the
+ * distance of the pixel center to the line, so that the edges of the stroke are smooth.
+ */
+inline void draw_raster_line(
+    genesis::utils::Matrix<genesis::utils::Color>& image,
+    std::array<double, 4> const& segment,
+    genesis::utils::Color const& color,
+    double width
+) {
+    auto const x1 = segment[0];
+    auto const y1 = segment[1];
+    auto const x2 = segment[2];
+    auto const y2 = segment[3];
+    auto const dx = x2 - x1;
+    auto const dy = y2 - y1;
+    auto const len2 = dx * dx + dy * dy;
+    auto const r = width / 2.0;
+
+    // Iterate the pixels along the major axis (a) of the line, and for each of them,
+    // the few pixels across it (b) that the stroke can touch.
+    bool const steep = std::abs( dy ) > std::abs( dx );
+    auto a1 = steep ? y1 : x1;
+    auto b1 = steep ? x1 : y1;
+    auto a2 = steep ? y2 : x2;
+    auto b2 = steep ? x2 : y2;
+    if( a1 > a2 ) {
+        std::swap( a1, a2 );
+        std::swap( b1, b2 );
+    }
+    auto const slope = ( a2 > a1 ) ? ( b2 - b1 ) / ( a2 - a1 ) : 0.0;
+    auto const a_size = static_cast<long>( steep ? image.rows() : image.cols() );
+    auto const b_size = static_cast<long>( steep ? image.cols() : image.rows() );
+    auto const reach = 1.5 * r + 2.0;
+
+    auto const a_begin = std::max<long>( 0, std::floor( a1 - r - 1.0 ));
+    auto const a_end   = std::min<long>( a_size, std::ceil( a2 + r + 1.0 ));
+    for( long a = a_begin; a < a_end; ++a ) {
+        auto const ac = std::min( std::max( a + 0.5, a1 ), a2 );
+        auto const bc = b1 + slope * ( ac - a1 );
+        auto const b_begin = std::max<long>( 0, std::floor( bc - reach ));
+        auto const b_end   = std::min<long>( b_size, std::ceil( bc + reach ));
+        for( long b = b_begin; b < b_end; ++b ) {
+            auto const px = ( steep ? b : a ) + 0.5;
+            auto const py = ( steep ? a : b ) + 0.5;
+
+            // Distance of the pixel center to the segment.
+            double t = 0.0;
+            if( len2 > 0.0 ) {
+                t = std::min( std::max((( px - x1 ) * dx + ( py - y1 ) * dy ) / len2, 0.0 ), 1.0 );
+            }
+            auto const ex = px - ( x1 + t * dx );
+            auto const ey = py - ( y1 + t * dy );
+            auto const coverage = std::min( r + 0.5 - std::sqrt( ex * ex + ey * ey ), 1.0 );
+            if( coverage <= 0.0 ) {
+                continue;
+            }
+
+            auto& pixel = steep ? image( a, b ) : image( b, a );
+            pixel = genesis::utils::interpolate( pixel, color, coverage );
+        }
+    }
+}
+
+/**
+ * @brief Write a BMP file containing a tree with colored branches,
+ * using a layout from make_raster_tree_layout().
+ *
+ * This is a quick-look alternative to write_color_tree_to_svg() that is much faster to write
+ * and smaller for large trees, and does not need a copy of the layout per thread.
+ */
+inline void write_color_tree_to_bmp(
+    RasterTreeLayout const&          layout,
+    std::vector<genesis::utils::Color> const& colors_per_branch,
+    std::string const&               bmp_filename
+) {
+    if( colors_per_branch.size() != layout.edge_segments.size() ) {
+        throw std::runtime_error( "Branch colors vec of wrong size" );
+    }
+
+    auto image = genesis::utils::Matrix<genesis::utils::Color>(
+        layout.height, layout.width, genesis::utils::color_from_hex( "#ffffff" )
+    );
+    for( size_t e = 0; e < layout.edge_segments.size(); ++e ) {
+        for( auto const& segment : layout.edge_segments[e] ) {
+            draw_raster_line( image, segment, colors_per_branch[e], layout.stroke_width );
+        }
+    }
+    genesis::utils::BmpWriter().to_file( image, bmp_filename );
+}
+
+#endif // include guard
@@ -23,8 +23,13 @@
 
 #include "genesis/genesis.hpp"
 
+#include "../common/correlation.hpp"
+#include "../common/randomized_pca.hpp"
+
 #include <algorithm>
 #include <cmath>
+#include <limits>
+#include <numeric>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
@@ -103,6 +108,17 @@ int main( int argc, char** argv )
     assert( bals.rows() == trees.size() );
     assert( bals.cols() == trees[0].edge_count() );
 
+    // Correlations of all nodes and edges with all meta data columns at once.
+    LOG_INFO << "Computing Correlations";
+    auto meta_mat = Matrix<double>( trees.size(), meta.cols() );
+    for( auto const& col : meta ) {
+        for( size_t i = 0; i < trees.size(); ++i ) {
+            meta_mat( i, col.index() ) = col.as<double>()[ trees.name_at(i) ];
+        }
+    }
+    auto const ilr_corr = correlation_matrix( ilr,  meta_mat, true );
+    auto const bal_corr = correlation_matrix( bals, meta_mat, false );
+
     for( auto const& col : meta ) {
         LOG_INFO << "meta " << col.name();
 
@@ -121,7 +137,8 @@ int main( int argc, char** argv )
 
         std::vector<double> edge_vals_ilr( bal_data.tree.edge_count(), 0.0 );
         for( size_t i = 0; i < bal_data.tree.node_count(); ++i ) {
-            auto corr = spearmans_rank_correlation_coefficient( meta_vals, ilr.col(i) );
+            // auto corr = spearmans_rank_correlation_coefficient( meta_vals, ilr.col(i) );
+            auto corr = ilr_corr( i, col.index() );
             edge_vals_ilr[ bal_data.tree.node_at(i).primary_edge().index() ] = corr;
         }
 
@@ -133,7 +150,8 @@ int main( int argc, char** argv )
         std::vector<double> edge_vals_bal( bal_data.tree.edge_count(), 0.0 );
         for( size_t i = 0; i < bal_data.tree.edge_count(); ++i ) {
             // auto corr = spearmans_rank_correlation_coefficient( meta_vals, bals.col(i) );
-            auto corr = pearson_correlation_coefficient( meta_vals, bals.col(i) );
+            // auto corr = pearson_correlation_coefficient( meta_vals, bals.col(i) );
+            auto corr = bal_corr( i, col.index() );
             edge_vals_bal[ i ] = corr;
 
             if( corr > max_corr ) {
@@ -189,9 +207,7 @@ int main( int argc, char** argv )
     }
 
     LOG_INFO << "balance pca";
-    auto const pca = utils::principal_component_analysis(
-        bals, 5, utils::PcaStandardization::kCovariance
-    );
+    auto const pca = randomized_principal_component_analysis( bals, 5 );
     assert( pca.eigenvalues.size()  == 5 );
     assert( pca.eigenvectors.rows() == trees[0].edge_count() );
     assert( pca.eigenvectors.cols() == 5 );
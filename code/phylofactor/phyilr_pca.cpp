@@ -23,6 +23,8 @@
 
 #include "genesis/genesis.hpp"
 
+#include "../common/randomized_pca.hpp"
+
 #include <algorithm>
 #include <cmath>
 #include <string>
@@ -140,9 +142,7 @@ int main( int argc, char** argv )
 
     size_t const num_comp = 2;
     LOG_INFO << "Balance pca";
-    auto const pca = utils::principal_component_analysis(
-        bals_non_const, num_comp, utils::PcaStandardization::kCovariance
-    );
+    auto const pca = randomized_principal_component_analysis( bals_non_const, num_comp );
     assert( pca.eigenvalues.size()  == num_comp );
     // assert( pca.eigenvectors.rows() == trees[0].edge_count() );
     assert( pca.eigenvectors.cols() == num_comp );
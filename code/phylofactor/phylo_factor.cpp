@@ -23,9 +23,23 @@
 
 #include "genesis/genesis.hpp"
 
+#include "../common/correlation.hpp"
+#include "../common/edge_matrix_cache.hpp"
+#include "../common/fast_jplace_reader.hpp"
+#include "../common/randomized_pca.hpp"
+
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <random>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
@@ -74,6 +88,148 @@ Tree translate_tree_labels( Tree const& tree, std::string const& in_label_file )
     return result;
 }
 
+// =================================================================================================
+//     Edge Masses
+// =================================================================================================
+
+/**
+ * @brief Raw edge masses of a set of jplace files, without keeping the samples or mass trees.
+ */
+struct EdgeMassData
+{
+    // Reference tree, with edge indices as in all samples, without masses.
+    Tree tree;
+
+    // Samples x edges matrix of the summed placement masses per edge.
+    Matrix<double> edge_masses;
+    std::vector<std::string> sample_names;
+};
+
+/**
+ * @brief Raw edge masses of a set of jplace files, via the edge matrix cache.
+ *
+ * The samples are reduced to their rows of masses per edge right away, which is what
+ * `mass_tree_mass_per_edge()` yields for the mass trees of the samples, so that we never keep
+ * the whole SampleSet or its mass trees in memory. All files need to be placed on the same
+ * reference tree. We use the average branch length tree of the cache, as in the non-streaming
+ * path all mass trees are on that tree, so that `mass_balance_data()` yields it as well.
+ * The balances only depend on the topology, but the branch lengths are used for drawing.
+ */
+EdgeMassData read_edge_masses_cached( std::vector<std::string> const& jplace_files )
+{
+    auto selection = EdgeMatrixCacheSelection();
+    selection.weights    = false;
+    selection.imbalances = false;
+    auto cache = edge_matrix_cache( jplace_files, selection );
+
+    EdgeMassData result;
+    result.tree = convert_sample_to_mass_tree( Sample( cache.average_tree )).first;
+    mass_tree_clear_masses( result.tree );
+    result.edge_masses  = std::move( cache.masses );
+    result.sample_names = std::move( cache.sample_names );
+    return result;
+}
+
+/**
+ * @brief Compute the BalanceData from raw edge masses, following the same steps as
+ * `mass_balance_data()` does for mass trees: pseudo counts, taxon weights as the product of the
+ * central tendency of the masses and the norm of the relative masses per edge (as in PhILR),
+ * and closure of each sample.
+ *
+ * We cannot call `mass_balance_data()` itself here, as it takes one mass tree per sample, which
+ * is exactly what the streaming path avoids to keep in memory. It only uses the masses per edge
+ * of these trees though, so that the result is the same. If the genesis function changes,
+ * this needs to follow.
+ */
+BalanceData mass_balance_data_from_edge_masses(
+    EdgeMassData&& data,
+    BalanceSettings const& settings
+) {
+    BalanceData result;
+    result.tree = std::move( data.tree );
+    result.raw_edge_masses = std::move( data.edge_masses );
+    auto const rows = result.raw_edge_masses.rows();
+    auto const cols = result.raw_edge_masses.cols();
+
+    // Pseudo counts.
+    result.edge_masses = result.raw_edge_masses;
+    for( size_t r = 0; r < rows; ++r ) {
+        for( size_t c = 0; c < cols; ++c ) {
+            auto& val = result.edge_masses( r, c );
+            if( val == 0.0 ) {
+                val += settings.pseudo_count_summand_zeros;
+            }
+            val += settings.pseudo_count_summand_all;
+        }
+    }
+
+    // Central tendency of the masses per edge.
+    result.taxon_weights = std::vector<double>( cols, 1.0 );
+    #pragma omp parallel for
+    for( size_t c = 0; c < cols; ++c ) {
+        auto const column = result.edge_masses.col(c).to_vector();
+        switch( settings.tendency ) {
+            case BalanceSettings::WeightTendency::kNone: {
+                break;
+            }
+            case BalanceSettings::WeightTendency::kMedian: {
+                result.taxon_weights[c] = median( column );
+                break;
+            }
+            case BalanceSettings::WeightTendency::kArithmeticMean: {
+                result.taxon_weights[c] = arithmetic_mean( column );
+                break;
+            }
+            case BalanceSettings::WeightTendency::kGeometricMean: {
+                result.taxon_weights[c] = geometric_mean( column );
+                break;
+            }
+        }
+    }
+
+    // Closure, so that each sample sums up to one.
+    for( size_t r = 0; r < rows; ++r ) {
+        double sum = 0.0;
+        for( size_t c = 0; c < cols; ++c ) {
+            sum += result.edge_masses( r, c );
+        }
+        if( sum > 0.0 ) {
+            for( size_t c = 0; c < cols; ++c ) {
+                result.edge_masses( r, c ) /= sum;
+            }
+        }
+    }
+
+    // Norm of the relative masses per edge.
+    #pragma omp parallel for
+    for( size_t c = 0; c < cols; ++c ) {
+        auto const column = result.edge_masses.col(c).to_vector();
+        switch( settings.norm ) {
+            case BalanceSettings::WeightNorm::kNone: {
+                break;
+            }
+            case BalanceSettings::WeightNorm::kManhattan: {
+                result.taxon_weights[c] *= manhattan_norm( column );
+                break;
+            }
+            case BalanceSettings::WeightNorm::kEuclidean: {
+                result.taxon_weights[c] *= euclidean_norm( column );
+                break;
+            }
+            case BalanceSettings::WeightNorm::kMaximum: {
+                result.taxon_weights[c] *= maximum_norm( column );
+                break;
+            }
+            case BalanceSettings::WeightNorm::kAitchison: {
+                result.taxon_weights[c] *= aitchison_norm( column );
+                break;
+            }
+        }
+    }
+
+    return result;
+}
+
 // =================================================================================================
 //     read_data
 // =================================================================================================
@@ -86,8 +242,9 @@ struct PFData
     std::vector<std::string> col_names;
     int main_col_idx = -1;
 
-    SampleSet samples;
-    TreeSet trees;
+    // We do not keep the samples or mass trees, only their names,
+    // in the order of the rows of the balance data matrices.
+    std::vector<std::string> sample_names;
     Tree label_tree;
     BalanceData bal_data;
     LayoutParameters lm;
@@ -101,7 +258,8 @@ PFData read_data(
     std::string        main_col_name = "",
     double line_width = 10.0,
     std::string meta_sep_char = "\t",
-    bool use_only_main_col = false
+    bool use_only_main_col = false,
+    bool streaming = true
 ) {
     PFData data;
 
@@ -130,18 +288,36 @@ PFData read_data(
     LOG_INFO << report;
     LOG_INFO << "meta: " << meta.rows() << " x " << meta.cols();
 
-    LOG_INFO << "Reading jplace files";
-    data.samples = JplaceReader().read( from_files( utils::dir_list_files( in_jplace, ".*\\.jplace" )));
-    LOG_INFO << "samples: " << data.samples.size();
+    auto const jplace_files = utils::dir_list_files( in_jplace, true, ".*\\.jplace" );
+    if( streaming ) {
+        LOG_INFO << "Reading jplace files and reducing them to edge masses";
+        auto edge_masses = read_edge_masses_cached( jplace_files );
+        data.sample_names = edge_masses.sample_names;
+        LOG_INFO << "samples: " << data.sample_names.size();
 
-    LOG_INFO << "Converting to Mass Trees";
-    data.trees = convert_sample_set_to_mass_trees( data.samples, false ).first;
+        LOG_INFO << "Computing Balance data";
+        data.bal_data = mass_balance_data_from_edge_masses( std::move( edge_masses ), settings );
+        ladderize( data.bal_data.tree );
+    } else {
+        LOG_INFO << "Reading jplace files";
+        auto samples = FastJplaceReader().from_files( jplace_files );
+        LOG_INFO << "samples: " << samples.size();
 
-    for( size_t i = 0; i < data.trees.size(); ++i ) {
-        // LOG_DBG << "tree " << i << " " << data.trees.name_at(i);
-        // make_rooted( data.trees[i] );
-        ladderize( data.trees[i] );
+        LOG_INFO << "Converting to Mass Trees";
+        auto trees = convert_sample_set_to_mass_trees( samples, false ).first;
+        samples.clear();
+
+        for( size_t i = 0; i < trees.size(); ++i ) {
+            // make_rooted( trees[i] );
+            ladderize( trees[i] );
+        }
+        data.sample_names = trees.names();
+
+        LOG_INFO << "Computing Balance data";
+        data.bal_data = mass_balance_data( trees, settings );
     }
+    data.label_tree = translate_tree_labels( data.bal_data.tree, in_label_file );
+    auto const num_samples = data.sample_names.size();
 
     // Copy the meta data in the correct sample order.
     LOG_INFO << "Get meta vector";
@@ -149,34 +325,30 @@ PFData read_data(
         main_col_name = meta[0].name();
     }
     if( ! main_col_name.empty() ) {
-        auto meta_vals = std::vector<double>( data.trees.size(), 0.0 );
-        assert( meta.rows() == data.trees.size() );
-        for( size_t i = 0; i < data.trees.size(); ++i ) {
-            meta_vals[i] = meta[ main_col_name ].as<double>()[ data.trees.name_at(i) ];
+        auto meta_vals = std::vector<double>( num_samples, 0.0 );
+        assert( meta.rows() == num_samples );
+        for( size_t i = 0; i < num_samples; ++i ) {
+            meta_vals[i] = meta[ main_col_name ].as<double>()[ data.sample_names[i] ];
         }
         data.col_sort_indices = sort_indices( meta_vals.begin(), meta_vals.end() );
         data.main_col_idx = meta[ main_col_name ].index();
     } else {
-        data.col_sort_indices = std::vector<size_t>( data.trees.size() );
+        data.col_sort_indices = std::vector<size_t>( num_samples );
         std::iota( data.col_sort_indices.begin(), data.col_sort_indices.end(), 0 );
     }
 
-    data.meta_vals_mat = Matrix<double>( data.trees.size(), meta.cols() );
+    data.meta_vals_mat = Matrix<double>( num_samples, meta.cols() );
     data.col_names = std::vector<std::string>( meta.cols() );
-    assert( meta.rows() == data.trees.size() );
-    for( size_t i = 0; i < data.trees.size(); ++i ) {
+    assert( meta.rows() == num_samples );
+    for( size_t i = 0; i < num_samples; ++i ) {
         for( size_t c = 0; c < meta.cols(); ++c ) {
-            data.meta_vals_mat( i, c ) = meta[ c ].as<double>()[ data.trees.name_at(i) ];
+            data.meta_vals_mat( i, c ) = meta[ c ].as<double>()[ data.sample_names[i] ];
         }
     }
     for( size_t c = 0; c < meta.cols(); ++c ) {
         data.col_names[c] = meta[ c ].name();
     }
 
-    LOG_INFO << "Computing Balance data";
-    data.bal_data = mass_balance_data( data.trees, settings );
-    data.label_tree = translate_tree_labels( data.bal_data.tree, in_label_file );
-
     // Will need for all trees.
     data.lm.ladderize = false;
     // data.lm.stroke.width = 4;
@@ -186,6 +358,159 @@ PFData read_data(
     return data;
 }
 
+// =================================================================================================
+//     Prepared Color Trees
+// =================================================================================================
+
+/**
+ * @brief Layout of a tree that is computed once, for writing many SVG files of that tree
+ * which only differ in their edge colors.
+ *
+ * Each call of write_color_tree_to_svg_file() computes the node positions and edge paths anew.
+ * Here, we keep the layout, and per file only swap the edge strokes. Files are queued via add(),
+ * and written in parallel by write(). Once @p batch_size files are queued, they are written
+ * right away, so that we do not keep too many SVG documents in memory.
+ */
+class PreparedColorTree
+{
+public:
+
+    PreparedColorTree( Tree const& tree, LayoutParameters const& params, size_t batch_size = 64 )
+        : params_( params )
+        , batch_size_( batch_size )
+    {
+        switch( params.shape ) {
+            case LayoutShape::kCircular: {
+                layout_ = std::unique_ptr<LayoutBase>(
+                    new CircularLayout( tree, params.type, params.ladderize )
+                );
+                break;
+            }
+            case LayoutShape::kRectangular: {
+                layout_ = std::unique_ptr<LayoutBase>(
+                    new RectangularLayout( tree, params.type, params.ladderize )
+                );
+                break;
+            }
+            default: {
+                throw std::runtime_error( "Unknown tree layout shape." );
+            }
+        }
+    }
+
+    void add( std::vector<Color> const& colors, std::string const& filename )
+    {
+        queue_.emplace_back( make_document_( colors ), filename );
+        flush_if_full_();
+    }
+
+    void add(
+        std::vector<Color> const& colors,
+        ColorMap const& color_map,
+        ColorNormalization const& color_norm,
+        std::string const& filename
+    ) {
+        auto doc = make_document_( colors );
+        add_color_bar_( doc, color_map, color_norm );
+        queue_.emplace_back( std::move( doc ), filename );
+        flush_if_full_();
+    }
+
+    void add(
+        std::vector<double> const& values,
+        ColorMap const& color_map,
+        ColorNormalization const& color_norm,
+        std::string const& filename
+    ) {
+        add( color_map( color_norm, values ), color_map, color_norm, filename );
+    }
+
+    /**
+     * @brief Write all queued files, in parallel.
+     */
+    void write()
+    {
+        // We cannot throw from within the parallel region, so just note the file that went wrong.
+        std::string error_file;
+
+        #pragma omp parallel for schedule(dynamic)
+        for( size_t i = 0; i < queue_.size(); ++i ) {
+            try {
+                std::ostringstream out;
+                queue_[i].first.write( out );
+                utils::file_write( out.str(), queue_[i].second );
+            } catch( ... ) {
+                #pragma omp critical(prepared_color_tree_error)
+                {
+                    error_file = queue_[i].second;
+                }
+            }
+        }
+        queue_.clear();
+
+        if( ! error_file.empty() ) {
+            throw std::runtime_error( "Cannot write tree file " + error_file );
+        }
+    }
+
+private:
+
+    SvgDocument make_document_( std::vector<Color> const& colors )
+    {
+        if( colors.size() != layout_->tree().edge_count() ) {
+            throw std::runtime_error( "Edge colors vec of wrong size." );
+        }
+
+        std::vector<utils::SvgStroke> strokes;
+        strokes.reserve( colors.size() );
+        for( auto const& color : colors ) {
+            strokes.push_back( params_.stroke );
+            strokes.back().color = color;
+            strokes.back().line_cap = utils::SvgStroke::LineCap::kRound;
+        }
+        layout_->set_edge_strokes( strokes );
+        return layout_->to_svg_document();
+    }
+
+    void add_color_bar_(
+        SvgDocument& doc,
+        ColorMap const& color_map,
+        ColorNormalization const& color_norm
+    ) {
+        // Same placement as write_color_tree_to_svg_file(): half the height of the tree,
+        // to the right of it.
+        auto const bb = doc.bounding_box();
+        auto settings = SvgColorBarSettings();
+        settings.height = bb.height() / 2.0;
+        settings.width  = settings.height / 10.0;
+
+        auto bar = make_svg_color_bar( settings, color_map, color_norm );
+        if( params_.shape == LayoutShape::kCircular ) {
+            bar.second.transform.append( SvgTransform::Translate(
+                1.2 * bb.width() / 2.0, - settings.height / 2.0
+            ));
+        } else {
+            bar.second.transform.append( SvgTransform::Translate(
+                1.2 * bb.width(), bb.height() / 4.0
+            ));
+        }
+        doc.defs.push_back( bar.first );
+        doc.add( bar.second );
+    }
+
+    void flush_if_full_()
+    {
+        if( queue_.size() >= batch_size_ ) {
+            write();
+        }
+    }
+
+    std::unique_ptr<LayoutBase> layout_;
+    LayoutParameters params_;
+    size_t batch_size_;
+    std::vector<std::pair<SvgDocument, std::string>> queue_;
+};
+
 // =================================================================================================
 //     calc_and_write_balances_mat_and_pca
 // =================================================================================================
@@ -208,7 +533,7 @@ void calc_and_write_balances_mat_and_pca( PFData const& data, std::string const&
     // Preprae data and write out matrices
     auto mat = edge_balances( data.bal_data );
     utils::MatrixWriter<double>().to_file(
-        mat, out_dir + "edge_balances_all.csv", data.trees.names()
+        mat, out_dir + "edge_balances_all.csv", data.sample_names
     );
 
     // correlation per edge, if we have a main meta data feature to correlate with.
@@ -273,13 +598,13 @@ void calc_and_write_balances_mat_and_pca( PFData const& data, std::string const&
         cm.mask_color( utils::color_from_hex( "#dfdfdf" ));
         auto cn = ColorNormalizationDiverging( -1.0, 0.0, 1.0 );
 
+        auto main_col = Matrix<double>( data.meta_vals_mat.rows(), 1 );
+        main_col.col(0) = data.meta_vals_mat.col( data.main_col_idx ).to_vector();
+        auto const corr_mat = correlation_matrix( mat, main_col, true );
+
         auto corr = std::vector<double>( mat.cols(), 0.0 );
         for( size_t i = 0; i < mat.cols(); ++i ) {
-            corr[i] = spearmans_rank_correlation_coefficient(
-                mat.col(i).begin(), mat.col(i).end(),
-                data.meta_vals_mat.col(data.main_col_idx).begin(),
-                data.meta_vals_mat.col(data.main_col_idx).end()
-            );
+            corr[i] = corr_mat( i, 0 );
 
             assert(( -1.0 <= corr[i] && corr[i] <= 1.0 ) || ( ! std::isfinite(corr[i]) ) );
             // if( corr[i] > 0.5 || corr[i] < -0.5 ) {
@@ -304,9 +629,7 @@ void calc_and_write_balances_mat_and_pca( PFData const& data, std::string const&
     // Run PCA
     LOG_DBG1 << "pca";
     size_t components = 10;
-    auto pca = utils::principal_component_analysis(
-        mat, components, utils::PcaStandardization::kCovariance
-    );
+    auto pca = randomized_principal_component_analysis( mat, components );
 
     LOG_DBG1 << "results";
 
@@ -317,7 +640,7 @@ void calc_and_write_balances_mat_and_pca( PFData const& data, std::string const&
     utils::MatrixWriter<double>().to_file(
         pca.projection, out_dir + "edge_balances_pca_projection.csv"
     );
-    auto proj_meta = utils::Matrix<double>( data.trees.size(), components + data.meta_vals_mat.cols(), 0.0 );
+    auto proj_meta = utils::Matrix<double>( data.sample_names.size(), components + data.meta_vals_mat.cols(), 0.0 );
     assert( proj_meta.rows() == data.meta_vals_mat.rows() );
     for( size_t i = 0; i < components; ++i ) {
         proj_meta.col(i) = pca.projection.col(i).to_vector();
@@ -326,10 +649,11 @@ void calc_and_write_balances_mat_and_pca( PFData const& data, std::string const&
         proj_meta.col( components + i ) = data.meta_vals_mat.col(i).to_vector();
     }
     utils::MatrixWriter<double>().to_file(
-        proj_meta, out_dir + "edge_balances_pca_proj_meta.csv", data.trees.names()
+        proj_meta, out_dir + "edge_balances_pca_proj_meta.csv", data.sample_names
     );
 
     // Write trees
+    auto eigenvector_trees = PreparedColorTree( data.bal_data.tree, data.lm );
     for( size_t i = 0; i < components; ++i ) {
         auto edge_vals = std::vector<double>( data.bal_data.tree.edge_count(), 0.0 );
         for( size_t j = 0; j < non_const_edges.size(); ++j ) {
@@ -347,8 +671,8 @@ void calc_and_write_balances_mat_and_pca( PFData const& data, std::string const&
         auto cn = ColorNormalizationDiverging( edge_vals );
         cn.make_centric();
 
-        write_color_tree_to_svg_file(
-            data.bal_data.tree, data.lm, edge_vals, cm, cn,
+        eigenvector_trees.add(
+            edge_vals, cm, cn,
             out_dir + "edge_balances_pca_eigenvector_" + std::to_string(i) + ".svg"
         );
         //
@@ -362,6 +686,7 @@ void calc_and_write_balances_mat_and_pca( PFData const& data, std::string const&
         //     out_dir + "eigenvector_" + std::to_string(i) + ".svg"
         // );
     }
+    eigenvector_trees.write();
 }
 
 // =================================================================================================
@@ -373,7 +698,7 @@ void write_edge_masses_taxon_weights( PFData const& data, std::string const& out
     LOG_DBG << "write_edge_masses_taxon_weights";
 
     utils::MatrixWriter<double>().to_file(
-        data.bal_data.edge_masses, out_dir + "edge_masses.csv", data.trees.names()
+        data.bal_data.edge_masses, out_dir + "edge_masses.csv", data.sample_names
     );
     assert( data.bal_data.edge_masses.cols() == data.bal_data.tree.edge_count() );
     auto emtotal = std::vector<double>( data.bal_data.edge_masses.cols(), 0.0 );
@@ -385,13 +710,14 @@ void write_edge_masses_taxon_weights( PFData const& data, std::string const& out
         }
     }
     assert( emtotal.size() == data.bal_data.tree.edge_count() );
-    write_color_tree_to_svg_file(
-        data.label_tree, data.lm, emtotal,
+    auto trees = PreparedColorTree( data.label_tree, data.lm );
+    trees.add(
+        emtotal,
         ColorMap( color_list_viridis() ), ColorNormalizationLinear( emtotal ),
         out_dir + "edge_masses.svg"
     );
-    write_color_tree_to_svg_file(
-        data.label_tree, data.lm, emrtotal,
+    trees.add(
+        emrtotal,
         ColorMap( color_list_viridis() ), ColorNormalizationLinear( emrtotal ),
         out_dir + "edge_masses_raw.svg"
     );
@@ -402,13 +728,14 @@ void write_edge_masses_taxon_weights( PFData const& data, std::string const& out
             data.bal_data.taxon_weights.begin(), data.bal_data.taxon_weights.end()
         );
         if( mm.min < mm.max ) {
-            write_color_tree_to_svg_file(
-                data.label_tree, data.lm, data.bal_data.taxon_weights,
+            trees.add(
+                data.bal_data.taxon_weights,
                 ColorMap( color_list_viridis() ), ColorNormalizationLinear( data.bal_data.taxon_weights ),
                 out_dir + "taxon_weights.svg"
             );
         }
     }
+    trees.write();
 }
 
 // =================================================================================================
@@ -618,10 +945,38 @@ void write_heat_tree(
         utils::file_write( out.str(), out_dir + "heat_tree_" + mname + ".svg" );
     };
 
-    write_heattree_( ColorMap( color_list_viridis() ), ColorMap( color_list_viridis() ), "viridis" );
-    write_heattree_( ColorMap( color_list_heat() ), ColorMap( color_list_heat() ), "heat" );
-    write_heattree_( ColorMap( color_list_heat() ), ColorMap( color_list_viridis() ), "viridis_heat" );
-    write_heattree_( ColorMap( color_list_heat() ), ColorMap( color_list_bupubk() ), "bupubk_heat" );
+    // The variants are independent of each other, so we can write them in parallel.
+    // Each heat tree needs its own layout anyway, as the matrix columns are part of it.
+    struct HeatTreeVariant
+    {
+        ColorMap map_mat;
+        ColorMap map_tree;
+        std::string name;
+    };
+    auto const variants = std::vector<HeatTreeVariant>{{
+        { ColorMap( color_list_viridis() ), ColorMap( color_list_viridis() ), "viridis" },
+        { ColorMap( color_list_heat() ),    ColorMap( color_list_heat() ),    "heat" },
+        { ColorMap( color_list_heat() ),    ColorMap( color_list_viridis() ), "viridis_heat" },
+        { ColorMap( color_list_heat() ),    ColorMap( color_list_bupubk() ),  "bupubk_heat" }
+    }};
+
+    // We cannot throw from within the parallel region, so just note the variant that went wrong.
+    std::string error_msg;
+
+    #pragma omp parallel for schedule(dynamic)
+    for( size_t i = 0; i < variants.size(); ++i ) {
+        try {
+            write_heattree_( variants[i].map_mat, variants[i].map_tree, variants[i].name );
+        } catch( std::exception const& ex ) {
+            #pragma omp critical(heat_tree_error)
+            {
+                error_msg = variants[i].name + ": " + ex.what();
+            }
+        }
+    }
+    if( ! error_msg.empty() ) {
+        throw std::runtime_error( "Cannot write heat tree " + error_msg );
+    }
     // write_heattree_( ColorMap( color_list_orrd() ), "orrd" );
     // write_heattree_( ColorMap( color_list_ylorrd() ), "ylorrd" );
 }
@@ -716,9 +1071,9 @@ void write_factor_edges(
     PFData const& data, std::vector<PhyloFactor> const& factors, std::string const& out_dir
 ) {
     auto const found_factors = factors.size();
-    assert( data.col_sort_indices.size() == data.trees.size() );
+    assert( data.col_sort_indices.size() == data.sample_names.size() );
     auto balances = utils::Matrix<double>(
-        data.trees.size(), found_factors + data.meta_vals_mat.cols()
+        data.sample_names.size(), found_factors + data.meta_vals_mat.cols()
     );
     auto col_names = std::vector<std::string>( data.meta_vals_mat.cols() + found_factors );
 
@@ -731,6 +1086,7 @@ void write_factor_edges(
 
     std::ofstream factor_taxa_of;
     file_output_stream( out_dir + "factor_taxa.txt", factor_taxa_of );
+    auto trees = PreparedColorTree( data.label_tree, data.lm );
 
     for( size_t i = 0; i < found_factors; ++i ) {
         auto const& factor = factors[i];
@@ -739,10 +1095,7 @@ void write_factor_edges(
 
         // Make a tree with the edges of that factor.
         auto edge_cols = phylo_factor_single_factor_colors( data.bal_data.tree, factors, i );
-        write_color_tree_to_svg_file(
-            data.label_tree, data.lm, edge_cols,
-            out_dir + "factor_edges_" + std::to_string(i) + ".svg"
-        );
+        trees.add( edge_cols, out_dir + "factor_edges_" + std::to_string(i) + ".svg" );
 
         assert( factor.balances.size() == balances.rows() );
         balances.col(i) = factor.balances;
@@ -751,8 +1104,8 @@ void write_factor_edges(
         // write objective value trees
         auto cm = ColorMap( color_list_viridis() );
         cm.mask_color( Color( 0.8, 0.8, 0.8 ));
-        write_color_tree_to_svg_file(
-            data.label_tree, data.lm, factor.all_objective_values,
+        trees.add(
+            factor.all_objective_values,
             cm, ColorNormalizationLinear( factor.all_objective_values ),
             out_dir + "ovs_" + std::to_string(i) + ".svg"
         );
@@ -771,10 +1124,11 @@ void write_factor_edges(
         }
         factor_taxa_of << "\n";
     }
+    trees.write();
 
     // Write balances of the factors.
     utils::MatrixWriter<double>().to_file(
-        balances, out_dir + "factor_balances.csv", data.trees.names(), col_names, "sample"
+        balances, out_dir + "factor_balances.csv", data.sample_names, col_names, "sample"
     );
 }
 
@@ -835,27 +1189,167 @@ double obj_fct_lin_reg( PFData const& data, std::vector<double> const& balances
     // return err;
 }
 
+/**
+ * @brief Objective function that fits a full GLM per candidate.
+ *
+ * This is called concurrently by parallel_phylogenetic_factorization(), and hence does not log
+ * from inside. Non-finite deviances simply yield a non-finite objective value, which is reported
+ * by the factorization after each iteration.
+ */
 double obj_fct_glm( PFData const& data, std::vector<double> const& balances )
 {
     GlmExtras extras;
     // extras.mean_deviance = true;
     auto const fit = glm_fit( data.meta_vals_mat, balances, glm_family_gaussian(), extras );
-    if( !fit.converged ) {
-        LOG_DBG << "did not converge";
+    return fit.null_deviance - fit.deviance;
+}
+
+// =================================================================================================
+//     Fixed Design GLM
+// =================================================================================================
+
+/**
+ * @brief Precomputed design for a gaussian GLM with identity link, intercept and unit weights.
+ *
+ * The design matrix (meta data) is the same for all candidate balances. With an intercept, the
+ * difference between null deviance and deviance of such a model is the squared norm of the
+ * projection of the response onto the column space of the centered design. We hence center the
+ * design once and compute an orthonormal basis of its columns (modified Gram-Schmidt).
+ * Collinear columns are dropped, as `glm_fit` does with aliased predictors.
+ * Evaluating a balance vector is then just one product with that basis, instead of a full fit.
+ */
+struct GlmDesign
+{
+    // Orthonormal basis of the centered design, samples x rank.
+    Matrix<double> basis;
+};
+
+GlmDesign glm_prepare_design( Matrix<double> const& x_predictors, double tolerance = 1e-8 )
+{
+    auto const n = x_predictors.rows();
+    auto const p = x_predictors.cols();
+    if( n == 0 ) {
+        throw std::runtime_error( "Cannot prepare GLM design without samples." );
     }
 
-    if( ! std::isfinite(fit.null_deviance) ) {
-        LOG_DBG << "fit.null_deviance " << fit.null_deviance;
+    // Center the columns, which accounts for the intercept.
+    std::vector<std::vector<double>> cols;
+    for( size_t c = 0; c < p; ++c ) {
+        auto col = x_predictors.col(c).to_vector();
+        double mean = 0.0;
+        for( auto v : col ) {
+            mean += v;
+        }
+        mean /= static_cast<double>( n );
+        for( auto& v : col ) {
+            v -= mean;
+        }
+
+        // Orthogonalize against the previous basis vectors.
+        double norm_orig = 0.0;
+        for( auto v : col ) {
+            norm_orig += v * v;
+        }
+        for( auto const& q : cols ) {
+            double dot = 0.0;
+            for( size_t i = 0; i < n; ++i ) {
+                dot += q[i] * col[i];
+            }
+            for( size_t i = 0; i < n; ++i ) {
+                col[i] -= dot * q[i];
+            }
+        }
+        double norm = 0.0;
+        for( auto v : col ) {
+            norm += v * v;
+        }
+
+        // Skip constant and collinear columns.
+        if( ! std::isfinite( norm ) ) {
+            throw std::runtime_error( "Non-finite values in GLM design matrix." );
+        }
+        if( norm <= tolerance * norm_orig || norm == 0.0 ) {
+            LOG_WARN << "GLM design column " << c << " is collinear with previous columns, skipping";
+            continue;
+        }
+        norm = std::sqrt( norm );
+        for( auto& v : col ) {
+            v /= norm;
+        }
+        cols.push_back( std::move( col ));
     }
-    if( ! std::isfinite(fit.deviance) ) {
-        LOG_DBG << "fit.deviance " << fit.deviance;
+
+    GlmDesign result;
+    result.basis = Matrix<double>( n, cols.size() );
+    for( size_t k = 0; k < cols.size(); ++k ) {
+        for( size_t i = 0; i < n; ++i ) {
+            result.basis( i, k ) = cols[k][i];
+        }
+    }
+    LOG_INFO << "GLM design with " << n << " samples and rank " << cols.size() << " of " << p;
+    return result;
+}
+
+/**
+ * @brief Same as obj_fct_glm(), that is, `null_deviance - deviance`, but using a precomputed design.
+ */
+double obj_fct_glm_design( GlmDesign const& design, std::vector<double> const& balances )
+{
+    auto const& basis = design.basis;
+    assert( balances.size() == basis.rows() );
+
+    // As the basis is orthogonal to the intercept, we do not need to center the balances.
+    double result = 0.0;
+    for( size_t k = 0; k < basis.cols(); ++k ) {
+        double dot = 0.0;
+        for( size_t i = 0; i < basis.rows(); ++i ) {
+            dot += basis( i, k ) * balances[i];
+        }
+        result += dot * dot;
     }
-    if( ! std::isfinite(fit.null_deviance) || ! std::isfinite(fit.deviance) ) {
-        LOG_DBG << "data.meta_vals_mat " << join( data.meta_vals_mat );
-        LOG_DBG << "balances " << join( balances );
+    return result;
+}
+
+/**
+ * @brief Evaluate obj_fct_glm_design() for many candidate balance vectors at once.
+ *
+ * The @p balances matrix has one row per sample and one column per candidate.
+ * This is a single matrix product of the transposed basis with the balances, computed in blocks of
+ * candidate columns, which are distributed over the threads.
+ */
+std::vector<double> obj_fct_glm_design( GlmDesign const& design, Matrix<double> const& balances )
+{
+    auto const& basis = design.basis;
+    if( balances.rows() != basis.rows() ) {
+        throw std::runtime_error( "Balances matrix does not fit the GLM design." );
     }
 
-    return fit.null_deviance - fit.deviance;
+    auto const n = basis.rows();
+    auto const m = balances.cols();
+    size_t const block_size = 256;
+    auto const num_blocks = ( m + block_size - 1 ) / block_size;
+    auto result = std::vector<double>( m, 0.0 );
+
+    #pragma omp parallel for schedule(dynamic)
+    for( size_t b = 0; b < num_blocks; ++b ) {
+        auto const beg = b * block_size;
+        auto const end = std::min( beg + block_size, m );
+        auto dots = std::vector<double>( end - beg );
+
+        for( size_t k = 0; k < basis.cols(); ++k ) {
+            std::fill( dots.begin(), dots.end(), 0.0 );
+            for( size_t i = 0; i < n; ++i ) {
+                auto const q = basis( i, k );
+                for( size_t j = beg; j < end; ++j ) {
+                    dots[ j - beg ] += q * balances( i, j );
+                }
+            }
+            for( size_t j = beg; j < end; ++j ) {
+                result[j] += dots[ j - beg ] * dots[ j - beg ];
+            }
+        }
+    }
+    return result;
 }
 
 double obj_fct_phyca( PFData const& data, std::vector<double> const& balances )
@@ -871,6 +1365,765 @@ double obj_fct_phyca( PFData const& data, std::vector<double> const& balances )
     return ms.stddev * ms.stddev;
 }
 
+// =================================================================================================
+//     Parallel Phylogenetic Factorization
+// =================================================================================================
+
+/**
+ * @brief Objective function for the factorization. Is called concurrently from several threads
+ * with different balance vectors, and hence needs to be thread-safe (in particular, no logging).
+ */
+using PhyloFactorObjective = std::function<double( std::vector<double> const& balances )>;
+
+/**
+ * @brief Get the indices of all edges of the subtree that starts at the given link,
+ * stopping at edges that are not candidates any more (the edges of previously found factors).
+ * The edge of the link itself is not part of the result.
+ */
+std::unordered_set<size_t> pf_subtree_edge_indices(
+    TreeLink const& start, std::vector<bool> const& is_candidate
+) {
+    std::unordered_set<size_t> result;
+    auto cur_link = &start.next();
+    while( cur_link != &start ) {
+        auto const eidx = cur_link->edge().index();
+        if( ! is_candidate[ eidx ] ) {
+            cur_link = &cur_link->next();
+            continue;
+        }
+        result.insert( eidx );
+        cur_link = &cur_link->outer().next();
+    }
+    return result;
+}
+
+/**
+ * @brief Calculate the isometric log ratio balances between the masses of the numerator and
+ * denominator edges, as `mass_balance()` does, but into a given buffer, so that each thread can
+ * reuse its own scratch memory.
+ */
+void pf_mass_balance(
+    BalanceData const& data,
+    std::unordered_set<size_t> const& numerator_edge_indices,
+    std::unordered_set<size_t> const& denominator_edge_indices,
+    std::vector<double>& buffer
+) {
+    auto const& masses  = data.edge_masses;
+    auto const& weights = data.taxon_weights;
+    buffer.resize( masses.rows() );
+
+    double num_weight = 0.0;
+    for( auto const idx : numerator_edge_indices ) {
+        num_weight += weights[ idx ];
+    }
+    double den_weight = 0.0;
+    for( auto const idx : denominator_edge_indices ) {
+        den_weight += weights[ idx ];
+    }
+    auto const scaling = std::sqrt( num_weight * den_weight / ( num_weight + den_weight ));
+
+    // Weighted means of the log masses are the logs of the weighted geometric means.
+    for( size_t t = 0; t < masses.rows(); ++t ) {
+        double num_log = 0.0;
+        for( auto const idx : numerator_edge_indices ) {
+            num_log += weights[ idx ] * std::log( masses( t, idx ));
+        }
+        double den_log = 0.0;
+        for( auto const idx : denominator_edge_indices ) {
+            den_log += weights[ idx ] * std::log( masses( t, idx ));
+        }
+        buffer[t] = scaling * ( num_log / num_weight - den_log / den_weight );
+    }
+}
+
+/**
+ * @brief Weighted log edge masses, edges x samples, that is, `w_e * log( m_te )`.
+ * These do not change during the factorization, so we compute the expensive logs only once.
+ */
+Matrix<double> pf_weighted_log_masses( BalanceData const& data )
+{
+    auto const& masses = data.edge_masses;
+    auto result = Matrix<double>( masses.cols(), masses.rows() );
+
+    #pragma omp parallel for
+    for( size_t e = 0; e < masses.cols(); ++e ) {
+        for( size_t t = 0; t < masses.rows(); ++t ) {
+            result( e, t ) = data.taxon_weights[ e ] * std::log( masses( t, e ));
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Edge indices of the tree in preorder, that is, each edge comes after the edge above it.
+ */
+std::vector<size_t> pf_preorder_edges( Tree const& tree )
+{
+    std::vector<size_t> result;
+    auto visited = std::vector<bool>( tree.edge_count(), false );
+
+    // Euler tour around the tree. Each edge is passed twice, first on the way down.
+    auto const& start = tree.root_node().link();
+    auto cur_link = &start;
+    do {
+        auto const eidx = cur_link->edge().index();
+        if( ! visited[ eidx ] ) {
+            visited[ eidx ] = true;
+            result.push_back( eidx );
+        }
+        cur_link = &cur_link->outer().next();
+    } while( cur_link != &start );
+
+    assert( result.size() == tree.edge_count() );
+    return result;
+}
+
+/**
+ * @brief Sums of weighted log masses, weights, and edge counts per subtree and per region,
+ * for the current set of candidate edges.
+ *
+ * The edges of the factors found so far split the tree into regions of candidate edges that are
+ * connected via nodes. A candidate edge splits its region into the subtree below it (secondary
+ * side) and the rest of the region (primary side), which are exactly the edges that
+ * pf_subtree_edge_indices() yields. We compute the secondary sums in one postorder pass, and the
+ * primary sums as the complement via the region totals. Each candidate balance is then O(1) per
+ * sample, instead of O(edges).
+ *
+ * All sums, and the weighted log masses they are made of, are kept as doubles on purpose: the
+ * primary side is the difference of a region sum over up to all edges and a subtree sum, which
+ * cancels most of their digits. In single precision, that difference would be off in the second
+ * or third digit for large trees, and change which edge wins. Both matrices are edges x samples,
+ * so that the per-edge loops already read them linearly.
+ */
+struct PfSubtreeSums
+{
+    // Per edge: sums over the candidate edges below it, not including the edge itself.
+    Matrix<double>      subtree_log_sums;
+    std::vector<double> subtree_weights;
+    std::vector<size_t> subtree_counts;
+
+    // Per edge: the region it belongs to, and per region: sums over all of its edges.
+    std::vector<size_t> edge_regions;
+    Matrix<double>      region_log_sums;
+    std::vector<double> region_weights;
+    std::vector<size_t> region_counts;
+};
+
+PfSubtreeSums pf_subtree_sums(
+    BalanceData const& data,
+    Matrix<double> const& weighted_log_masses,
+    std::vector<size_t> const& preorder_edges,
+    std::vector<bool> const& is_candidate
+) {
+    auto const& tree = data.tree;
+    auto const num_edges = tree.edge_count();
+    auto const num_samples = weighted_log_masses.cols();
+    auto const npos = std::numeric_limits<size_t>::max();
+
+    PfSubtreeSums result;
+    result.subtree_log_sums = Matrix<double>( num_edges, num_samples, 0.0 );
+    result.subtree_weights  = std::vector<double>( num_edges, 0.0 );
+    result.subtree_counts   = std::vector<size_t>( num_edges, 0 );
+    result.edge_regions     = std::vector<size_t>( num_edges, npos );
+
+    // Assign regions top-down. Candidate edges below a blocked edge (or the root) start a new
+    // region, which is shared by all candidate edges attached to that same node.
+    auto node_regions = std::vector<size_t>( tree.node_count(), npos );
+    size_t num_regions = 0;
+    for( auto const eidx : preorder_edges ) {
+        if( ! is_candidate[ eidx ] ) {
+            continue;
+        }
+        auto const& node = tree.edge_at( eidx ).primary_node();
+        bool const is_root = ( node.index() == tree.root_node().index() );
+        auto const parent_eidx = node.primary_link().edge().index();
+        if( ! is_root && is_candidate[ parent_eidx ] ) {
+            result.edge_regions[ eidx ] = result.edge_regions[ parent_eidx ];
+        } else {
+            if( node_regions[ node.index() ] == npos ) {
+                node_regions[ node.index() ] = num_regions++;
+            }
+            result.edge_regions[ eidx ] = node_regions[ node.index() ];
+        }
+    }
+
+    // Accumulate bottom-up: each candidate edge adds itself and its subtree to the edge above,
+    // as long as that one is a candidate as well, and to its region.
+    result.region_log_sums = Matrix<double>( num_regions, num_samples, 0.0 );
+    result.region_weights  = std::vector<double>( num_regions, 0.0 );
+    result.region_counts   = std::vector<size_t>( num_regions, 0 );
+    for( auto it = preorder_edges.rbegin(); it != preorder_edges.rend(); ++it ) {
+        auto const eidx = *it;
+        if( ! is_candidate[ eidx ] ) {
+            continue;
+        }
+        auto const weight = data.taxon_weights[ eidx ];
+        auto const region = result.edge_regions[ eidx ];
+        for( size_t t = 0; t < num_samples; ++t ) {
+            result.region_log_sums( region, t ) += weighted_log_masses( eidx, t );
+        }
+        result.region_weights[ region ] += weight;
+        ++result.region_counts[ region ];
+
+        auto const& node = tree.edge_at( eidx ).primary_node();
+        if( node.index() == tree.root_node().index() ) {
+            continue;
+        }
+        auto const parent_eidx = node.primary_link().edge().index();
+        if( ! is_candidate[ parent_eidx ] ) {
+            continue;
+        }
+        for( size_t t = 0; t < num_samples; ++t ) {
+            result.subtree_log_sums( parent_eidx, t )
+                += weighted_log_masses( eidx, t ) + result.subtree_log_sums( eidx, t );
+        }
+        result.subtree_weights[ parent_eidx ] += weight + result.subtree_weights[ eidx ];
+        result.subtree_counts[ parent_eidx ]  += 1 + result.subtree_counts[ eidx ];
+    }
+    return result;
+}
+
+/**
+ * @brief Balances of a candidate edge from the subtree sums, primary side as numerator,
+ * same as pf_mass_balance() on the two edge index sets. Returns `false` if one side is empty.
+ */
+bool pf_candidate_balance(
+    BalanceData const& data,
+    Matrix<double> const& weighted_log_masses,
+    PfSubtreeSums const& sums,
+    size_t edge_index,
+    std::vector<double>& buffer
+) {
+    auto const region = sums.edge_regions[ edge_index ];
+    auto const s_count = sums.subtree_counts[ edge_index ];
+    auto const p_count = sums.region_counts[ region ] - s_count - 1;
+    if( s_count == 0 || p_count == 0 ) {
+        return false;
+    }
+
+    auto const s_weight = sums.subtree_weights[ edge_index ];
+    auto const p_weight
+        = sums.region_weights[ region ] - s_weight - data.taxon_weights[ edge_index ]
+    ;
+    auto const scaling = std::sqrt( p_weight * s_weight / ( p_weight + s_weight ));
+
+    auto const num_samples = weighted_log_masses.cols();
+    buffer.resize( num_samples );
+    for( size_t t = 0; t < num_samples; ++t ) {
+        auto const s_log = sums.subtree_log_sums( edge_index, t );
+        auto const p_log
+            = sums.region_log_sums( region, t ) - s_log - weighted_log_masses( edge_index, t )
+        ;
+        buffer[t] = scaling * ( p_log / p_weight - s_log / s_weight );
+    }
+    return true;
+}
+
+/**
+ * @brief Find the candidate edge that maximizes the objective, evaluating the candidates in
+ * parallel. Ties are broken towards the smaller edge index, so that the result does not depend
+ * on the number of threads or on the scheduling.
+ */
+PhyloFactor pf_find_best_edge(
+    BalanceData const& data,
+    Matrix<double> const& weighted_log_masses,
+    std::vector<size_t> const& preorder_edges,
+    std::vector<bool> const& is_candidate,
+    PhyloFactorObjective const& objective
+) {
+    auto const& tree = data.tree;
+    auto const nan = std::numeric_limits<double>::quiet_NaN();
+
+    std::vector<size_t> candidates;
+    for( size_t i = 0; i < tree.edge_count(); ++i ) {
+        if( is_candidate[i] ) {
+            candidates.push_back( i );
+        }
+    }
+
+    PhyloFactor result;
+    result.all_objective_values = std::vector<double>( tree.edge_count(), nan );
+    auto evaluated = std::vector<char>( candidates.size(), 0 );
+    auto const sums = pf_subtree_sums( data, weighted_log_masses, preorder_edges, is_candidate );
+
+    #pragma omp parallel for schedule(dynamic)
+    for( size_t c = 0; c < candidates.size(); ++c ) {
+        // One scratch buffer per thread, so that we do not allocate balances for each candidate.
+        thread_local std::vector<double> buffer;
+
+        if( ! pf_candidate_balance( data, weighted_log_masses, sums, candidates[c], buffer )) {
+            continue;
+        }
+        result.all_objective_values[ candidates[c] ] = objective( buffer );
+        evaluated[c] = 1;
+    }
+
+    // Serial reduction over the edges in index order.
+    size_t non_finite = 0;
+    result.edge_index = std::numeric_limits<size_t>::max();
+    result.objective_value = - std::numeric_limits<double>::infinity();
+    for( size_t c = 0; c < candidates.size(); ++c ) {
+        auto const ov = result.all_objective_values[ candidates[c] ];
+        if( ! evaluated[c] ) {
+            continue;
+        }
+        if( ! std::isfinite( ov )) {
+            ++non_finite;
+            continue;
+        }
+        if( ov > result.objective_value ) {
+            result.edge_index = candidates[c];
+            result.objective_value = ov;
+        }
+    }
+    if( non_finite > 0 ) {
+        LOG_WARN << non_finite << " candidate edges with non-finite objective value";
+    }
+    if( result.edge_index == std::numeric_limits<size_t>::max() ) {
+        throw std::runtime_error( "No candidate edge with a finite objective value found." );
+    }
+
+    // Recompute the sets and balances of the winner, instead of keeping them for all candidates.
+    auto const& edge = tree.edge_at( result.edge_index );
+    result.edge_indices_primary   = pf_subtree_edge_indices( edge.primary_link(), is_candidate );
+    result.edge_indices_secondary = pf_subtree_edge_indices( edge.secondary_link(), is_candidate );
+    pf_mass_balance(
+        data, result.edge_indices_primary, result.edge_indices_secondary, result.balances
+    );
+    return result;
+}
+
+/**
+ * @brief Same as `phylogenetic_factorization()`, but evaluating the candidate edges of each
+ * iteration on all threads. The @p objective has to be thread-safe.
+ *
+ * The factorization continues after the @p initial_factors, e.g., from a checkpoint, so that
+ * a run can be resumed or extended to more factors without redoing the earlier iterations.
+ * After each iteration, @p on_factor is called with all factors found so far.
+ */
+std::vector<PhyloFactor> parallel_phylogenetic_factorization(
+    BalanceData const& data,
+    PhyloFactorObjective const& objective,
+    size_t max_iterations = 0,
+    std::function<void( size_t iteration, size_t max_iterations )> log_progress = {},
+    std::vector<PhyloFactor> initial_factors = {},
+    std::function<void( std::vector<PhyloFactor> const& factors )> on_factor = {}
+) {
+    auto is_candidate = std::vector<bool>( data.tree.edge_count(), true );
+    auto const weighted_log_masses = pf_weighted_log_masses( data );
+    auto const preorder_edges = pf_preorder_edges( data.tree );
+    if( max_iterations == 0 || max_iterations > data.tree.edge_count() ) {
+        max_iterations = data.tree.edge_count();
+    }
+
+    std::vector<PhyloFactor> result = std::move( initial_factors );
+    if( result.size() > max_iterations ) {
+        result.resize( max_iterations );
+    }
+    for( auto const& factor : result ) {
+        if( factor.edge_index >= is_candidate.size() || ! is_candidate[ factor.edge_index ] ) {
+            throw std::runtime_error( "Invalid initial factors for phylo factorization." );
+        }
+        is_candidate[ factor.edge_index ] = false;
+    }
+
+    while( result.size() < max_iterations ) {
+        if( log_progress ) {
+            log_progress( result.size() + 1, max_iterations );
+        }
+        result.push_back( pf_find_best_edge(
+            data, weighted_log_masses, preorder_edges, is_candidate, objective
+        ));
+        is_candidate[ result.back().edge_index ] = false;
+        if( on_factor ) {
+            on_factor( result );
+        }
+    }
+    return result;
+}
+
+// =================================================================================================
+//     Checkpoints
+// =================================================================================================
+
+/**
+ * @brief 64 bit FNV-1a hash of everything that the factors depend on: the tree topology, the
+ * balance data and its settings, the samples, the meta data, and the name of the @p objective.
+ *
+ * A checkpoint is only resumed if this hash is the same, so that changed input files or settings
+ * do not silently mix factors of two different runs.
+ */
+uint64_t factorization_input_hash(
+    PFData const& data,
+    BalanceSettings const& settings,
+    std::string const& objective
+) {
+    uint64_t hash = 14695981039346656037ull;
+    auto add_bytes = [&]( void const* ptr, size_t size ){
+        auto const bytes = static_cast<unsigned char const*>( ptr );
+        for( size_t i = 0; i < size; ++i ) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+    };
+    auto add_size = [&]( size_t value ){
+        auto const v = static_cast<uint64_t>( value );
+        add_bytes( &v, sizeof( v ));
+    };
+    auto add_double = [&]( double value ){
+        add_bytes( &value, sizeof( value ));
+    };
+    auto add_string = [&]( std::string const& str ){
+        add_size( str.size() );
+        add_bytes( str.data(), str.size() );
+    };
+    auto add_matrix = [&]( Matrix<double> const& mat ){
+        add_size( mat.rows() );
+        add_size( mat.cols() );
+        for( size_t r = 0; r < mat.rows(); ++r ) {
+            for( size_t c = 0; c < mat.cols(); ++c ) {
+                add_double( mat( r, c ));
+            }
+        }
+    };
+
+    auto const& bal_data = data.bal_data;
+    add_size( bal_data.tree.edge_count() );
+    for( auto const& edge : bal_data.tree.edges() ) {
+        add_size( edge.primary_node().index() );
+        add_size( edge.secondary_node().index() );
+    }
+    add_matrix( bal_data.raw_edge_masses );
+    add_matrix( bal_data.edge_masses );
+    add_size( bal_data.taxon_weights.size() );
+    for( auto const w : bal_data.taxon_weights ) {
+        add_double( w );
+    }
+
+    add_size( static_cast<size_t>( settings.tendency ));
+    add_size( static_cast<size_t>( settings.norm ));
+    add_double( settings.pseudo_count_summand_all );
+    add_double( settings.pseudo_count_summand_zeros );
+
+    add_size( data.sample_names.size() );
+    for( auto const& name : data.sample_names ) {
+        add_string( name );
+    }
+    add_matrix( data.meta_vals_mat );
+    add_string( objective );
+    return hash;
+}
+
+/**
+ * @brief Write the factors found so far, so that the factorization can be resumed from there.
+ *
+ * This is a simple text format, with one line per field of each factor. The other state of the
+ * factorization (candidate edges, log masses and subtree sums) is cheap to recompute from the
+ * factors and the balance data. The @p input_hash of factorization_input_hash() is stored in the
+ * header. We write to a temporary file first and rename it, so that a job that dies while writing
+ * does not leave a broken checkpoint behind.
+ */
+void write_factorization_checkpoint(
+    BalanceData const& data,
+    uint64_t input_hash,
+    std::vector<PhyloFactor> const& factors,
+    std::string const& filename
+) {
+    auto const tmp_filename = filename + ".tmp";
+    {
+        std::ofstream cp_of;
+        file_output_stream( tmp_filename, cp_of );
+        cp_of << std::setprecision( 17 );
+        cp_of << "phylo_factor_checkpoint 2\n";
+        cp_of << data.tree.edge_count() << " " << data.edge_masses.rows() << " ";
+        cp_of << factors.size() << " " << input_hash << "\n";
+
+        auto write_values = [&]( std::string const& key, std::vector<double> const& values ){
+            cp_of << key << " " << values.size();
+            for( auto const v : values ) {
+                cp_of << " " << v;
+            }
+            cp_of << "\n";
+        };
+        auto write_indices = [&]( std::string const& key, std::unordered_set<size_t> const& set ){
+            auto indices = std::vector<size_t>( set.begin(), set.end() );
+            std::sort( indices.begin(), indices.end() );
+            cp_of << key << " " << indices.size();
+            for( auto const i : indices ) {
+                cp_of << " " << i;
+            }
+            cp_of << "\n";
+        };
+
+        for( auto const& factor : factors ) {
+            cp_of << "factor " << factor.edge_index << " " << factor.objective_value << "\n";
+            write_indices( "primary", factor.edge_indices_primary );
+            write_indices( "secondary", factor.edge_indices_secondary );
+            write_values( "balances", factor.balances );
+            write_values( "objectives", factor.all_objective_values );
+        }
+    }
+    if( std::rename( tmp_filename.c_str(), filename.c_str() ) != 0 ) {
+        throw std::runtime_error( "Cannot write checkpoint file " + filename );
+    }
+}
+
+/**
+ * @brief Read the factors of a checkpoint, and check that they fit the balance data.
+ *
+ * Throws if the checkpoint was written for other inputs or settings, that is, if its hash
+ * differs from the @p input_hash of this run. In that case, the checkpoint has to be removed
+ * in order to start over.
+ */
+std::vector<PhyloFactor> read_factorization_checkpoint(
+    BalanceData const& data,
+    uint64_t input_hash,
+    std::string const& filename
+) {
+    std::ifstream cp_if( filename );
+    if( ! cp_if ) {
+        throw std::runtime_error( "Cannot read checkpoint file " + filename );
+    }
+
+    // Numbers are read via stod, which also works for nan and inf values.
+    auto next_token = [&](){
+        std::string token;
+        if( !( cp_if >> token )) {
+            throw std::runtime_error( "Unexpected end of checkpoint file " + filename );
+        }
+        return token;
+    };
+    auto expect = [&]( std::string const& key ){
+        if( next_token() != key ) {
+            throw std::runtime_error( "Invalid checkpoint file " + filename + ", expecting " + key );
+        }
+    };
+    auto read_values = [&]( std::string const& key ){
+        expect( key );
+        auto values = std::vector<double>( std::stoull( next_token() ));
+        for( auto& v : values ) {
+            v = std::stod( next_token() );
+        }
+        return values;
+    };
+    auto read_indices = [&]( std::string const& key ){
+        expect( key );
+        std::unordered_set<size_t> indices;
+        auto const size = std::stoull( next_token() );
+        for( size_t i = 0; i < size; ++i ) {
+            indices.insert( std::stoull( next_token() ));
+        }
+        return indices;
+    };
+
+    expect( "phylo_factor_checkpoint" );
+    if( next_token() != "2" ) {
+        throw std::runtime_error(
+            "Checkpoint file " + filename + " was written by an older version, "
+            "and does not contain the hash of its inputs. Remove it to start over."
+        );
+    }
+    auto const edges   = std::stoull( next_token() );
+    auto const samples = std::stoull( next_token() );
+    auto const size    = std::stoull( next_token() );
+    auto const hash    = std::stoull( next_token() );
+    if( edges != data.tree.edge_count() || samples != data.edge_masses.rows() ) {
+        throw std::runtime_error( "Checkpoint file " + filename + " does not fit the data." );
+    }
+    if( hash != input_hash ) {
+        throw std::runtime_error(
+            "Checkpoint file " + filename + " was written for different input data or settings. "
+            "Remove it to start over."
+        );
+    }
+
+    auto result = std::vector<PhyloFactor>( size );
+    for( auto& factor : result ) {
+        expect( "factor" );
+        factor.edge_index      = std::stoull( next_token() );
+        factor.objective_value = std::stod( next_token() );
+        factor.edge_indices_primary   = read_indices( "primary" );
+        factor.edge_indices_secondary = read_indices( "secondary" );
+        factor.balances               = read_values( "balances" );
+        factor.all_objective_values   = read_values( "objectives" );
+        if( factor.balances.size() != samples || factor.all_objective_values.size() != edges ) {
+            throw std::runtime_error( "Checkpoint file " + filename + " does not fit the data." );
+        }
+    }
+    return result;
+}
+
+// =================================================================================================
+//     Permutation Test
+// =================================================================================================
+
+/**
+ * @brief Significance of a phylo factor under permutations of the meta data.
+ */
+struct PhyloFactorSignificance
+{
+    // Fraction of permutations in which the objective of the winning edge is at least as good
+    // as the observed one. Uses the usual (1 + count) / (1 + permutations).
+    double p_value_edge = std::numeric_limits<double>::quiet_NaN();
+
+    // Same, but for the best objective over all candidate edges of that iteration.
+    double p_value_argmax = std::numeric_limits<double>::quiet_NaN();
+};
+
+/**
+ * @brief Permutation test of the factors found with the fixed design GLM objective,
+ * that is, obj_fct_glm_design().
+ *
+ * Permuting the samples of the meta data permutes the rows of the orthonormal basis of the
+ * design, so we do not need to refit anything. Each permutation gets its own random engine,
+ * seeded from @p seed and its index, so that the result does not depend on the number of threads.
+ * The edge test re-evaluates the balances of the winning edge of each factor. If @p test_argmax is
+ * set, we also compute the best objective over all candidate edges of each iteration under each
+ * permutation, which is the proper null distribution for the greedy choice, but costs as much
+ * as one objective evaluation per permutation and candidate. Candidates are processed in blocks,
+ * with the balances of a block computed once and shared by all permutations.
+ */
+std::vector<PhyloFactorSignificance> phylo_factor_permutation_test(
+    BalanceData const& data,
+    GlmDesign const& design,
+    std::vector<PhyloFactor> const& factors,
+    size_t permutations,
+    bool test_argmax = false,
+    unsigned long seed = 42
+) {
+    auto const& basis = design.basis;
+    auto const n = basis.rows();
+    auto const rank = basis.cols();
+    auto result = std::vector<PhyloFactorSignificance>( factors.size() );
+    if( permutations == 0 ) {
+        return result;
+    }
+
+    // Make the permutations of the sample indices.
+    auto perms = std::vector<std::vector<size_t>>( permutations );
+    #pragma omp parallel for
+    for( size_t k = 0; k < permutations; ++k ) {
+        std::seed_seq seq{ seed, static_cast<unsigned long>( k ) };
+        std::mt19937_64 engine( seq );
+        perms[k] = std::vector<size_t>( n );
+        std::iota( perms[k].begin(), perms[k].end(), 0 );
+        std::shuffle( perms[k].begin(), perms[k].end(), engine );
+    }
+
+    // Objective of a balance vector under a permutation of the design.
+    auto permuted_objective = [&]( std::vector<size_t> const& perm, std::vector<double> const& bal ){
+        double res = 0.0;
+        for( size_t r = 0; r < rank; ++r ) {
+            double dot = 0.0;
+            for( size_t i = 0; i < n; ++i ) {
+                dot += basis( perm[i], r ) * bal[i];
+            }
+            res += dot * dot;
+        }
+        return res;
+    };
+
+    auto is_candidate = std::vector<bool>( data.tree.edge_count(), true );
+    Matrix<double> weighted_log_masses;
+    std::vector<size_t> preorder_edges;
+    if( test_argmax ) {
+        weighted_log_masses = pf_weighted_log_masses( data );
+        preorder_edges = pf_preorder_edges( data.tree );
+    }
+
+    for( size_t f = 0; f < factors.size(); ++f ) {
+        auto const& factor = factors[f];
+        LOG_DBG1 << "permutation test of factor " << f;
+
+        // Test the winning edge.
+        size_t edge_count = 0;
+        #pragma omp parallel for reduction(+:edge_count)
+        for( size_t k = 0; k < permutations; ++k ) {
+            if( permuted_objective( perms[k], factor.balances ) >= factor.objective_value ) {
+                ++edge_count;
+            }
+        }
+        result[f].p_value_edge
+            = static_cast<double>( 1 + edge_count ) / static_cast<double>( 1 + permutations )
+        ;
+
+        // Test the best edge over all candidates of this iteration.
+        if( test_argmax ) {
+            auto const sums = pf_subtree_sums(
+                data, weighted_log_masses, preorder_edges, is_candidate
+            );
+            std::vector<size_t> candidates;
+            for( size_t i = 0; i < is_candidate.size(); ++i ) {
+                if( is_candidate[i] ) {
+                    candidates.push_back( i );
+                }
+            }
+
+            auto max_objectives = std::vector<double>(
+                permutations, - std::numeric_limits<double>::infinity()
+            );
+            size_t const block_size = 256;
+            for( size_t beg = 0; beg < candidates.size(); beg += block_size ) {
+                auto const end = std::min( beg + block_size, candidates.size() );
+
+                // Balances of the block, one per candidate, empty if the candidate is invalid.
+                auto balances = std::vector<std::vector<double>>( end - beg );
+                #pragma omp parallel for
+                for( size_t c = beg; c < end; ++c ) {
+                    if( ! pf_candidate_balance(
+                        data, weighted_log_masses, sums, candidates[c], balances[ c - beg ]
+                    )) {
+                        balances[ c - beg ].clear();
+                    }
+                }
+
+                #pragma omp parallel for schedule(dynamic)
+                for( size_t k = 0; k < permutations; ++k ) {
+                    for( auto const& bal : balances ) {
+                        if( bal.empty() ) {
+                            continue;
+                        }
+                        auto const ov = permuted_objective( perms[k], bal );
+                        if( ov > max_objectives[k] ) {
+                            max_objectives[k] = ov;
+                        }
+                    }
+                }
+            }
+
+            size_t argmax_count = 0;
+            for( auto const mo : max_objectives ) {
+                if( mo >= factor.objective_value ) {
+                    ++argmax_count;
+                }
+            }
+            result[f].p_value_argmax
+                = static_cast<double>( 1 + argmax_count ) / static_cast<double>( 1 + permutations )
+            ;
+            is_candidate[ factor.edge_index ] = false;
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Write the objective values and p-values of the factors to a table.
+ */
+void write_factor_significance(
+    std::vector<PhyloFactor> const& factors,
+    std::vector<PhyloFactorSignificance> const& significance,
+    std::string const& out_dir
+) {
+    assert( factors.size() == significance.size() );
+    std::ofstream sig_of;
+    file_output_stream( out_dir + "factor_significance.csv", sig_of );
+    sig_of << "factor,edge,objective_value,p_value_edge,p_value_argmax\n";
+    for( size_t i = 0; i < factors.size(); ++i ) {
+        sig_of << i << "," << factors[i].edge_index << "," << factors[i].objective_value << ",";
+        sig_of << significance[i].p_value_edge << "," << significance[i].p_value_argmax << "\n";
+    }
+}
+
 // =================================================================================================
 //     main
 // =================================================================================================
@@ -993,6 +2246,10 @@ int main( int argc, char** argv )
 
     size_t const num_factors = 10;
 
+    // Permutation test of the factors. Testing the argmax over all candidate edges is costly.
+    size_t const num_permutations = 1000;
+    bool const permutation_test_argmax = false;
+
     // ----------------------------------------------------------------
     //     Run!
     // ----------------------------------------------------------------
@@ -1009,14 +2266,32 @@ int main( int argc, char** argv )
     // write_edge_mass_matrix( data.bal_data.raw_edge_masses, data.col_sort_indices, data.label_tree, out_dir, "_raw" );
     write_heat_map_stuff( data, out_dir );
 
+    // The design of the GLM is the same for all candidate edges, so we prepare it only once.
+    auto const glm_design = glm_prepare_design( data.meta_vals_mat );
+
+    // Resume from the factors of a previous run, if there are any. This also allows to extend
+    // a previous run to more factors, by increasing num_factors.
+    auto const checkpoint_file = out_dir + "factorization_checkpoint.txt";
+    // The name of the objective function below is part of the hash, so that changing it
+    // does not resume a checkpoint of another objective.
+    auto const checkpoint_hash = factorization_input_hash( data, settings, "glm_design" );
+    std::vector<PhyloFactor> initial_factors;
+    if( file_exists( checkpoint_file )) {
+        initial_factors = read_factorization_checkpoint(
+            data.bal_data, checkpoint_hash, checkpoint_file
+        );
+        LOG_INFO << "Resuming from checkpoint with " << initial_factors.size() << " factors";
+    }
+
     LOG_INFO << "Running Phylo Factorization";
-    auto const factors = phylogenetic_factorization(
+    auto const factors = parallel_phylogenetic_factorization(
         data.bal_data,
         [&]( std::vector<double> const& balances ){
             // return obj_fct_corr( data, balances );
             // return obj_fct_lin_reg( data, balances );
             // return obj_fct_phyca( data, balances );
-            return obj_fct_glm( data, balances );
+            // return obj_fct_glm( data, balances );
+            return obj_fct_glm_design( glm_design, balances );
 
             // if( main_col.empty() ) {
             //     // LOG_INFO << "!!! running GLM";
@@ -1029,12 +2304,22 @@ int main( int argc, char** argv )
         num_factors,
         []( size_t iteration, size_t max_iterations ){
             LOG_DBG1 << "iteration " << iteration << " of " << max_iterations;
+        },
+        std::move( initial_factors ),
+        [&]( std::vector<PhyloFactor> const& found ){
+            write_factorization_checkpoint( data.bal_data, checkpoint_hash, found, checkpoint_file );
         }
     );
 
     write_factor_tree(  data, factors, out_dir );
     write_factor_edges( data, factors, out_dir );
 
+    LOG_INFO << "Running Permutation Test";
+    auto const significance = phylo_factor_permutation_test(
+        data.bal_data, glm_design, factors, num_permutations, permutation_test_argmax
+    );
+    write_factor_significance( factors, significance, out_dir );
+
     LOG_INFO << "Finished";
 
     return 0;
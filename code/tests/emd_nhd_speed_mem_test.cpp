@@ -23,7 +23,9 @@
 
 #include "genesis/genesis.hpp"
 
+#include <algorithm>
 #include <fstream>
+#include <numeric>
 #include <string>
 #include <unordered_map>
 
@@ -36,6 +38,255 @@ using namespace genesis::placement;
 using namespace genesis::tree;
 using namespace genesis::utils;
 
+// =================================================================================================
+//      NHD Tree Index
+// =================================================================================================
+
+/**
+ * @brief Per node information of the reference tree that is needed to fill the node distance
+ * histograms, in O(nodes) memory instead of the dense node distance and node side matrices.
+ *
+ * This is computed once for the reference tree and shared by all samples. Distances between
+ * two nodes are then obtained from their distances to the root and their lowest common ancestor,
+ * which is looked up in constant time via a sparse table over an Euler tour of the tree.
+ * Whether a node lies in the subtree of another is answered via pre- and postorder numbering.
+ */
+struct NhdTreeIndex
+{
+    std::vector<size_t> parent;
+    std::vector<double> root_dist;
+    std::vector<double> eccentricity;
+    std::vector<size_t> order_in;
+    std::vector<size_t> order_out;
+
+    // Euler tour of node indices, first occurrence of each node in it, and the sparse table
+    // over it, storing tour positions of the shallowest node in each range of length 2^k.
+    std::vector<size_t> euler;
+    std::vector<size_t> euler_first;
+    std::vector<size_t> euler_depth;
+    std::vector<std::vector<size_t>> sparse;
+
+    bool is_in_subtree( size_t node, size_t subtree_root ) const
+    {
+        return order_in[ subtree_root ] <= order_in[ node ]
+            && order_out[ node ] <= order_out[ subtree_root ];
+    }
+
+    size_t lca( size_t a, size_t b ) const
+    {
+        auto l = euler_first[a];
+        auto r = euler_first[b];
+        if( l > r ) {
+            std::swap( l, r );
+        }
+        size_t k = 0;
+        while(( size_t( 2 ) << k ) <= r - l + 1 ) {
+            ++k;
+        }
+        auto const x = sparse[k][l];
+        auto const y = sparse[k][ r + 1 - ( size_t( 1 ) << k ) ];
+        return euler[ euler_depth[x] <= euler_depth[y] ? x : y ];
+    }
+
+    double distance( size_t a, size_t b ) const
+    {
+        return root_dist[a] + root_dist[b] - 2.0 * root_dist[ lca( a, b ) ];
+    }
+};
+
+NhdTreeIndex nhd_tree_index( PlacementTree const& tree )
+{
+    auto const node_count = tree.node_count();
+    auto const root = tree.root_node().index();
+
+    // Children lists and branch lengths towards the parent, from the edges.
+    NhdTreeIndex index;
+    index.parent       = std::vector<size_t>( node_count, node_count );
+    index.root_dist    = std::vector<double>( node_count, 0.0 );
+    index.eccentricity = std::vector<double>( node_count, 0.0 );
+    index.order_in     = std::vector<size_t>( node_count, 0 );
+    index.order_out    = std::vector<size_t>( node_count, 0 );
+    index.euler_first  = std::vector<size_t>( node_count, 0 );
+    auto children  = std::vector<std::vector<size_t>>( node_count );
+    auto parent_bl = std::vector<double>( node_count, 0.0 );
+    for( size_t e = 0; e < tree.edge_count(); ++e ) {
+        auto const& edge = tree.edge_at(e);
+        auto const p = edge.primary_node().index();
+        auto const c = edge.secondary_node().index();
+        index.parent[c] = p;
+        parent_bl[c] = edge.data<PlacementEdgeData>().branch_length;
+        children[p].push_back(c);
+    }
+
+    // Iterative dfs for the numbering, root distances and the Euler tour.
+    // Also keep the preorder, so that we can run the dynamic programming passes below.
+    std::vector<size_t> preorder;
+    preorder.reserve( node_count );
+    std::vector<std::pair<size_t, size_t>> stack;
+    size_t counter = 0;
+    stack.push_back({ root, 0 });
+    index.order_in[ root ] = counter++;
+    index.euler_first[ root ] = 0;
+    index.euler.push_back( root );
+    index.euler_depth.push_back( 0 );
+    preorder.push_back( root );
+    while( ! stack.empty() ) {
+        auto& top = stack.back();
+        auto const node = top.first;
+        if( top.second < children[node].size() ) {
+            auto const child = children[node][ top.second ];
+            ++top.second;
+            index.root_dist[ child ] = index.root_dist[ node ] + parent_bl[ child ];
+            index.order_in[ child ] = counter++;
+            index.euler_first[ child ] = index.euler.size();
+            index.euler.push_back( child );
+            index.euler_depth.push_back( stack.size() );
+            preorder.push_back( child );
+            stack.push_back({ child, 0 });
+        } else {
+            index.order_out[ node ] = counter++;
+            stack.pop_back();
+            if( ! stack.empty() ) {
+                index.euler.push_back( stack.back().first );
+                index.euler_depth.push_back( stack.size() - 1 );
+            }
+        }
+    }
+
+    // Sparse table over the Euler tour.
+    auto const tour_size = index.euler.size();
+    index.sparse.push_back( std::vector<size_t>( tour_size ));
+    std::iota( index.sparse[0].begin(), index.sparse[0].end(), 0 );
+    for( size_t k = 1; ( size_t( 1 ) << k ) <= tour_size; ++k ) {
+        auto const& prev = index.sparse[ k - 1 ];
+        auto const half = size_t( 1 ) << ( k - 1 );
+        auto cur = std::vector<size_t>( tour_size - ( size_t( 1 ) << k ) + 1 );
+        for( size_t i = 0; i < cur.size(); ++i ) {
+            auto const x = prev[i];
+            auto const y = prev[ i + half ];
+            cur[i] = ( index.euler_depth[x] <= index.euler_depth[y] ? x : y );
+        }
+        index.sparse.push_back( std::move( cur ));
+    }
+
+    // Eccentricity of each node via rerooting: the furthest node is either in the own subtree
+    // (down pass, postorder), or reached via the parent (up pass, preorder). For the up pass,
+    // we need the best and second best child subtree of the parent.
+    auto down  = std::vector<double>( node_count, 0.0 );
+    auto down2 = std::vector<double>( node_count, 0.0 );
+    auto best_child = std::vector<size_t>( node_count, node_count );
+    for( auto it = preorder.rbegin(); it != preorder.rend(); ++it ) {
+        auto const node = *it;
+        for( auto const child : children[node] ) {
+            auto const d = down[ child ] + parent_bl[ child ];
+            if( d > down[node] ) {
+                down2[node] = down[node];
+                down[node] = d;
+                best_child[node] = child;
+            } else if( d > down2[node] ) {
+                down2[node] = d;
+            }
+        }
+    }
+    auto up = std::vector<double>( node_count, 0.0 );
+    for( auto const node : preorder ) {
+        for( auto const child : children[node] ) {
+            auto const sibling_down = ( best_child[node] == child ? down2[node] : down[node] );
+            up[ child ] = parent_bl[ child ] + std::max( up[node], sibling_down );
+        }
+        index.eccentricity[node] = std::max( up[node], down[node] );
+    }
+
+    return index;
+}
+
+// =================================================================================================
+//      NHD Histograms
+// =================================================================================================
+
+/**
+ * @brief Compute the same histograms as `node_distance_histogram_set()`, but using the
+ * NhdTreeIndex instead of the dense node distance and node side matrices.
+ *
+ * The placements of the sample are first collected in one pass into a compact list, and then
+ * binned for every node. Placements on the root side of a node get negative distances,
+ * placements in the subtree of the node get positive ones. The histogram of a node spans
+ * plus and minus its eccentricity, that is, the distance to its furthest node.
+ */
+NodeDistanceHistogramSet nhd_histogram_set(
+    Sample const& sample,
+    NhdTreeIndex const& index,
+    size_t const histogram_bins
+) {
+    struct CompactPlacement
+    {
+        size_t primary;
+        size_t secondary;
+        double proximal_length;
+        double distal_length;
+        double mass;
+    };
+
+    // Single pass over the sample to get all placement positions and masses.
+    std::vector<CompactPlacement> placements;
+    double total_mass = 0.0;
+    for( auto const& pquery : sample ) {
+        auto const mult = total_multiplicity( pquery );
+        for( auto const& placement : pquery.placements() ) {
+            auto const& edge = placement.edge();
+            auto const bl = edge.data<PlacementEdgeData>().branch_length;
+            CompactPlacement cp;
+            cp.primary         = edge.primary_node().index();
+            cp.secondary       = edge.secondary_node().index();
+            cp.proximal_length = placement.proximal_length;
+            cp.distal_length   = bl - placement.proximal_length;
+            cp.mass            = mult * placement.like_weight_ratio;
+            total_mass += cp.mass;
+            placements.push_back( cp );
+        }
+    }
+
+    auto const node_count = sample.tree().node_count();
+    NodeDistanceHistogramSet result;
+    result.histograms.resize( node_count );
+    for( size_t node = 0; node < node_count; ++node ) {
+        auto& hist = result.histograms[ node ];
+        hist.min = - index.eccentricity[ node ];
+        hist.max =   index.eccentricity[ node ];
+        hist.bins = std::vector<double>( histogram_bins, 0.0 );
+        if( hist.max <= 0.0 ) {
+            continue;
+        }
+        auto const bin_width = ( hist.max - hist.min ) / static_cast<double>( histogram_bins );
+
+        for( auto const& cp : placements ) {
+            double dist;
+            if( index.is_in_subtree( node, cp.secondary )) {
+                // The node is below the placement edge, so the placement is on its root side.
+                dist = -( index.distance( node, cp.secondary ) + cp.distal_length );
+            } else if( index.is_in_subtree( cp.primary, node )) {
+                // The placement edge is in the subtree of the node.
+                dist = index.distance( node, cp.primary ) + cp.proximal_length;
+            } else {
+                // Somewhere else in the tree, reached via the root side of the node.
+                dist = -( index.distance( node, cp.primary ) + cp.proximal_length );
+            }
+
+            auto bin = static_cast<long>(( dist - hist.min ) / bin_width );
+            bin = std::max( 0l, std::min( bin, static_cast<long>( histogram_bins ) - 1 ));
+            hist.bins[ bin ] += cp.mass;
+        }
+
+        // Normalize.
+        if( total_mass > 0.0 ) {
+            for( auto& val : hist.bins ) {
+                val /= total_mass;
+            }
+        }
+    }
+    return result;
+}
+
 void run_nhd( std::vector<std::string> const& bplace_filenames, std::string const& outdir )
 {
     size_t const bins = 50;
@@ -44,6 +295,71 @@ void run_nhd( std::vector<std::string> const& bplace_filenames, std::string cons
     auto hist_vecs = std::vector<NodeDistanceHistogramSet>( bplace_filenames.size() );
     SampleSerializer bplace_loader;
 
+    LOG_INFO << "init";
+    NhdTreeIndex tree_index;
+    {
+        // Load the first one twice... can live with that for now
+        auto smp = bplace_loader.load( bplace_filenames[0] );
+        tree_index = nhd_tree_index( smp.tree() );
+    }
+
+    auto nhd_matrix = utils::Matrix<double>( set_size, set_size, 0.0 );
+
+    // Cannot throw from within the parallel loop, so we just flag incompatible trees.
+    LOG_INFO << "fill histogams";
+    bool incompatible = false;
+    #pragma omp parallel for
+    for( size_t fi = 0; fi < bplace_filenames.size(); ++fi ) {
+        auto smp = bplace_loader.load( bplace_filenames[fi] );
+        if( smp.tree().node_count() != tree_index.parent.size() ) {
+            #pragma omp critical(INCOMPATIBLE)
+            {
+                incompatible = true;
+            }
+            continue;
+        }
+        hist_vecs[fi] = nhd_histogram_set( smp, tree_index, bins );
+    }
+    if( incompatible ) {
+        throw std::invalid_argument(
+            "Trees in SampleSet not compatible for calculating Node Histogram Distance."
+        );
+    }
+
+    LOG_INFO << "calc dists";
+
+    // We only need to calculate the upper triangle. Get the number of indices needed
+    // to describe this triangle.
+    size_t const max_k = utils::triangular_size( set_size );
+
+    // Calculate distance matrix for every pair of samples.
+    #pragma omp parallel for
+    for( size_t k = 0; k < max_k; ++k ) {
+
+        // For the given linear index, get the actual position in the Matrix.
+        auto const ij = utils::triangular_indices( k, set_size );
+        auto const i = ij.first;
+        auto const j = ij.second;
+
+        // Calculate and store distance.
+        auto const dist = node_histogram_distance( hist_vecs[ i ], hist_vecs[ j ] );
+        nhd_matrix(i, j) = dist;
+        nhd_matrix(j, i) = dist;
+    }
+    LOG_INFO << "finished";
+
+    utils::file_write( utils::to_string( nhd_matrix ), outdir + "nhd_unordered.mat" );
+    LOG_INFO << "written";
+}
+
+void run_nhd_matrix( std::vector<std::string> const& bplace_filenames, std::string const& outdir )
+{
+    size_t const bins = 50;
+    auto const set_size = bplace_filenames.size();
+
+    auto hist_vecs = std::vector<NodeDistanceHistogramSet>( bplace_filenames.size() );
+    SampleSerializer bplace_loader;
+
     Matrix<double> node_distances;
     Matrix<signed char> node_sides;
     // size_t node_count;
@@ -200,6 +516,8 @@ int main( int argc, char** argv )
 
     if( mode == "nhd" ) {
         run_nhd( bplace_filenames, outdir );
+    } else if( mode == "nhd_matrix" ) {
+        run_nhd_matrix( bplace_filenames, outdir );
     } else if( mode == "emd" ) {
         run_emd( bplace_filenames, outdir );
     } else {
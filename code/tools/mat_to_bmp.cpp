@@ -24,15 +24,81 @@
 #include "genesis/genesis.hpp"
 
 #include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
 
 using namespace genesis;
 using namespace genesis::utils;
 
-int main( int argc, char** argv )
+// =================================================================================================
+//     Helpers
+// =================================================================================================
+
+/**
+ * @brief Parse a line of space separated numbers into @p values.
+ *
+ * Returns the number of values, which is also the new size of @p values.
+ */
+size_t parse_matrix_row( std::string const& line, std::vector<double>& values )
+{
+    values.clear();
+    char const* pos = line.c_str();
+    while( true ) {
+        char* end;
+        auto const value = std::strtod( pos, &end );
+        if( end == pos ) {
+            break;
+        }
+        values.push_back( value );
+        pos = end;
+    }
+    return values.size();
+}
+
+/**
+ * @brief Read an order file with the matrix row indices in the order in which they shall be
+ * drawn, as for example the squash clustering merge order written by compare_emd_nhd_bplace,
+ * and return the drawing position of each matrix row.
+ */
+std::vector<size_t> read_positions( std::string const& order_file, size_t size )
 {
-    (void) argc;
-    (void) argv;
+    std::ifstream is( order_file );
+    if( ! is ) {
+        throw std::runtime_error( "Cannot read order file " + order_file );
+    }
 
+    auto positions = std::vector<size_t>( size, size );
+    size_t index;
+    size_t pos = 0;
+    while( is >> index ) {
+        if( index >= size || positions[ index ] != size ) {
+            throw std::runtime_error( "Order file is not a permutation of the matrix rows." );
+        }
+        positions[ index ] = pos++;
+    }
+    if( pos != size ) {
+        throw std::runtime_error( "Order file is not a permutation of the matrix rows." );
+    }
+    return positions;
+}
+
+// =================================================================================================
+//     Main
+// =================================================================================================
+
+/**
+ * @brief Visualize a square matrix file as a grey color heatmap.
+ *
+ * The matrix is streamed in blocks of rows, and its cells are aggregated into the pixels of an
+ * image of at most `size x size` pixels, by their mean or maximum. Memory is thus bounded by
+ * the image and one block of rows, instead of the whole matrix. Optionally, the rows and
+ * columns are drawn in the order given by an order file.
+ */
+int main( int argc, char** argv )
+{
     // Activate logging.
     utils::Logging::log_to_stdout();
     utils::Logging::details.time = true;
@@ -40,96 +106,139 @@ int main( int argc, char** argv )
     LOG_BOLD;
 
     // Check if the command line contains the right number of arguments.
-    if (argc != 2) {
+    if( argc < 2 || argc > 5 ) {
         throw std::runtime_error(
-            "Need to provide an EMD matrix file.\n"
+            "Need to provide an EMD matrix file, "
+            "and optionally the image size, 'mean' or 'max', and an order file.\n"
         );
     }
 
     // In out dirs.
-    auto emd_mat_file = std::string( argv[1] );
-    auto emd_bmp_file = utils::file_filename( emd_mat_file ) + ".bmp";
+    auto const emd_mat_file = std::string( argv[1] );
+    auto const emd_bmp_file = utils::file_filename( emd_mat_file ) + ".bmp";
+    size_t const max_size   = ( argc > 2 ? std::stoul( argv[2] ) : 4096 );
+    auto const aggregation  = ( argc > 3 ? std::string( argv[3] ) : std::string( "mean" ));
+    auto const order_file   = ( argc > 4 ? std::string( argv[4] ) : std::string() );
+    if( max_size == 0 ) {
+        throw std::runtime_error( "Image size needs to be positive." );
+    }
+    if( aggregation != "mean" && aggregation != "max" ) {
+        throw std::runtime_error( "Aggregation needs to be 'mean' or 'max'." );
+    }
+    bool const use_max = ( aggregation == "max" );
+
+    std::ifstream is( emd_mat_file );
+    if( ! is ) {
+        throw std::runtime_error( "Cannot read file " + emd_mat_file );
+    }
 
-    // Read table.
+    // The matrix is square, so the first line tells us its size.
     LOG_INFO << "Reading file " << emd_mat_file;
-    auto reader = CsvReader();
-    reader.separator_chars( " " );
-    auto table  = reader.from_file( emd_mat_file );
-    if( table.size() == 0 ) {
+    std::string line;
+    auto first_row = std::vector<double>();
+    while( std::getline( is, line ) && parse_matrix_row( line, first_row ) == 0 ) {}
+    if( first_row.empty() ) {
         LOG_INFO << "Empty";
         return 0;
     }
+    auto const num = first_row.size();
 
-    LOG_INFO << "Processing Matrix";
-
-    // Get and check dimensions.
-    auto const row_num = table.size();
-    auto const col_num = table[0].size();
-    if( row_num != col_num ) {
-        throw std::invalid_argument( "Input is not a symmetric matrix." );
-    }
-    for( auto const& row : table ) {
-        if( row.size() != col_num ) {
-            throw std::invalid_argument( "Input is not a symmetric matrix." );
+    // Drawing position of each row and column, and the pixel that it ends up in.
+    auto positions = std::vector<size_t>( num );
+    if( order_file.empty() ) {
+        for( size_t i = 0; i < num; ++i ) {
+            positions[i] = i;
         }
+    } else {
+        positions = read_positions( order_file, num );
+    }
+    auto const img_size = std::min( num, max_size );
+    auto pixels = std::vector<size_t>( num );
+    auto pixel_counts = std::vector<size_t>( img_size, 0 );
+    for( size_t i = 0; i < num; ++i ) {
+        pixels[i] = positions[i] * img_size / num;
+        ++pixel_counts[ pixels[i] ];
     }
+    LOG_INFO << "Matrix of size " << num << " x " << num
+             << ", drawing " << img_size << " x " << img_size << " pixels";
+
+    // Sum or maximum of the cells per pixel, row-major.
+    auto const init = use_max ? std::numeric_limits<double>::lowest() : 0.0;
+    auto image = std::vector<double>( img_size * img_size, init );
+    double maxy = std::numeric_limits<double>::lowest();
+
+    // Read blocks of lines, parse them in parallel, and add them to the image. The first line
+    // was already parsed.
+    size_t const block_size = 256;
+    auto lines = std::vector<std::string>();
+    auto block = std::vector<std::vector<double>>( block_size );
+    block[0] = std::move( first_row );
+    size_t row = 0;
+    size_t filled = 1;
+    bool done = false;
+    while( ! done ) {
+        lines.clear();
+        while( filled + lines.size() < block_size ) {
+            if( ! std::getline( is, line )) {
+                done = true;
+                break;
+            }
+            if( line.find_first_not_of( " \t\r" ) == std::string::npos ) {
+                continue;
+            }
+            lines.push_back( std::move( line ));
+        }
 
-    // Convert to double.
-    auto dmat = Matrix<double>( row_num, col_num );
-    for( size_t i = 0; i < row_num; ++i ) {
-        for( size_t j = 0; j < col_num; ++j ) {
-            dmat( i, j ) = stod( table[i][j] );
+        bool good = true;
+        #pragma omp parallel for
+        for( size_t l = 0; l < lines.size(); ++l ) {
+            if( parse_matrix_row( lines[l], block[ filled + l ] ) != num ) {
+                #pragma omp critical(mat_to_bmp_error)
+                {
+                    good = false;
+                }
+            }
+        }
+        if( ! good || row + filled + lines.size() > num ) {
+            throw std::invalid_argument( "Input is not a symmetric matrix." );
+        }
+        filled += lines.size();
+
+        // Aggregate the block. Rows of the block can fall into the same pixel row,
+        // so we do this serially, which is cheap compared to parsing.
+        for( size_t b = 0; b < filled; ++b ) {
+            auto const& values = block[b];
+            auto* const img_row = &image[ pixels[ row + b ] * img_size ];
+            for( size_t j = 0; j < num; ++j ) {
+                auto& pixel = img_row[ pixels[j] ];
+                pixel = use_max ? std::max( pixel, values[j] ) : pixel + values[j];
+                maxy = std::max( maxy, values[j] );
+            }
         }
+        row += filled;
+        filled = 0;
+    }
+    if( row != num ) {
+        throw std::invalid_argument( "Input is not a symmetric matrix." );
     }
-    table.clear();
-
-    // Find max value.
-    auto maxy = *std::max_element( dmat.begin(), dmat.end() );
-
-    // // Get row sums.
-    // auto row_sums = std::vector<double>( dmat.rows(), 0 );
-    // for( size_t i = 0; i < row_num; ++i ) {
-    //     for( size_t j = 0; j < col_num; ++j ) {
-    //         row_sums[i] += dmat( i, j );
-    //     }
-    // }
-    //
-    // // Sort by row sum.
-    // auto si = sort_indices( row_sums.begin(), row_sums.end() );
-    // auto dmat2 = Matrix<double>( row_num, col_num );
-    // for( size_t i = 0; i < row_num; ++i ) {
-    //     for( size_t j = 0; j < col_num; ++j ) {
-    //         dmat2( i, j ) = dmat( si[i], si[j] );
-    //     }
-    // }
 
     LOG_INFO << "Creating Bitmap";
 
-    // Convert to grayscale.
-    auto bmat = Matrix<unsigned char>( row_num, col_num );
-    for( size_t i = 0; i < row_num; ++i ) {
-        for( size_t j = 0; j < col_num; ++j ) {
-            bmat( i, j ) = 255.0 * dmat( i, j ) / maxy;
+    // Convert to grayscale, relative to the maximum cell value.
+    auto bmat = Matrix<unsigned char>( img_size, img_size );
+    for( size_t i = 0; i < img_size; ++i ) {
+        for( size_t j = 0; j < img_size; ++j ) {
+            auto value = image[ i * img_size + j ];
+            if( ! use_max ) {
+                value /= static_cast<double>( pixel_counts[i] * pixel_counts[j] );
+            }
+            bmat( i, j ) = maxy > 0.0 ? 255.0 * value / maxy : 0;
         }
     }
 
-    // // Nice color palette.
-    // auto gradient   = std::map<double, utils::Color>();
-    // gradient[ 0.0 ] = utils::color_from_hex("#81bfff");
-    // gradient[ 0.5 ] = utils::color_from_hex("#c040be");
-    // gradient[ 1.0 ] = utils::color_from_hex("#000000");
-    // auto palette = std::vector<Color>( 256 );
-    // for( size_t i = 0; i < 256; ++i ) {
-    //     auto c = utils::gradient( gradient, static_cast<double>(i) / 255.0 );
-    //     palette[i].r( c.r() );
-    //     palette[i].g( c.g() );
-    //     palette[i].b( c.b() );
-    // }
-
     LOG_INFO << "Writing Bitmap";
 
     // Write to bitmap file.
-    // BmpWriter().to_file( bmat, palette, emd_bmp_file );
     BmpWriter().to_file( bmat, emd_bmp_file );
 
     LOG_INFO << "Finished";
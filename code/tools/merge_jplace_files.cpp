@@ -23,6 +23,10 @@
 
 #include "genesis/genesis.hpp"
 
+#include "../common/fast_jplace_reader.hpp"
+
+#include <algorithm>
+
 using namespace genesis;
 
 /**
@@ -68,8 +72,8 @@ int main( int argc, const char* argv[] )
     }
 
     // Prepare a Jplace reader that reports wrong values.
-    auto jplace_reader = JplaceReader();
-    jplace_reader.invalid_number_behaviour(
+    auto jplace_reader = FastJplaceReader();
+    jplace_reader.jplace_reader().invalid_number_behaviour(
         genesis::placement::JplaceReader::InvalidNumberBehaviour::kLogAndCorrect
     );
 
@@ -115,9 +119,17 @@ int main( int argc, const char* argv[] )
         }
         LOG_INFO << "Reading " << (argc - 3) << " input Jplace files:" << file_list;
 
-        // Read all jplace files and merge them into the sample.
-        for( size_t i = 2; i < static_cast<size_t>( argc - 1 ); ++i ) {
-            copy_pqueries( jplace_reader.from_file( argv[i] ), out_sample );
+        // Read the jplace files in parallel batches of one file per thread, and merge each batch
+        // into the sample before reading the next one, so that only a few files are in memory.
+        auto const files = std::vector<std::string>( argv + 2, argv + argc - 1 );
+        auto const batch_size = std::max<size_t>( 1, utils::Options::get().number_of_threads() );
+        for( size_t b = 0; b < files.size(); b += batch_size ) {
+            auto const end = std::min( b + batch_size, files.size() );
+            auto const batch = std::vector<std::string>( files.begin() + b, files.begin() + end );
+            auto const sample_set = jplace_reader.from_files( batch );
+            for( auto const& named_sample : sample_set ) {
+                copy_pqueries( named_sample.sample, out_sample );
+            }
         }
         LOG_INFO << "Found " << out_sample.size() << " Pqueries in total.";
     }
@@ -23,28 +23,38 @@
 
 #include "genesis/genesis.hpp"
 
+#include "../common/meta_data_table.hpp"
+
 #include <algorithm>
+#include <cmath>
+#include <cstdlib>
 #include <fstream>
 #include <limits>
 #include <string>
 #include <unordered_map>
+#include <utility>
 
 using namespace genesis;
 using namespace genesis::placement;
 using namespace genesis::tree;
 using namespace genesis::utils;
 
+// =================================================================================================
+//      Colors
+// =================================================================================================
+
+/**
+ * @brief Viridis colors for the values, with missing values (NaN) in red.
+ */
 std::vector<Color> vec_to_col( std::vector<double> const& values )
 {
     auto res = std::vector<Color>( values.size() );
 
-    auto const invalid_value = 99999;
-
     double min = std::numeric_limits<double>::max();
     double max = std::numeric_limits<double>::lowest();
 
     for( size_t i = 0; i < values.size(); ++i ) {
-        if( values[i] == invalid_value ) {
+        if( std::isnan( values[i] )) {
             continue;
         }
         if( values[i] < min ) {
@@ -60,7 +70,7 @@ std::vector<Color> vec_to_col( std::vector<double> const& values )
     // auto const max = *minmax.second;
 
     for( size_t i = 0; i < values.size(); ++i ) {
-        if( values[i] == invalid_value ) {
+        if( std::isnan( values[i] )) {
             res[i] = Color( 255, 0, 0 );
             continue;
         }
@@ -130,44 +140,17 @@ int main( int argc, char** argv )
     auto clust_tree = DefaultTreeNewickReader().from_file( tree_file );
     ladderize(clust_tree);
 
-    // Read metadata table
+    // Read metadata table. Non-numeric columns are skipped already.
     LOG_INFO << "Reading meta data";
-    auto reader = utils::CsvReader();
-    reader.separator_chars( "\t" );
-    auto meta_table = reader.from_file( meta_file );
-
-    // Get column names from first row of meta table
-    auto meta_names = std::vector<std::string>();
-    for( size_t i = 1; i < meta_table[0].size(); ++i ) {
-        meta_names.push_back( meta_table[0][i] );
-    }
-
-    // Get sample names from first col of meta table
-    auto sample_names = std::vector<std::string>();
-    for( size_t i = 1; i < meta_table.size(); ++i ) {
-        sample_names.push_back( meta_table[i][0] );
-    }
+    auto const meta_table = read_meta_data_table( meta_file );
 
     // Go through all meta data.
-    for( size_t mi = 0; mi < meta_names.size(); ++mi ) {
+    for( size_t mi = 0; mi < meta_table.cols(); ++mi ) {
 
-        LOG_INFO << "Meta: " << meta_names[mi];
-
-        try {
-            stod( meta_table.at(1).at(mi+1) );
-        } catch(...) {
-            LOG_WARN << "Skipping";
-            continue;
-        }
-
-        // Fill vec with medatadata for this col
-        std::vector<double> data;
-        for( size_t r = 0; r < sample_names.size(); ++r ) {
-            data.push_back( stod( meta_table.at(r+1).at(mi+1) ));
-        }
+        LOG_INFO << "Meta: " << meta_table.names[mi];
 
         // Make nice colors for the metadata
-        auto const colors = vec_to_col( data );
+        auto const colors = vec_to_col( meta_table.columns[mi] );
         auto layout = RectangularLayout( clust_tree );
 
         // Set colourful node shapes.
@@ -180,12 +163,12 @@ int main( int argc, char** argv )
 
             // Get the sample position in the data matrix.
             auto const& node_name = clust_tree.node_at( i ).data<DefaultNodeData>().name;
-            auto const pos_it = std::find( sample_names.begin(), sample_names.end(), node_name );
-            if( pos_it == sample_names.end() ) {
+            auto const pos_it = meta_table.sample_index.find( node_name );
+            if( pos_it == meta_table.sample_index.end() ) {
                 LOG_WARN << "No sample name " << node_name;
                 continue;
             }
-            auto const pos = pos_it - sample_names.begin();
+            auto const pos = pos_it->second;
 
             // Add a shape according to the sample color.
             node_shapes[i].add( utils::SvgCircle(
@@ -199,7 +182,7 @@ int main( int argc, char** argv )
 
         std::ostringstream out;
         layout.to_svg_document().write( out );
-        utils::file_write( out.str(), out_pref + "clust_tree_" + meta_names[mi] + ".svg" );
+        utils::file_write( out.str(), out_pref + "clust_tree_" + meta_table.names[mi] + ".svg" );
     }
 
     // // Make a table of meta data for all columns, and fill it with the data
@@ -23,11 +23,27 @@
 
 #include "genesis/genesis.hpp"
 
+#include "../common/correlation.hpp"
+#include "../common/edge_matrices.hpp"
+#include "../common/edge_matrix_cache.hpp"
+#include "../common/fast_jplace_reader.hpp"
+#include "../common/matrix_io.hpp"
+#include "../common/meta_data_table.hpp"
+#include "../common/raster_tree_layout.hpp"
+
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <numeric>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 
 #ifdef GENESIS_OPENMP
 #   include <omp.h>
@@ -184,30 +200,41 @@ void write_color_tree_to_nexus(
 // =================================================================================================
 
 /**
- * @brief Write an SVG file containing a tree with colored branches.
+ * @brief Make the layout of the tree that is used for all SVG files.
+ *
+ * The layout only depends on the tree, so we compute it once, and then only swap the branch
+ * colors for each file that we write, see write_color_tree_to_svg().
+ */
+tree::CircularLayout make_color_tree_layout( tree::Tree const& tree )
+{
+    auto copy = tree;
+    ladderize(copy);
+
+    // Make a layout tree.
+    // auto layout = tree::RectangularLayout( tree );
+    auto layout = tree::CircularLayout( copy, tree::LayoutType::kCladogram );
+    // layout.scaler_r( 500.0 );
+    layout.text_template().font.size /= 3.5;
+    return layout;
+}
+
+/**
+ * @brief Write an SVG file containing a tree with colored branches,
+ * using a layout from make_color_tree_layout().
  */
 void write_color_tree_to_svg(
-    placement::PlacementTree const&  tree,
+    tree::CircularLayout&            layout,
     std::vector<utils::Color> const& colors_per_branch,
     std::vector<utils::Color> const& colors_per_node,
     std::string const&               svg_filename
 ) {
-    if( colors_per_branch.size() != tree.edge_count() ) {
+    if( colors_per_branch.size() != layout.tree().edge_count() ) {
         throw std::runtime_error( "Branch colors vec of wrong size" );
     }
-    if( !colors_per_node.empty() && colors_per_node.size() != tree.edge_count() ) {
+    if( !colors_per_node.empty() && colors_per_node.size() != layout.tree().edge_count() ) {
         throw std::runtime_error( "Node colors vec of wrong size" );
     }
 
-    auto copy = tree;
-    ladderize(copy);
-
-    // Make a layout tree.
-    // auto layout = tree::RectangularLayout( tree );
-    auto layout = tree::CircularLayout( copy, tree::LayoutType::kCladogram );
-    // layout.scaler_r( 500.0 );
-    layout.text_template().font.size /= 3.5;
-
     // Set edge colors.
     std::vector<utils::SvgStroke> strokes;
     for( auto color : colors_per_branch ) {
@@ -242,109 +269,40 @@ void write_color_tree_to_svg(
     utils::file_write( out.str(), svg_filename );
 }
 
-// =================================================================================================
-//     Read Matrix
-// =================================================================================================
-
-Matrix<double> read_double_matrix( std::string const& filename )
-{
-    auto reader = CsvReader();
-    reader.separator_chars( " " );
-    auto table  = reader.from_file( filename );
-
-    if( table.size() == 0 ) {
-        return {};
-    }
-
-    // Get and check dimensions.
-    auto const row_num = table.size();
-    auto const col_num = table[0].size();
-    for( auto const& row : table ) {
-        if( row.size() != col_num ) {
-            throw std::invalid_argument( "Input is not a matrix." );
-        }
-    }
-
-    // Convert to double.
-    auto dmat = Matrix<double>( row_num, col_num );
-    for( size_t i = 0; i < row_num; ++i ) {
-        for( size_t j = 0; j < col_num; ++j ) {
-            dmat( i, j ) = stod( table[i][j] );
-        }
-    }
-
-    return dmat;
-}
-
 // =================================================================================================
 //     Meta Data Prep
 // =================================================================================================
 
-struct MetaData
-{
-    std::vector<std::string> names;
-    utils::Matrix<double>    data;
-};
-
-MetaData meta_data_prep(
+MetaDataTable meta_data_prep(
     std::string const& meta_file,
     size_t edge_w_rows,
     std::vector<std::string> const& order,
     std::string const& out_pref
 ) {
-    // Read metadata table
     LOG_INFO << "Reading meta data";
-    auto reader = CsvReader();
-    reader.separator_chars( "\t" );
-    auto meta_table = reader.from_file( meta_file );
-
-    // Meta data needs to have one more row (header line) than the matrices.
-    if( meta_table.size() != edge_w_rows + 1 ) {
-        throw std::runtime_error( "Meta table has not length of matrix rows." );
-    }
-
-    // Get column names of the meta data
-    auto meta_names = std::vector<std::string>();
-    for( size_t i = 1; i < meta_table[0].size(); ++i ) {
-        meta_names.push_back( meta_table[0][i] );
-    }
-
-    // Make a table of meta data for all columns, and fill it with the data, sorted
-    // by the sample names, so that each row corresponds to the other matrix rows.
-    auto meta_data = utils::Matrix<double>( edge_w_rows, meta_names.size() );
-    if( meta_data.rows() != order.size() ) {
+    auto const meta_table = read_meta_data_table( meta_file );
+    if( order.size() != edge_w_rows ) {
         throw std::runtime_error( "Impossibru." );
     }
-    for( size_t r = 0; r < meta_data.rows(); ++r ) {
+    if( meta_table.rows() != edge_w_rows ) {
+        LOG_INFO << "Meta data table has " << meta_table.rows() << " rows, using the "
+                 << edge_w_rows << " samples of the matrices";
+    }
 
-        // For the given matrix row, find the line in the meta table that corresponds to this sample.
-        auto const& sample_name = order[r];
-        size_t meta_index = meta_table.size();
-        for( size_t j = 1; j < meta_table.size(); ++j ) {
-            if( meta_table[j][0] == sample_name ) {
-                meta_index = j;
-                break;
-            }
-        }
-        if( meta_index == meta_table.size() ) {
-            throw std::runtime_error( "Cannot find meta data table index for sample " + sample_name );
-        }
-        if(  meta_table[meta_index].size() != meta_data.cols() + 1 ) {
-            throw std::runtime_error( "Meta data table has wrong line length at " + std::to_string(r) );
-        }
+    // Sort the table by the sample names, so that each row corresponds to the other matrix rows.
+    auto meta_data = reorder_meta_data_table( meta_table, order );
 
-        // Now, fill the data columns.
+    // Write meta matrix, with missing values as nan.
+    LOG_INFO << "Writing meta data matrix";
+    auto meta_mat = utils::Matrix<double>( meta_data.rows(), meta_data.cols() );
+    for( size_t r = 0; r < meta_data.rows(); ++r ) {
         for( size_t c = 0; c < meta_data.cols(); ++c ) {
-            // LOG_DBG1 << meta_table[meta_index][c+1];
-            meta_data( r, c ) = stod( meta_table[meta_index][c+1] );
+            meta_mat( r, c ) = meta_data( r, c );
         }
     }
+    utils::file_write( utils::to_string( meta_mat ), out_pref + "metadata.mat" );
 
-    // Write meta matrix.
-    LOG_INFO << "Writing meta data matrix";
-    utils::file_write( utils::to_string( meta_data ), out_pref + "metadata.mat" );
-
-    return { meta_names, meta_data };
+    return meta_data;
 }
 
 // =================================================================================================
@@ -356,7 +314,7 @@ void process(
     Matrix<double> const& edge_w,
     Matrix<double> const& edge_i,
     std::vector<std::string> const& order,
-    MetaData const& meta,
+    MetaDataTable const& meta,
     std::string const& out_pref
 ) {
 
@@ -366,7 +324,7 @@ void process(
     LOG_INFO << "edge_w: " << edge_w.cols() << " cols and " << edge_w.rows() << " rows";
     LOG_INFO << "edge_i: " << edge_i.cols() << " cols and " << edge_i.rows() << " rows";
     LOG_INFO << "order: " << order.size() << " rows";
-    LOG_INFO << "meta_data: " << meta.data.cols() << " cols and " << meta.data.rows() << " rows";
+    LOG_INFO << "meta_data: " << meta.cols() << " cols and " << meta.rows() << " rows";
 
     // currently ignored: test to visualize total sum of weights on each edge
     // LOG_INFO << "Calculating tree edge weights";
@@ -381,65 +339,104 @@ void process(
 
     LOG_INFO << "Calculating meta";
 
-    // For each meta datum, make a pcc and srcc coloured tree with both edge weight and imbalance.
-    for( size_t c = 0; c < meta.data.cols(); ++c ) {
-
-        auto name = utils::sanitize_filname( meta.names[c] );
-        LOG_INFO << "Meta data: " << name;
-
-        // How many row were filtered due to bad metadata
-        size_t filtered = 0;
-
-        auto pcc_w = std::vector<double>( edge_w.cols(), 0.0 );
-        auto pcc_i = std::vector<double>( edge_w.cols(), 0.0 );
-        auto srcc_w = std::vector<double>( edge_w.cols(), 0.0 );
-        auto srcc_i = std::vector<double>( edge_w.cols(), 0.0 );
-        for( size_t j = 0; j < edge_w.cols(); ++j ) {
-
-            // Get only rows that have good metadata!
-            std::vector<double> edge_w_col;
-            std::vector<double> edge_i_col;
-            std::vector<double> meta_col;
-            for( size_t i = 0; i < meta.data.rows(); ++i ) {
-                if( meta.data( i, c ) != 99999 ) {
-                    edge_w_col.push_back( edge_w( i,j ) );
-                    edge_i_col.push_back( edge_i( i,j ) );
-                    meta_col.push_back( meta.data( i,c ) );
-                }
-            }
-
-            if( filtered == 0 ) {
-                filtered = meta.data.rows() - meta_col.size();
-            } else if( filtered != meta.data.rows() - meta_col.size() ) {
-                LOG_ERR << filtered << " = filtered != meta.data.rows() - meta_col.size() = " << (meta.data.rows() - meta_col.size());
-            }
-
-            pcc_w[j] = pearson_correlation_coefficient( edge_w_col, meta_col );
-            pcc_i[j] = pearson_correlation_coefficient( edge_i_col, meta_col );
-            srcc_w[j] = spearmans_rank_correlation_coefficient( edge_w_col, meta_col );
-            srcc_i[j] = spearmans_rank_correlation_coefficient( edge_i_col, meta_col );
+    // Group the meta data columns by their validity masks, that is, by their rows that are not
+    // missing, so that the edge columns are only ranked and standardized once per group.
+    std::map<std::vector<uint64_t>, std::vector<size_t>> mask_groups;
+    for( size_t c = 0; c < meta.cols(); ++c ) {
+        mask_groups[ meta_data_valid_mask( meta, c ) ].push_back( c );
+    }
 
-            // Simple version that uses the whole matrix.
-            // srcc_w[j] = matrix_col_spearmans_rank_correlation_coefficient( edge_w, j, meta.data, c );
-            // srcc_i[j] = matrix_col_spearmans_rank_correlation_coefficient( edge_i, j, meta.data, c );
+    // Correlation of all edges with all meta data columns, per meta column, by group.
+    // For each group, the values and ranks of each column are computed in one pass,
+    // and then give Pearson's and Spearman's correlation, respectively.
+    auto pcc_w  = std::vector<std::vector<double>>( meta.cols() );
+    auto pcc_i  = std::vector<std::vector<double>>( meta.cols() );
+    auto srcc_w = std::vector<std::vector<double>>( meta.cols() );
+    auto srcc_i = std::vector<std::vector<double>>( meta.cols() );
+    auto filtered = std::vector<size_t>( meta.cols(), 0 );
+    for( auto const& group : mask_groups ) {
+        auto const rows = valid_mask_rows( group.first );
+        auto const& cols = group.second;
+
+        auto const meta_std = standardized_columns( meta, cols, rows );
+        Matrix<double> pcc_w_mat, pcc_i_mat, srcc_w_mat, srcc_i_mat;
+        {
+            auto const w_std = standardized_columns( edge_w, rows );
+            pcc_w_mat  = standardized_correlations( w_std.values, meta_std.values );
+            srcc_w_mat = standardized_correlations( w_std.ranks,  meta_std.ranks );
+        }
+        {
+            auto const i_std = standardized_columns( edge_i, rows );
+            pcc_i_mat  = standardized_correlations( i_std.values, meta_std.values );
+            srcc_i_mat = standardized_correlations( i_std.ranks,  meta_std.ranks );
         }
 
-        LOG_INFO << "Filtered out " << filtered << " metadata rows";
-
-        auto pcc_col_w = cc_to_colors( pcc_w );
-        auto pcc_col_i = cc_to_colors( pcc_i );
-        auto srcc_col_w = cc_to_colors( srcc_w );
-        auto srcc_col_i = cc_to_colors( srcc_i );
+        for( size_t k = 0; k < cols.size(); ++k ) {
+            auto const c = cols[k];
+            filtered[c] = meta.rows() - rows.size();
+            for( size_t j = 0; j < edge_w.cols(); ++j ) {
+                pcc_w[c].push_back(  pcc_w_mat( j, k ));
+                pcc_i[c].push_back(  pcc_i_mat( j, k ));
+                srcc_w[c].push_back( srcc_w_mat( j, k ));
+                srcc_i[c].push_back( srcc_i_mat( j, k ));
+            }
+        }
+    }
 
-        write_color_tree_to_nexus( tree, pcc_col_w, out_pref + name + "_pcc_weights.nexus" );
-        write_color_tree_to_svg(   tree, pcc_col_w, edge_w_colors, out_pref + name + "_pcc_weights.svg" );
-        write_color_tree_to_nexus( tree, pcc_col_i, out_pref + name + "_pcc_imbalance.nexus" );
-        write_color_tree_to_svg(   tree, pcc_col_i, edge_i_colors,  out_pref + name + "_pcc_imbalance.svg" );
+    for( size_t c = 0; c < meta.cols(); ++c ) {
+        LOG_INFO << "Meta data: " << utils::sanitize_filname( meta.names[c] );
+        LOG_INFO << "Filtered out " << filtered[c] << " metadata rows";
+    }
 
-        write_color_tree_to_nexus( tree, srcc_col_w, out_pref + name + "_srcc_weights.nexus" );
-        write_color_tree_to_svg(   tree, srcc_col_w, edge_w_colors, out_pref + name + "_srcc_weights.svg" );
-        write_color_tree_to_nexus( tree, srcc_col_i, out_pref + name + "_srcc_imbalance.nexus" );
-        write_color_tree_to_svg(   tree, srcc_col_i, edge_i_colors,  out_pref + name + "_srcc_imbalance.svg" );
+    // For each meta datum, make a pcc and srcc coloured tree with both edge weight and imbalance.
+    // The tree layout is the same for all of them, so we only compute it once, and give each
+    // thread its own copy, in which only the branch colors are changed per file.
+    // The raster quick-look versions of the trees share one read-only layout.
+    LOG_INFO << "Writing trees";
+    auto const prepared_layout = make_color_tree_layout( tree );
+    auto const raster_layout = make_raster_tree_layout( tree, true, tree::LayoutType::kCladogram );
+
+    // We cannot throw from within the parallel region, so just note the column that went wrong.
+    std::string error_msg;
+
+    #pragma omp parallel
+    {
+        auto layout = prepared_layout;
+
+        #pragma omp for schedule(dynamic)
+        for( size_t c = 0; c < meta.cols(); ++c ) {
+            try {
+                auto name = utils::sanitize_filname( meta.names[c] );
+
+                auto pcc_col_w = cc_to_colors( pcc_w[c] );
+                auto pcc_col_i = cc_to_colors( pcc_i[c] );
+                auto srcc_col_w = cc_to_colors( srcc_w[c] );
+                auto srcc_col_i = cc_to_colors( srcc_i[c] );
+
+                write_color_tree_to_nexus( tree, pcc_col_w, out_pref + name + "_pcc_weights.nexus" );
+                write_color_tree_to_svg( layout, pcc_col_w, edge_w_colors, out_pref + name + "_pcc_weights.svg" );
+                write_color_tree_to_nexus( tree, pcc_col_i, out_pref + name + "_pcc_imbalance.nexus" );
+                write_color_tree_to_svg( layout, pcc_col_i, edge_i_colors,  out_pref + name + "_pcc_imbalance.svg" );
+
+                write_color_tree_to_nexus( tree, srcc_col_w, out_pref + name + "_srcc_weights.nexus" );
+                write_color_tree_to_svg( layout, srcc_col_w, edge_w_colors, out_pref + name + "_srcc_weights.svg" );
+                write_color_tree_to_nexus( tree, srcc_col_i, out_pref + name + "_srcc_imbalance.nexus" );
+                write_color_tree_to_svg( layout, srcc_col_i, edge_i_colors,  out_pref + name + "_srcc_imbalance.svg" );
+
+                write_color_tree_to_bmp( raster_layout, pcc_col_w,  out_pref + name + "_pcc_weights.bmp" );
+                write_color_tree_to_bmp( raster_layout, pcc_col_i,  out_pref + name + "_pcc_imbalance.bmp" );
+                write_color_tree_to_bmp( raster_layout, srcc_col_w, out_pref + name + "_srcc_weights.bmp" );
+                write_color_tree_to_bmp( raster_layout, srcc_col_i, out_pref + name + "_srcc_imbalance.bmp" );
+            } catch( std::exception const& ex ) {
+                #pragma omp critical(correlation_trees_error)
+                {
+                    error_msg = meta.names[c] + ": " + ex.what();
+                }
+            }
+        }
+    }
+    if( ! error_msg.empty() ) {
+        throw std::runtime_error( "Cannot write trees for meta data " + error_msg );
     }
 
     LOG_INFO << "Finished";
@@ -594,6 +591,8 @@ void process_3( int argc, char** argv )
 
     SampleSet sample_set;
     std::vector<std::string> order;
+    EdgeMatrices edge_mats;
+    bool cached_edge_mats = false;
 
     // Get all bplace files, either in the epa dir, or in its subdirs
     auto bplace_filenames = utils::dir_list_files( epadir, false, ".*\\.bplace" );
@@ -654,10 +653,15 @@ void process_3( int argc, char** argv )
             e = epadir + e;
         }
 
-        LOG_INFO << "reading " << jplace_filenames.size() << " jplace sample files";
-        auto jplace_reader = JplaceReader();
-        sample_set = jplace_reader.from_files( jplace_filenames );
-        assert( sample_set.size() == jplace_filenames.size() );
+        // Jplace files are only read if the edge matrix cache is not up to date.
+        auto selection = EdgeMatrixCacheSelection();
+        selection.masses = false;
+        auto cache = edge_matrix_cache( jplace_filenames, selection );
+        edge_mats.average_tree = std::move( cache.average_tree );
+        edge_mats.imbalances   = std::move( cache.imbalances );
+        edge_mats.weights      = std::move( cache.weights );
+        cached_edge_mats = true;
+        sample_set.clear();
         LOG_INFO << "finished reading sample jplace files";
         LOG_INFO;
     }
@@ -666,14 +670,14 @@ void process_3( int argc, char** argv )
     //     Get matrices etc
     // -------------------------------------------------------------------------
 
-    // Average tree.
-    tree::TreeSet avg_tree_set;
-    for( auto const& smp : sample_set ) {
-        avg_tree_set.add( "", smp.sample.tree() );
+    // Average tree, edge imbalances and edge weights, all in one pass over the samples,
+    // unless we already got them from the edge matrix cache.
+    if( ! cached_edge_mats ) {
+        LOG_INFO << "calculating edge matrices";
+        edge_mats = edge_matrices( sample_set );
     }
-    auto const tree = tree::average_branch_length_tree( avg_tree_set );
+    auto const tree = std::move( edge_mats.average_tree );
     // tree::DefaultTreeNewickWriter().to_file( avg_tree, outdir + "avg_tree.newick" );
-    avg_tree_set.clear();
 
     // Rename tips of the tree to more readable proper names
     if( ! sequence_name_file.empty() ) {
@@ -707,8 +711,8 @@ void process_3( int argc, char** argv )
         }
     }
 
-    auto const edge_i = epca_imbalance_matrix( sample_set, true );
-    auto const edge_w = placement_weight_per_edge( sample_set );
+    auto const edge_i = std::move( edge_mats.imbalances );
+    auto const edge_w = std::move( edge_mats.weights );
 
     // utils::file_write( utils::to_string( edge_i ), outdir + "imbalance.mat" );
     // utils::file_write( utils::to_string( edge_w ), outdir + "edge_weights.mat" );
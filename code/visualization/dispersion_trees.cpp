@@ -23,11 +23,26 @@
 
 #include "genesis/genesis.hpp"
 
+#include "../common/edge_matrix_cache.hpp"
+#include "../common/fast_jplace_reader.hpp"
+#include "../common/raster_tree_layout.hpp"
+
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
+
+#ifdef GENESIS_OPENMP
+#   include <omp.h>
+#endif
+
 
 using namespace genesis;
 using namespace genesis::utils;
@@ -391,13 +406,13 @@ void write_color_tree_to_nexus(
 // =================================================================================================
 
 /**
- * @brief Write an SVG file containing a tree with colored branches.
+ * @brief Make the layout of the tree that is used for all SVG files.
+ *
+ * The layout only depends on the tree, so we compute it once, and then only swap the branch
+ * colors for each file that we write, see write_color_tree_to_svg().
  */
-void write_color_tree_to_svg(
-    placement::PlacementTree const&  tree,
-    ColPalPair const& colors_per_branch,
-    std::string const&               svg_filename
-) {
+tree::CircularLayout make_color_tree_layout( placement::PlacementTree const& tree )
+{
     auto copy = tree;
     ladderize(copy);
 
@@ -406,7 +421,18 @@ void write_color_tree_to_svg(
     auto layout = tree::CircularLayout( copy );
     // layout.scaler_r( 500.0 );
     // layout.text_template().font.size /= 3.0;
+    return layout;
+}
 
+/**
+ * @brief Write an SVG file containing a tree with colored branches,
+ * using a layout from make_color_tree_layout().
+ */
+void write_color_tree_to_svg(
+    tree::CircularLayout&            layout,
+    ColPalPair const&                colors_per_branch,
+    std::string const&               svg_filename
+) {
     // Set edge colors.
     std::vector<utils::SvgStroke> strokes;
     for( auto color : colors_per_branch.colors ) {
@@ -441,106 +467,401 @@ void write_color_tree_to_svg(
 }
 
 // =================================================================================================
-//     Read Matrix
+//     Edge Dispersion
 // =================================================================================================
 
-Matrix<double> read_double_matrix( std::string const& filename )
+/**
+ * @brief Mergeable sketch of the quantiles of a stream of values.
+ *
+ * The values are kept in levels of compactors, where a value in level `h` stands for `2^h` of
+ * the original values. Once a level is full, it is sorted, and every other value is moved up,
+ * alternating between the odd and the even ones. As long as no level was compacted,
+ * the sketch contains all values, and the quartiles are exact. Otherwise, the rank error is
+ * in the order of `log( n / capacity ) / capacity`. Minimum and maximum are always exact.
+ * With the default capacity, this means that the quartiles are only exact for fewer than
+ * 256 samples.
+ *
+ * The quartiles are currently only used for the QCOD trees, whose output is disabled in
+ * process(), so that none of the written trees depend on this approximation.
+ */
+class QuantileSketch
 {
-    auto reader = CsvReader();
-    reader.separator_chars( " " );
-    auto table  = reader.from_file( filename );
+public:
 
-    if( table.size() == 0 ) {
-        return {};
+    explicit QuantileSketch( size_t capacity = 256 )
+        : capacity_( std::max<size_t>( capacity, 2 ))
+    {}
+
+    size_t count() const
+    {
+        return count_;
     }
 
-    // Get and check dimensions.
-    auto const row_num = table.size();
-    auto const col_num = table[0].size();
-    for( auto const& row : table ) {
-        if( row.size() != col_num ) {
-            throw std::invalid_argument( "Input is not a matrix." );
+    bool exact() const
+    {
+        return levels_.size() <= 1;
+    }
+
+    void add( double value )
+    {
+        add_bounds_( value, value );
+        ++count_;
+        if( levels_.empty() ) {
+            levels_.emplace_back();
+        }
+        levels_[0].push_back( value );
+        if( levels_[0].size() >= capacity_ ) {
+            compress_();
         }
     }
 
-    // Convert to double.
-    auto dmat = Matrix<double>( row_num, col_num );
-    for( size_t i = 0; i < row_num; ++i ) {
-        for( size_t j = 0; j < col_num; ++j ) {
-            dmat( i, j ) = stod( table[i][j] );
+    void merge( QuantileSketch const& other )
+    {
+        if( other.count_ == 0 ) {
+            return;
+        }
+        add_bounds_( other.min_, other.max_ );
+        count_ += other.count_;
+        if( levels_.size() < other.levels_.size() ) {
+            levels_.resize( other.levels_.size() );
         }
+        for( size_t h = 0; h < other.levels_.size(); ++h ) {
+            levels_[h].insert( levels_[h].end(), other.levels_[h].begin(), other.levels_[h].end() );
+        }
+        compress_();
     }
 
-    return dmat;
-}
+    /**
+     * @brief Quartiles of the values, using the same definition as utils::quartiles()
+     * as long as the sketch is exact().
+     */
+    Quartiles quartiles() const
+    {
+        if( count_ == 0 ) {
+            return Quartiles();
+        }
+        if( exact() ) {
+            auto values = levels_[0];
+            std::sort( values.begin(), values.end() );
+            return utils::quartiles( values );
+        }
 
-// =================================================================================================
-//     Process
-// =================================================================================================
+        // Collect all values with their weights, and find the ranks of the quartiles.
+        auto items = std::vector<std::pair<double, double>>();
+        for( size_t h = 0; h < levels_.size(); ++h ) {
+            auto const weight = static_cast<double>( uint64_t( 1 ) << h );
+            for( auto const v : levels_[h] ) {
+                items.emplace_back( v, weight );
+            }
+        }
+        std::sort( items.begin(), items.end() );
+
+        auto const total = static_cast<double>( count_ );
+        auto quantile = [&]( double q ){
+            double cumulative = 0.0;
+            for( auto const& item : items ) {
+                cumulative += item.second;
+                if( cumulative >= q * total ) {
+                    return item.first;
+                }
+            }
+            return items.back().first;
+        };
+
+        Quartiles result;
+        result.q0 = min_;
+        result.q1 = quantile( 0.25 );
+        result.q2 = quantile( 0.5 );
+        result.q3 = quantile( 0.75 );
+        result.q4 = max_;
+        return result;
+    }
 
-void process(
-    tree::DefaultTree const& tree,
-    Matrix<double> const& edge_w,
-    Matrix<double> edge_i,
-    std::string const& out_pref
-) {
-    LOG_INFO << "tree: " << tree.edge_count() << " edges";
-    LOG_INFO << "edge_w: " << edge_w.cols() << " cols and " << edge_w.rows() << " rows";
-    LOG_INFO << "edge_i: " << edge_i.cols() << " cols and " << edge_i.rows() << " rows";
+private:
 
-    if( edge_w.cols() != tree.edge_count() ) {
-        throw std::runtime_error( "Edge weights does not have corrent length" );
+    void add_bounds_( double min, double max )
+    {
+        min_ = ( count_ == 0 ? min : std::min( min_, min ));
+        max_ = ( count_ == 0 ? max : std::max( max_, max ));
     }
-    if( edge_i.cols() != tree.edge_count() ) {
-        // throw std::runtime_error( "Edge imbalance does not have corrent length" );
 
-        // Get the indices of all edges that do not lead to a tip.
-        std::vector<size_t> inner_edge_indices;
-        for( auto const& edge_it : tree.edges() ) {
-            if( edge_it->secondary_node().is_inner() ) {
-                inner_edge_indices.push_back( edge_it->index() );
+    void compress_()
+    {
+        for( size_t h = 0; h < levels_.size(); ++h ) {
+            if( levels_[h].size() < capacity_ ) {
+                continue;
+            }
+            if( h + 1 == levels_.size() ) {
+                levels_.emplace_back();
             }
+            auto& level = levels_[h];
+            auto& next  = levels_[h + 1];
+
+            // Compact an even number of values, and keep the largest one if the number is odd.
+            std::sort( level.begin(), level.end() );
+            auto const even = level.size() - level.size() % 2;
+            auto const offset = ( toggles_ >> h ) & 1;
+            toggles_ ^= uint64_t( 1 ) << h;
+            for( size_t i = offset; i < even; i += 2 ) {
+                next.push_back( level[i] );
+            }
+            level.erase( level.begin(), level.begin() + even );
         }
+    }
+
+    size_t   capacity_;
+    size_t   count_   = 0;
+    uint64_t toggles_ = 0;
+    double   min_     = 0.0;
+    double   max_     = 0.0;
+
+    std::vector<std::vector<double>> levels_;
+};
 
-        if( inner_edge_indices.size() != edge_i.cols() ) {
-            throw std::runtime_error( "Edge imbalance does not have corrent length" );
+/**
+ * @brief Per-edge dispersion statistics, computed from a stream of sample rows.
+ *
+ * Mean and variance are accumulated with Welford's algorithm, the quartiles with a
+ * QuantileSketch, so that the samples x edges matrix is never needed. Accumulators of
+ * disjoint sets of rows can be merged, which is how the rows are processed in parallel.
+ */
+class EdgeDispersion
+{
+public:
+
+    EdgeDispersion() = default;
+
+    explicit EdgeDispersion( size_t edges, size_t sketch_capacity = 256 )
+        : mean_( edges, 0.0 )
+        , m2_( edges, 0.0 )
+        , sketches_( edges, QuantileSketch( sketch_capacity ))
+    {}
+
+    size_t edges() const
+    {
+        return mean_.size();
+    }
+
+    size_t count() const
+    {
+        return count_;
+    }
+
+    void add_row( std::vector<double> const& row )
+    {
+        assert( row.size() == edges() );
+        ++count_;
+        auto const n = static_cast<double>( count_ );
+        for( size_t e = 0; e < row.size(); ++e ) {
+            auto const delta = row[e] - mean_[e];
+            mean_[e] += delta / n;
+            m2_[e]   += delta * ( row[e] - mean_[e] );
+            sketches_[e].add( row[e] );
         }
+    }
+
+    void merge( EdgeDispersion const& other )
+    {
+        if( other.count_ == 0 ) {
+            return;
+        }
+        if( count_ == 0 ) {
+            *this = other;
+            return;
+        }
+        if( other.edges() != edges() ) {
+            throw std::runtime_error( "Cannot merge edge dispersions of different sizes." );
+        }
+
+        // Chan et al., pairwise update of mean and sum of squared deviations.
+        auto const na = static_cast<double>( count_ );
+        auto const nb = static_cast<double>( other.count_ );
+        auto const n  = na + nb;
+        for( size_t e = 0; e < edges(); ++e ) {
+            auto const delta = other.mean_[e] - mean_[e];
+            mean_[e] += delta * nb / n;
+            m2_[e]   += other.m2_[e] + delta * delta * na * nb / n;
+            sketches_[e].merge( other.sketches_[e] );
+        }
+        count_ += other.count_;
+    }
 
-        // Reverse copy the values to a bigger matrix.
-        auto imbalance_matrix = utils::Matrix<double>( edge_i.rows(), tree.edge_count(), 0.0 );
-        for( size_t s = 0; s < edge_i.rows(); ++s ) {
-            for( size_t i = 0; i < inner_edge_indices.size(); ++i ) {
-                auto idx = inner_edge_indices[i];
-                imbalance_matrix( s, idx ) = edge_i( s, i );
+    /**
+     * @brief Mean and (population) standard deviation per edge, as matrix_col_mean_stddev().
+     */
+    std::vector<MeanStddevPair> mean_stddev() const
+    {
+        auto result = std::vector<MeanStddevPair>( edges() );
+        for( size_t e = 0; e < edges(); ++e ) {
+            result[e].mean   = mean_[e];
+            result[e].stddev = count_ == 0 ? 0.0 : std::sqrt( m2_[e] / static_cast<double>( count_ ));
+        }
+        return result;
+    }
+
+    std::vector<Quartiles> quartiles() const
+    {
+        auto result = std::vector<Quartiles>( edges() );
+        for( size_t e = 0; e < edges(); ++e ) {
+            result[e] = sketches_[e].quartiles();
+        }
+        return result;
+    }
+
+private:
+
+    size_t count_ = 0;
+    std::vector<double> mean_;
+    std::vector<double> m2_;
+    std::vector<QuantileSketch> sketches_;
+};
+
+/**
+ * @brief Edge index of the @p tree for each of the @p cols columns of a sample row.
+ *
+ * Rows either have a value for each edge, or, for imbalances, only for the inner edges.
+ * The edges without a column get a value of 0.
+ */
+std::vector<size_t> edge_dispersion_columns( tree::DefaultTree const& tree, size_t cols )
+{
+    auto result = std::vector<size_t>();
+    if( cols == tree.edge_count() ) {
+        for( size_t e = 0; e < cols; ++e ) {
+            result.push_back( e );
+        }
+        return result;
+    }
+
+    // Get the indices of all edges that do not lead to a tip.
+    for( auto const& edge_it : tree.edges() ) {
+        if( edge_it->secondary_node().is_inner() ) {
+            result.push_back( edge_it->index() );
+        }
+    }
+    if( result.size() != cols ) {
+        throw std::runtime_error( "Edge matrix does not have correct length" );
+    }
+    return result;
+}
+
+/**
+ * @brief Accumulate the rows of a samples x edges (or inner edges) matrix.
+ *
+ * The rows are split into one contiguous shard per thread, whose accumulators are merged
+ * in order, so that the result does not depend on the scheduling.
+ */
+EdgeDispersion matrix_edge_dispersion( tree::DefaultTree const& tree, Matrix<double> const& mat )
+{
+    auto const num_edges = tree.edge_count();
+    auto const columns = edge_dispersion_columns( tree, mat.cols() );
+
+    #ifdef GENESIS_OPENMP
+        auto const num_shards = static_cast<size_t>( std::max( omp_get_max_threads(), 1 ));
+    #else
+        size_t const num_shards = 1;
+    #endif
+    auto shards = std::vector<EdgeDispersion>( num_shards );
+
+    #pragma omp parallel for schedule(static)
+    for( size_t s = 0; s < num_shards; ++s ) {
+        auto const begin = s * mat.rows() / num_shards;
+        auto const end   = ( s + 1 ) * mat.rows() / num_shards;
+
+        auto shard = EdgeDispersion( num_edges );
+        auto row = std::vector<double>( num_edges, 0.0 );
+        for( size_t r = begin; r < end; ++r ) {
+            for( size_t c = 0; c < columns.size(); ++c ) {
+                row[ columns[c] ] = mat( r, c );
             }
+            shard.add_row( row );
         }
-        edge_i = imbalance_matrix;
+        shards[s] = std::move( shard );
     }
 
-    // Last checks
-    if( edge_i.cols() != tree.edge_count() ) {
-        throw std::runtime_error( "Edge imbalance does not have corrent length" );
+    auto result = EdgeDispersion( num_edges );
+    for( auto const& shard : shards ) {
+        result.merge( shard );
     }
-    if( edge_w.rows() != edge_i.rows() ) {
-        throw std::runtime_error( "Edge matrices do not have correct size" );
+    return result;
+}
+
+/**
+ * @brief Accumulate the rows of a space separated samples x edges (or inner edges) matrix file,
+ * one line at a time, without reading the whole matrix into memory.
+ */
+EdgeDispersion file_edge_dispersion( tree::DefaultTree const& tree, std::string const& filename )
+{
+    std::ifstream is( filename );
+    if( ! is ) {
+        throw std::runtime_error( "Cannot read matrix file " + filename );
     }
 
-    LOG_INFO << "Calculating stuff";
+    auto const num_edges = tree.edge_count();
+    auto result = EdgeDispersion( num_edges );
+    auto columns = std::vector<size_t>();
+    auto values = std::vector<double>();
+    auto row = std::vector<double>( num_edges, 0.0 );
+
+    std::string line;
+    while( std::getline( is, line )) {
+        values.clear();
+        char const* pos = line.c_str();
+        while( true ) {
+            char* end;
+            auto const value = std::strtod( pos, &end );
+            if( end == pos ) {
+                break;
+            }
+            values.push_back( value );
+            pos = end;
+        }
+        if( values.empty() ) {
+            continue;
+        }
 
-    // LOG_DBG1 << "edge_w\n" << edge_w;
-    // LOG_DBG1 << "edge_i\n" << edge_i;
+        // The first row determines whether the matrix is over all edges or the inner ones.
+        if( columns.empty() ) {
+            columns = edge_dispersion_columns( tree, values.size() );
+        } else if( values.size() != columns.size() ) {
+            throw std::invalid_argument( "Input is not a matrix." );
+        }
+        for( size_t c = 0; c < columns.size(); ++c ) {
+            row[ columns[c] ] = values[c];
+        }
+        result.add_row( row );
+    }
+    return result;
+}
 
-    // Make imbalances absolute.
-    // for( auto& e : edge_i ) {
-    //     if( e < 0.0 ) {
-    //         e = -e;
-    //     }
-    // }
+// =================================================================================================
+//     Process
+// =================================================================================================
 
-    auto w_mean_stddev = matrix_col_mean_stddev( edge_w );
-    auto i_mean_stddev = matrix_col_mean_stddev( edge_i );
-    auto w_quarties = matrix_col_quartiles( edge_w );
-    auto i_quarties = matrix_col_quartiles( edge_i );
+void process(
+    tree::DefaultTree const& tree,
+    EdgeDispersion const& disp_w,
+    EdgeDispersion const& disp_i,
+    std::string const& out_pref
+) {
+    LOG_INFO << "tree: " << tree.edge_count() << " edges";
+    LOG_INFO << "edge_w: " << disp_w.count() << " samples";
+    LOG_INFO << "edge_i: " << disp_i.count() << " samples";
+
+    if( disp_w.edges() != tree.edge_count() || disp_i.edges() != tree.edge_count() ) {
+        throw std::runtime_error( "Edge dispersions do not have correct length" );
+    }
+    if( disp_w.count() != disp_i.count() ) {
+        throw std::runtime_error( "Edge matrices do not have correct size" );
+    }
+
+    LOG_INFO << "Calculating stuff";
+
+    auto w_mean_stddev = disp_w.mean_stddev();
+    auto i_mean_stddev = disp_i.mean_stddev();
+    // The quartiles are approximate for larger inputs, see QuantileSketch. They are only needed
+    // for the QCOD trees, which are not written at the moment.
+    auto w_quarties = disp_w.quartiles();
+    auto i_quarties = disp_i.quartiles();
 
     auto w_cv   = std::vector<double>( w_mean_stddev.size(), 0.0 );
     auto i_cv   = std::vector<double>( i_mean_stddev.size(), 0.0 );
@@ -577,8 +898,8 @@ void process(
             // LOG_DBG << "i_vmr[ " << i << " ] " << i_vmr[ i ] << " " << i_mean_stddev[ i ].stddev << " " << i_mean_stddev[ i ].mean;
         // }
 
-        // auto qw = matrix_col_quartiles( edge_w, i );
-        // auto qi = matrix_col_quartiles( edge_i, i );
+        // auto const& qw = w_quarties[i];
+        // auto const& qi = i_quarties[i];
         // LOG_DBG1 << "qw i " << i << " q0 " << qw.q0 << " q1 " << qw.q1 << " q2 " << qw.q2 << " q3 " << qw.q3 << " q4 " << qw.q4;
         // LOG_DBG1 << "qi i " << i << " q0 " << qi.q0 << " q1 " << qi.q1 << " q2 " << qi.q2 << " q3 " << qi.q3 << " q4 " << qi.q4;
 
@@ -611,24 +932,57 @@ void process(
     auto color_i_var = variances_to_colors( i_var );
 
     LOG_INFO << "Writing stuff";
+    auto layout = make_color_tree_layout( tree );
 
     write_color_tree_to_nexus( tree, color_w_cv,  out_pref + "disp_edge_weights_cv.nexus" );
-    write_color_tree_to_svg(   tree, color_w_cv,  out_pref + "disp_edge_weights_cv.svg" );
+    write_color_tree_to_svg(   layout, color_w_cv,  out_pref + "disp_edge_weights_cv.svg" );
     write_color_tree_to_nexus( tree, color_i_cv,  out_pref + "disp_edge_imbalance_cv.nexus" );
-    write_color_tree_to_svg(   tree, color_i_cv,  out_pref + "disp_edge_imbalance_cv.svg" );
+    write_color_tree_to_svg(   layout, color_i_cv,  out_pref + "disp_edge_imbalance_cv.svg" );
 
     write_color_tree_to_nexus( tree, color_w_vmr, out_pref + "disp_edge_weights_vmr.nexus" );
-    write_color_tree_to_svg(   tree, color_w_vmr, out_pref + "disp_edge_weights_vmr.svg" );
+    write_color_tree_to_svg(   layout, color_w_vmr, out_pref + "disp_edge_weights_vmr.svg" );
     write_color_tree_to_nexus( tree, color_i_vmr, out_pref + "disp_edge_imbalance_vmr.nexus" );
-    write_color_tree_to_svg(   tree, color_i_vmr, out_pref + "disp_edge_imbalance_vmr.svg" );
+    write_color_tree_to_svg(   layout, color_i_vmr, out_pref + "disp_edge_imbalance_vmr.svg" );
 
     // write_color_tree_to_nexus( tree, color_w_qcod, out_pref + "disp_edge_weights_qcod.nexus" );
-    // write_color_tree_to_svg(   tree, color_w_qcod, out_pref + "disp_edge_weights_qcod.svg" );
+    // write_color_tree_to_svg(   layout, color_w_qcod, out_pref + "disp_edge_weights_qcod.svg" );
     // write_color_tree_to_nexus( tree, color_i_qcod, out_pref + "disp_edge_imbalance_qcod.nexus" );
-    // write_color_tree_to_svg(   tree, color_i_qcod, out_pref + "disp_edge_imbalance_qcod.svg" );
-
-    write_color_tree_to_svg(   tree, color_w_var, out_pref + "disp_edge_weights_variance.svg" );
-    write_color_tree_to_svg(   tree, color_i_var, out_pref + "disp_edge_imbalance_variance.svg" );
+    // write_color_tree_to_svg(   layout, color_i_qcod, out_pref + "disp_edge_imbalance_qcod.svg" );
+
+    write_color_tree_to_svg(   layout, color_w_var, out_pref + "disp_edge_weights_variance.svg" );
+    write_color_tree_to_svg(   layout, color_i_var, out_pref + "disp_edge_imbalance_variance.svg" );
+
+    // Raster quick-look versions of the trees, written in parallel, as they share one
+    // read-only layout. Phylogram, as the circular layout of make_color_tree_layout().
+    auto const raster_layout = make_raster_tree_layout( tree, true, tree::LayoutType::kPhylogram );
+    auto const raster_trees = std::vector<std::pair<ColPalPair const*, std::string>>{
+        { &color_w_cv,  "disp_edge_weights_cv.bmp" },
+        { &color_i_cv,  "disp_edge_imbalance_cv.bmp" },
+        { &color_w_vmr, "disp_edge_weights_vmr.bmp" },
+        { &color_i_vmr, "disp_edge_imbalance_vmr.bmp" },
+        { &color_w_var, "disp_edge_weights_variance.bmp" },
+        { &color_i_var, "disp_edge_imbalance_variance.bmp" }
+    };
+
+    // We cannot throw from within the parallel region, so just note the file that went wrong.
+    std::string error_msg;
+
+    #pragma omp parallel for schedule(dynamic)
+    for( size_t i = 0; i < raster_trees.size(); ++i ) {
+        try {
+            write_color_tree_to_bmp(
+                raster_layout, raster_trees[i].first->colors, out_pref + raster_trees[i].second
+            );
+        } catch( std::exception const& ex ) {
+            #pragma omp critical(dispersion_trees_error)
+            {
+                error_msg = raster_trees[i].second + ": " + ex.what();
+            }
+        }
+    }
+    if( ! error_msg.empty() ) {
+        throw std::runtime_error( "Cannot write tree " + error_msg );
+    }
 }
 
 // =================================================================================================
@@ -653,10 +1007,11 @@ void process_4( int argc, char** argv ) {
 
     auto tree = tree::DefaultTreeNewickReader().from_file( tree_file );
 
-    auto edge_w = read_double_matrix( edge_w_file );
-    auto edge_i = read_double_matrix( edge_i_file );
+    // Stream the matrix files row by row into the dispersion statistics.
+    auto const disp_w = file_edge_dispersion( tree, edge_w_file );
+    auto const disp_i = file_edge_dispersion( tree, edge_i_file );
 
-    process( tree, edge_w, edge_i, out_pref );
+    process( tree, disp_w, disp_i, out_pref );
 }
 
 // =================================================================================================
@@ -676,32 +1031,23 @@ void process_2( int argc, char** argv ) {
     auto const epadir   = std::string( argv[1] );
     auto const out_pref = std::string( argv[2] );
 
-    SampleSet sample_set;
-
-    // Get all bplace files, either in the epa dir, or in its subdirs
+    // Get all jplace files, either in the epa dir, or in its subdirs
     auto jplace_filenames = utils::dir_list_files( epadir, false, ".*\\.jplace" );
     std::sort( jplace_filenames.begin(), jplace_filenames.end() );
-
-    if( jplace_filenames.size() > 0 ) {
-        // order.clear();
-        for( auto& e : jplace_filenames ) {
-            // order.push_back( utils::replace_all( e, ".jplace", "" ) );
-            e = epadir + e;
-        }
-
-        LOG_INFO << "reading " << jplace_filenames.size() << " jplace sample files";
-        auto jplace_reader = JplaceReader();
-        sample_set = jplace_reader.from_files( jplace_filenames );
-        assert( sample_set.size() == jplace_filenames.size() );
-        LOG_INFO << "finished reading sample jplace files";
-        LOG_INFO;
+    for( auto& e : jplace_filenames ) {
+        e = epadir + e;
     }
 
-    auto const tree = average_branch_length_tree( sample_set );
-    auto const edge_i = epca_imbalance_matrix( sample_set, true );
-    auto const edge_w = placement_weight_per_edge( sample_set );
+    // Average tree, edge imbalances and edge weights. The jplace files are only read
+    // if the edge matrix cache is not up to date.
+    auto selection = EdgeMatrixCacheSelection();
+    selection.masses = false;
+    auto cache = edge_matrix_cache( jplace_filenames, selection );
+    auto const tree = std::move( cache.average_tree );
+    auto const disp_i = matrix_edge_dispersion( tree, cache.imbalances );
+    auto const disp_w = matrix_edge_dispersion( tree, cache.weights );
 
-    process( tree, edge_w, edge_i, out_pref );
+    process( tree, disp_w, disp_i, out_pref );
 }
 
 // =================================================================================================
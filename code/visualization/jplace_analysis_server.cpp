@@ -0,0 +1,616 @@
+/*
+    Genesis - A toolkit for working with phylogenetic data.
+    Copyright (C) 2014-2017 Lucas Czech
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Lucas Czech <lucas.czech@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "genesis/genesis.hpp"
+
+#include "../common/correlation.hpp"
+#include "../common/edge_matrices.hpp"
+#include "../common/fast_jplace_reader.hpp"
+#include "../common/meta_data_table.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace genesis;
+using namespace genesis::placement;
+using namespace genesis::tree;
+using namespace genesis::utils;
+
+// =================================================================================================
+//     Resident Data
+// =================================================================================================
+
+/**
+ * @brief Everything that the analyses need, loaded once from the jplace files.
+ */
+struct AnalysisData
+{
+    // Sample names, that is, the file names without directory and extension.
+    std::vector<std::string> sample_names;
+    std::vector<size_t>      pquery_counts;
+
+    // Reference tree of the first sample.
+    placement::PlacementTree reference_tree;
+
+    // Per-sample mass trees, on the average branch length tree as with
+    // convert_sample_set_to_mass_trees(), and edge matrices (samples x edges, including leaf edges).
+    std::vector<tree::MassTree> mass_trees;
+    utils::Matrix<double>       imbalances;
+    utils::Matrix<double>       weights;
+
+    // Pairwise EMD matrix, computed on first use, as it is needed by several analyses.
+    utils::Matrix<double> emd_matrix;
+};
+
+AnalysisData load_analysis_data( std::string const& epadir )
+{
+    // Get all jplace files, either in the epa dir, or in its subdirs
+    auto jplace_filenames = utils::dir_list_files( epadir, ".*\\.jplace" );
+    std::sort( jplace_filenames.begin(), jplace_filenames.end() );
+    if( jplace_filenames.empty() ) {
+        throw std::runtime_error( "No jplace files found in " + epadir );
+    }
+
+    LOG_INFO << "reading " << jplace_filenames.size() << " jplace sample files";
+    auto sset = FastJplaceReader().from_files( jplace_filenames );
+    assert( sset.size() == jplace_filenames.size() );
+
+    // Mass trees and edge matrices, all in one pass over the samples.
+    LOG_INFO << "Converting Trees";
+    auto edge_mats_settings = EdgeMatricesSettings();
+    edge_mats_settings.mass_trees = true;
+    edge_mats_settings.average_tree = false;
+    auto edge_mats = edge_matrices( sset, edge_mats_settings );
+
+    AnalysisData data;
+    for( auto const& smp : sset ) {
+        data.sample_names.push_back( utils::file_filename( utils::file_basename( smp.name )));
+        data.pquery_counts.push_back( smp.sample.size() );
+    }
+    data.reference_tree = sset[0].sample.tree();
+    data.mass_trees     = std::move( edge_mats.mass_trees );
+    data.imbalances     = std::move( edge_mats.imbalances );
+    data.weights        = std::move( edge_mats.weights );
+
+    // The samples themselves are not needed any more.
+    return data;
+}
+
+utils::Matrix<double> const& analysis_emd_matrix( AnalysisData& data )
+{
+    if( data.emd_matrix.rows() != data.mass_trees.size() ) {
+        LOG_INFO << "Calculating EMD matrix";
+        data.emd_matrix = tree::earth_movers_distance( data.mass_trees );
+    }
+    return data.emd_matrix;
+}
+
+// =================================================================================================
+//     Analyses
+// =================================================================================================
+
+/**
+ * @brief Write a tab separated file with one line per sample, and the given columns per sample.
+ */
+void write_sample_table(
+    AnalysisData const& data,
+    std::vector<std::string> const& header,
+    std::function<void( std::ostream&, size_t )> const& write_row,
+    std::string const& filename
+) {
+    std::ofstream os;
+    utils::file_output_stream( filename, os );
+    os << "sample";
+    for( auto const& h : header ) {
+        os << "\t" << h;
+    }
+    os << "\n";
+    for( size_t i = 0; i < data.sample_names.size(); ++i ) {
+        os << data.sample_names[i];
+        write_row( os, i );
+        os << "\n";
+    }
+}
+
+std::string analysis_emd( AnalysisData& data, std::vector<std::string> const& args )
+{
+    auto const& emd_matrix = analysis_emd_matrix( data );
+    utils::file_write( utils::to_string( emd_matrix ), args[0] );
+    return "EMD matrix of " + std::to_string( emd_matrix.rows() ) + " samples";
+}
+
+std::string analysis_kmeans_emd( AnalysisData& data, std::vector<std::string> const& args )
+{
+    auto const k = std::stoul( args[0] );
+    auto const& out_pref = args[1];
+
+    auto mkmeans = tree::MassTreeKmeans();
+    mkmeans.run( data.mass_trees, k );
+    auto const& assignments = mkmeans.assignments();
+
+    write_sample_table( data, { "cluster" }, [&]( std::ostream& os, size_t i ){
+        os << "\t" << assignments[i];
+    }, out_pref + "emd_assignments.csv" );
+
+    // Centroid masses, rescaled to what the original masses per sample were.
+    auto pqry_cnts = std::vector<size_t>( mkmeans.centroids().size(), 0 );
+    for( size_t i = 0; i < assignments.size(); ++i ) {
+        pqry_cnts[ assignments[i] ] += data.pquery_counts[i];
+    }
+    std::ofstream os;
+    utils::file_output_stream( out_pref + "emd_centroids.csv", os );
+    for( size_t c = 0; c < mkmeans.centroids().size(); ++c ) {
+        auto masses = mass_tree_mass_per_edge( mkmeans.centroids()[c] );
+        for( size_t e = 0; e < masses.size(); ++e ) {
+            os << ( e > 0 ? "\t" : "" ) << masses[e] * pqry_cnts[c];
+        }
+        os << "\n";
+    }
+    return "EMD k-means with k=" + std::to_string( k );
+}
+
+std::string analysis_kmeans_imbalance( AnalysisData& data, std::vector<std::string> const& args )
+{
+    auto const k = std::stoul( args[0] );
+    auto const& out_pref = args[1];
+
+    // Use the imbalances of the non-constant edges.
+    auto edge_imb_mat = data.imbalances;
+    auto const columns = epca_filter_constant_columns( edge_imb_mat, 0.001 );
+    auto edge_imb_vec = std::vector<std::vector<double>>( edge_imb_mat.rows() );
+    for( size_t i = 0; i < edge_imb_mat.rows(); ++i ) {
+        edge_imb_vec[i].resize( edge_imb_mat.cols() );
+        for( size_t j = 0; j < edge_imb_mat.cols(); ++j ) {
+            edge_imb_vec[i][j] = edge_imb_mat( i, j );
+        }
+    }
+
+    auto ikmeans = EuclideanKmeans( edge_imb_mat.cols() );
+    ikmeans.run( edge_imb_vec, k );
+    auto const& assignments = ikmeans.assignments();
+
+    write_sample_table( data, { "cluster" }, [&]( std::ostream& os, size_t i ){
+        os << "\t" << assignments[i];
+    }, out_pref + "imbalance_assignments.csv" );
+
+    // Centroids, with the edge indices of their columns in the first line.
+    std::ofstream os;
+    utils::file_output_stream( out_pref + "imbalance_centroids.csv", os );
+    for( size_t j = 0; j < columns.size(); ++j ) {
+        os << ( j > 0 ? "\t" : "" ) << columns[j];
+    }
+    os << "\n";
+    for( auto const& centroid : ikmeans.centroids() ) {
+        for( size_t j = 0; j < centroid.size(); ++j ) {
+            os << ( j > 0 ? "\t" : "" ) << centroid[j];
+        }
+        os << "\n";
+    }
+    return "Imbalance k-means with k=" + std::to_string( k );
+}
+
+std::string analysis_squash( AnalysisData& data, std::vector<std::string> const& args )
+{
+    // Squash clustering consumes its trees, so it gets a copy of the resident ones.
+    auto sc = tree::SquashClustering();
+    sc.run( std::vector<tree::MassTree>( data.mass_trees ));
+    utils::file_write( sc.tree_string( data.sample_names ), args[0] );
+    return "Squash clustering of " + std::to_string( data.mass_trees.size() ) + " samples";
+}
+
+std::string analysis_edge_pca( AnalysisData& data, std::vector<std::string> const& args )
+{
+    auto const components = std::stoul( args[0] );
+    auto const& out_pref = args[1];
+
+    // Edge PCA uses the inner edges only, as epca_imbalance_matrix( samples, false ).
+    std::vector<size_t> inner_edge_indices;
+    for( size_t e = 0; e < data.reference_tree.edge_count(); ++e ) {
+        if( data.reference_tree.edge_at( e ).secondary_node().is_inner() ) {
+            inner_edge_indices.push_back( e );
+        }
+    }
+    auto imbalance_matrix = utils::Matrix<double>( data.imbalances.rows(), inner_edge_indices.size() );
+    for( size_t r = 0; r < imbalance_matrix.rows(); ++r ) {
+        for( size_t c = 0; c < inner_edge_indices.size(); ++c ) {
+            imbalance_matrix( r, c ) = data.imbalances( r, inner_edge_indices[c] );
+        }
+    }
+
+    // Same steps as epca(), with its default kappa and epsilon.
+    auto const not_filtered_cols = epca_filter_constant_columns( imbalance_matrix, 1e-5 );
+    epca_splitify_transform( imbalance_matrix, 1.0 );
+    auto const num = std::min({ components, imbalance_matrix.rows(), imbalance_matrix.cols() });
+    auto const pca = utils::principal_component_analysis(
+        imbalance_matrix, num, utils::PcaStandardization::kCovariance
+    );
+
+    utils::file_write( utils::to_string( pca.projection ), out_pref + "epca_projection.mat" );
+    utils::file_write( utils::to_string( pca.eigenvectors ), out_pref + "epca_eigenvectors.mat" );
+    std::ostringstream evout;
+    for( auto const& v : pca.eigenvalues ) {
+        evout << v << "\n";
+    }
+    utils::file_write( evout.str(), out_pref + "epca_eigenvalues.mat" );
+    std::ostringstream edges_out;
+    for( auto const c : not_filtered_cols ) {
+        edges_out << inner_edge_indices[c] << "\n";
+    }
+    utils::file_write( edges_out.str(), out_pref + "epca_edges.list" );
+
+    return "Edge PCA with " + std::to_string( num ) + " components";
+}
+
+std::string analysis_dispersion( AnalysisData& data, std::vector<std::string> const& args )
+{
+    auto const w_mean_stddev = matrix_col_mean_stddev( data.weights );
+    auto const i_mean_stddev = matrix_col_mean_stddev( data.imbalances );
+
+    std::ofstream os;
+    utils::file_output_stream( args[0], os );
+    os << "edge\tw_mean\tw_stddev\tw_cv\tw_vmr\ti_mean\ti_stddev\ti_cv\ti_vmr\n";
+    for( size_t e = 0; e < w_mean_stddev.size(); ++e ) {
+        auto const& w = w_mean_stddev[e];
+        auto const& i = i_mean_stddev[e];
+        os << e;
+        os << "\t" << w.mean << "\t" << w.stddev;
+        os << "\t" << w.stddev / w.mean << "\t" << w.stddev * w.stddev / w.mean;
+        os << "\t" << i.mean << "\t" << i.stddev;
+        os << "\t" << std::abs( i.stddev / i.mean ) << "\t" << std::abs( i.stddev * i.stddev / i.mean );
+        os << "\n";
+    }
+    return "Dispersion of " + std::to_string( w_mean_stddev.size() ) + " edges";
+}
+
+std::string analysis_correlation( AnalysisData& data, std::vector<std::string> const& args )
+{
+    auto const meta = reorder_meta_data_table( read_meta_data_table( args[0] ), data.sample_names );
+    auto const num_edges = data.weights.cols();
+
+    // Group the meta data columns by their validity masks, so that the edge columns are only
+    // ranked and standardized once per group, as in correlation_trees.
+    std::map<std::vector<uint64_t>, std::vector<size_t>> mask_groups;
+    for( size_t c = 0; c < meta.cols(); ++c ) {
+        mask_groups[ meta_data_valid_mask( meta, c ) ].push_back( c );
+    }
+
+    // Per meta data column, Pearson and Spearman correlation of each edge,
+    // with edge weights and imbalances, using the samples that have a value.
+    auto result = utils::Matrix<double>( num_edges, 4 * meta.cols() );
+    for( auto const& group : mask_groups ) {
+        auto const rows = valid_mask_rows( group.first );
+        auto const& cols = group.second;
+
+        auto const meta_std = standardized_columns( meta, cols, rows );
+        auto const w_std = standardized_columns( data.weights, rows );
+        auto const i_std = standardized_columns( data.imbalances, rows );
+        auto const pcc_w  = standardized_correlations( w_std.values, meta_std.values );
+        auto const pcc_i  = standardized_correlations( i_std.values, meta_std.values );
+        auto const srcc_w = standardized_correlations( w_std.ranks,  meta_std.ranks );
+        auto const srcc_i = standardized_correlations( i_std.ranks,  meta_std.ranks );
+
+        for( size_t k = 0; k < cols.size(); ++k ) {
+            auto const c = cols[k];
+            for( size_t e = 0; e < num_edges; ++e ) {
+                result( e, 4 * c + 0 ) = pcc_w( e, k );
+                result( e, 4 * c + 1 ) = pcc_i( e, k );
+                result( e, 4 * c + 2 ) = srcc_w( e, k );
+                result( e, 4 * c + 3 ) = srcc_i( e, k );
+            }
+        }
+    }
+
+    std::ofstream os;
+    utils::file_output_stream( args[1], os );
+    os << "edge";
+    for( auto const& name : meta.names ) {
+        os << "\t" << name << "_pcc_weights\t" << name << "_pcc_imbalance";
+        os << "\t" << name << "_srcc_weights\t" << name << "_srcc_imbalance";
+    }
+    os << "\n";
+    for( size_t e = 0; e < num_edges; ++e ) {
+        os << e;
+        for( size_t c = 0; c < result.cols(); ++c ) {
+            os << "\t" << result( e, c );
+        }
+        os << "\n";
+    }
+    return "Correlation of " + std::to_string( num_edges ) + " edges with "
+        + std::to_string( meta.cols() ) + " meta data columns";
+}
+
+// =================================================================================================
+//     Commands
+// =================================================================================================
+
+struct AnalysisCommand
+{
+    std::string usage;
+    size_t      num_args;
+    std::function<std::string( AnalysisData&, std::vector<std::string> const& )> run;
+};
+
+std::map<std::string, AnalysisCommand> const& analysis_commands()
+{
+    static std::map<std::string, AnalysisCommand> const commands = {
+        { "emd",              { "emd <out_file>", 1, analysis_emd }},
+        { "kmeans_emd",       { "kmeans_emd <k> <out_prefix>", 2, analysis_kmeans_emd }},
+        { "kmeans_imbalance", { "kmeans_imbalance <k> <out_prefix>", 2, analysis_kmeans_imbalance }},
+        { "squash",           { "squash <out_file>", 1, analysis_squash }},
+        { "edge_pca",         { "edge_pca <components> <out_prefix>", 2, analysis_edge_pca }},
+        { "dispersion",       { "dispersion <out_file>", 1, analysis_dispersion }},
+        { "correlation",      { "correlation <meta_file> <out_file>", 2, analysis_correlation }}
+    };
+    return commands;
+}
+
+/**
+ * @brief Run one command line against the resident @p data, and return the response line.
+ *
+ * Empty lines and lines starting with `#` are ignored, and yield an empty response. The command
+ * `quit` sets @p quit. Errors of the analyses are reported in the response, so that the
+ * server keeps running.
+ */
+std::string run_analysis_command( AnalysisData& data, std::string const& line, bool& quit )
+{
+    auto const tokens = utils::split( line, " \t\r" );
+    if( tokens.empty() || tokens[0][0] == '#' ) {
+        return "";
+    }
+    if( tokens[0] == "quit" ) {
+        quit = true;
+        return "ok quit";
+    }
+    if( tokens[0] == "help" ) {
+        std::string result = "ok commands:";
+        for( auto const& cmd : analysis_commands() ) {
+            result += " [" + cmd.second.usage + "]";
+        }
+        return result + " [quit]";
+    }
+
+    auto const it = analysis_commands().find( tokens[0] );
+    if( it == analysis_commands().end() ) {
+        return "error unknown command " + tokens[0];
+    }
+    auto const args = std::vector<std::string>( tokens.begin() + 1, tokens.end() );
+    if( args.size() != it->second.num_args ) {
+        return "error usage: " + it->second.usage;
+    }
+
+    LOG_INFO << "Running " << line;
+    try {
+        auto const message = it->second.run( data, args );
+        LOG_INFO << "Finished " << tokens[0];
+        return "ok " + message;
+    } catch( std::exception const& ex ) {
+        LOG_WARN << "Command " << tokens[0] << " failed: " << ex.what();
+        return "error " + std::string( ex.what() );
+    }
+}
+
+// =================================================================================================
+//     Command Sources
+// =================================================================================================
+
+/**
+ * @brief Run all commands of a batch command file (or stdin), one per line.
+ */
+void run_command_stream( AnalysisData& data, std::istream& is )
+{
+    std::string line;
+    bool quit = false;
+    while( ! quit && std::getline( is, line )) {
+        auto const response = run_analysis_command( data, line, quit );
+        if( ! response.empty() ) {
+            LOG_INFO << response;
+        }
+    }
+}
+
+/**
+ * @brief Write the whole @p response to a socket @p client. Return false if the client
+ * is gone, in which case the response is dropped.
+ */
+bool write_socket_response( int client, std::string const& response )
+{
+    size_t done = 0;
+    while( done < response.size() ) {
+        auto const n = write( client, response.data() + done, response.size() - done );
+        if( n < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( n <= 0 ) {
+            if( errno == EPIPE || errno == ECONNRESET ) {
+                LOG_WARN << "Client disconnected before receiving its response.";
+            } else {
+                LOG_WARN << "Cannot write response to client.";
+            }
+            return false;
+        }
+        done += static_cast<size_t>( n );
+    }
+    return true;
+}
+
+/**
+ * @brief Listen on a Unix domain socket, and run the commands that clients send, one per line,
+ * answering each with one response line. Clients are served one after another, until one of
+ * them sends `quit`.
+ */
+void run_command_socket( AnalysisData& data, std::string const& socket_path )
+{
+    sockaddr_un addr;
+    std::memset( &addr, 0, sizeof( addr ));
+    addr.sun_family = AF_UNIX;
+    if( socket_path.size() >= sizeof( addr.sun_path )) {
+        throw std::runtime_error( "Socket path too long: " + socket_path );
+    }
+    std::strcpy( addr.sun_path, socket_path.c_str() );
+
+    int const server = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if( server < 0 ) {
+        throw std::runtime_error( "Cannot create socket." );
+    }
+
+    // Remove a stale socket of a previous run, but never any other file at that path.
+    struct stat st;
+    if( stat( socket_path.c_str(), &st ) == 0 ) {
+        if( ! S_ISSOCK( st.st_mode )) {
+            close( server );
+            throw std::runtime_error( "File " + socket_path + " exists and is not a socket." );
+        }
+        unlink( socket_path.c_str() );
+    }
+    if(
+        bind( server, reinterpret_cast<sockaddr const*>( &addr ), sizeof( addr )) != 0 ||
+        listen( server, 4 ) != 0
+    ) {
+        close( server );
+        throw std::runtime_error( "Cannot listen on socket " + socket_path );
+    }
+    LOG_INFO << "Listening on " << socket_path;
+
+    // A client that disconnects before its command is finished would otherwise raise SIGPIPE
+    // when we write the response, which terminates the server with all its loaded data.
+    std::signal( SIGPIPE, SIG_IGN );
+
+    // If accept() keeps failing, for example because we are out of file descriptors,
+    // wait a bit longer each time (up to a second), instead of spinning on it.
+    useconds_t backoff = 0;
+
+    bool quit = false;
+    while( ! quit ) {
+        int const client = accept( server, nullptr, nullptr );
+        if( client < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            if( backoff == 0 ) {
+                LOG_WARN << "Cannot accept client: " << std::strerror( errno );
+            }
+            backoff = std::min<useconds_t>( backoff == 0 ? 10000 : 2 * backoff, 1000000 );
+            usleep( backoff );
+            continue;
+        }
+        backoff = 0;
+
+        // Read the client input, and run each complete line.
+        std::string buffer;
+        char chunk[4096];
+        ssize_t n;
+        bool connected = true;
+        while( ! quit && connected && ( n = read( client, chunk, sizeof( chunk ))) > 0 ) {
+            buffer.append( chunk, n );
+            size_t pos;
+            while( ! quit && connected && ( pos = buffer.find( '\n' )) != std::string::npos ) {
+                auto const line = buffer.substr( 0, pos );
+                buffer.erase( 0, pos + 1 );
+
+                auto const response = run_analysis_command( data, line, quit );
+                if( ! response.empty() ) {
+                    connected = write_socket_response( client, response + "\n" );
+                }
+            }
+        }
+        close( client );
+    }
+
+    close( server );
+    unlink( socket_path.c_str() );
+}
+
+// =================================================================================================
+//      Main
+// =================================================================================================
+
+/**
+ * @brief Load a directory of jplace files once, and run many analyses on the resident data.
+ *
+ * The commands come from a batch command file, from stdin (`-`), or from clients of a Unix
+ * domain socket (`unix:<path>`), one command per line, see analysis_commands().
+ */
+int main( int argc, char** argv )
+{
+    // Activate logging.
+    utils::Logging::log_to_stdout();
+    utils::Logging::details.time = true;
+
+    LOG_INFO << "Started";
+
+    // Check if the command line contains the right number of arguments.
+    if (argc != 4) {
+        throw std::runtime_error(
+            "Need to provide three arguments: threads, jplace dir, and command file, "
+            "'-' for stdin, or 'unix:<path>' for a socket.\n"
+        );
+    }
+
+    auto const threads = std::stoi( argv[1] );
+    auto const epadir  = utils::dir_normalize_path( std::string( argv[2] ));
+    auto const source  = std::string( argv[3] );
+
+    utils::Options::get().command_line( argc, argv );
+    utils::Options::get().number_of_threads( threads );
+    utils::Options::get().random_seed( 1455697401 );
+    LOG_BOLD << utils::Options::get().info();
+    LOG_BOLD;
+
+    auto data = load_analysis_data( epadir );
+    LOG_INFO << "Loaded " << data.sample_names.size() << " samples on a tree with "
+             << data.reference_tree.edge_count() << " edges";
+
+    if( utils::starts_with( source, "unix:" )) {
+        run_command_socket( data, source.substr( 5 ));
+    } else if( source == "-" ) {
+        run_command_stream( data, std::cin );
+    } else {
+        std::ifstream is( source );
+        if( ! is ) {
+            throw std::runtime_error( "Cannot read command file " + source );
+        }
+        run_command_stream( data, is );
+    }
+
+    LOG_INFO << "Finished";
+    return 0;
+}
@@ -23,7 +23,14 @@
 
 #include "genesis/genesis.hpp"
 
+#include "../common/edge_matrix_cache.hpp"
+#include "../common/fast_jplace_reader.hpp"
+#include "../common/randomized_pca.hpp"
+
+#include <algorithm>
+#include <cassert>
 #include <fstream>
+#include <limits>
 #include <string>
 #include <unordered_map>
 
@@ -254,6 +261,38 @@ void write_color_tree_to_svg(
 //
 // }
 
+// =================================================================================================
+//     Randomized EPCA
+// =================================================================================================
+
+/**
+ * @brief Same as `epca()`, but using randomized_principal_component_analysis(),
+ * as we only need a few components of the large imbalance matrix.
+ *
+ * The @p imbalance_matrix is expected to contain the inner edges only,
+ * as `epca_imbalance_matrix( samples, false )` yields.
+ */
+EpcaData randomized_epca(
+    utils::Matrix<double> imbalance_matrix,
+    double kappa,
+    double epsilon,
+    size_t components
+) {
+    auto not_filtered_cols = epca_filter_constant_columns( imbalance_matrix, epsilon );
+    epca_splitify_transform( imbalance_matrix, kappa );
+
+    components = std::min( components, imbalance_matrix.rows() );
+    components = std::min( components, imbalance_matrix.cols() );
+    auto pca = randomized_principal_component_analysis( imbalance_matrix, components );
+
+    EpcaData result;
+    result.eigenvalues  = std::move( pca.eigenvalues );
+    result.eigenvectors = std::move( pca.eigenvectors );
+    result.projection   = std::move( pca.projection );
+    result.edge_indices = std::move( not_filtered_cols );
+    return result;
+}
+
 // =================================================================================================
 //     Main
 // =================================================================================================
@@ -292,12 +331,35 @@ int main( int argc, char** argv )
     // -------------------------------------------------------------------------
 
     // Get all jplace files, either in the epa dir, or in its subdirs
-    auto jplace_filenames = utils::dir_list_files( epadir, ".*\\.jplace" );
+    auto jplace_filenames = utils::dir_list_files( epadir, false, ".*\\.jplace" );
     std::sort( jplace_filenames.begin(), jplace_filenames.end() );
+    for( auto& e : jplace_filenames ) {
+        e = epadir + e;
+    }
 
-    LOG_INFO << "reading " << jplace_filenames.size() << " jplace sample files";
-    auto const sample_set = JplaceReader().from_files( jplace_filenames );
-    assert( sample_set.size() == jplace_filenames.size() );
+    // Average tree and edge imbalances. The jplace files are only read
+    // if the edge matrix cache is not up to date.
+    auto selection = EdgeMatrixCacheSelection();
+    selection.masses  = false;
+    selection.weights = false;
+    auto cache = edge_matrix_cache( jplace_filenames, selection );
+    auto const& tree = cache.average_tree;
+    auto const& sample_names = cache.sample_names;
+
+    // Edge PCA only uses the inner edges.
+    std::vector<size_t> inner_edge_indices;
+    for( size_t e = 0; e < tree.edge_count(); ++e ) {
+        if( tree.edge_at( e ).secondary_node().is_inner() ) {
+            inner_edge_indices.push_back( e );
+        }
+    }
+    auto imbalance_matrix = utils::Matrix<double>( cache.imbalances.rows(), inner_edge_indices.size() );
+    for( size_t r = 0; r < imbalance_matrix.rows(); ++r ) {
+        for( size_t c = 0; c < inner_edge_indices.size(); ++c ) {
+            imbalance_matrix( r, c ) = cache.imbalances( r, inner_edge_indices[c] );
+        }
+    }
+    cache.imbalances = utils::Matrix<double>();
     LOG_INFO << "finished reading sample jplace files";
     LOG_INFO;
 
@@ -310,7 +372,7 @@ int main( int argc, char** argv )
     size_t const components = 5;
 
     LOG_INFO << "Edge PCA calculation started";
-    auto const epca_data = epca( sample_set, 1.0, -1.0, components );
+    auto const epca_data = randomized_epca( std::move( imbalance_matrix ), 1.0, -1.0, components );
     LOG_INFO << "Edge PCA calculation finished";
 
     utils::file_write( utils::to_string( epca_data.projection ), outdir + "epca_projection.mat" );
@@ -320,7 +382,7 @@ int main( int argc, char** argv )
 
     std::ostringstream proj_out;
     for( size_t r = 0; r < epca_data.projection.rows(); ++r ) {
-        proj_out << sample_set[r].name << "," << epca_data.projection( r, 0 ) << "," << epca_data.projection( r, 1 ) << "\n";
+        proj_out << sample_names[r] << "," << epca_data.projection( r, 0 ) << "," << epca_data.projection( r, 1 ) << "\n";
     }
     utils::file_write( proj_out.str(), outdir + "proj.csv" );
 
@@ -332,13 +394,7 @@ int main( int argc, char** argv )
 
     LOG_DBG << "eigenvalues  " << epca_data.eigenvalues.size();
 
-    size_t inner_branch_count = 0;
-    for( auto const& e : sample_set.at(0).sample.tree().edges() ) {
-        if( e->secondary_node().is_inner() ) {
-            ++inner_branch_count;
-        }
-    }
-    LOG_DBG << "inner_branch_count " << inner_branch_count;
+    LOG_DBG << "inner_branch_count " << inner_edge_indices.size();
 
     std::ostringstream evout;
     for( auto const& v : epca_data.eigenvalues ) {
@@ -350,8 +406,6 @@ int main( int argc, char** argv )
     //     write vis files
     // -------------------------------------------------------------------------
 
-    auto const tree = average_branch_length_tree( sample_set );
-
     for( size_t i = 0; i < components; ++i ) {
         auto const color_vec = epca_to_colors( tree, epca_data, i );
 
@@ -378,7 +432,7 @@ int main( int argc, char** argv )
     //
     // std::ostringstream pca_proj_out;
     // for( size_t r = 0; r < pca.projection.rows(); ++r ) {
-    //     pca_proj_out << sample_set[r].name << "," << pca.projection( r, 0 ) << "," << pca.projection( r, 1 ) << "\n";
+    //     pca_proj_out << sample_names[r] << "," << pca.projection( r, 0 ) << "," << pca.projection( r, 1 ) << "\n";
     // }
     // utils::file_write( pca_proj_out.str(), outdir + "pca_proj.csv" );
 
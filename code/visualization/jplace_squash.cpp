@@ -23,6 +23,11 @@
 
 #include "genesis/genesis.hpp"
 
+#include "../common/fast_jplace_reader.hpp"
+#include "../common/nn_chain_squash_clustering.hpp"
+
+#include <algorithm>
+#include <cassert>
 #include <fstream>
 #include <string>
 #include <unordered_map>
@@ -335,20 +340,9 @@ int main( int argc, char** argv )
     // LOG_INFO << "done";
     // LOG_INFO;
 
-    SampleSet sset;
-    JplaceReader jplace_reader;
-
     // Process all jplace files.
     LOG_INFO << "reading " << jplace_filenames.size() << " jplace sample files";
-    size_t file_count = 0;
-    for( auto const& jplace_filename : jplace_filenames ) {
-
-        // Progress output.
-        // LOG_INFO << "at jplace file " << file_count << " (" << jplace_filename << ")";
-        ++file_count;
-
-        sset.add( jplace_reader.from_file( jplace_filename ), jplace_filename );
-    }
+    auto sset = FastJplaceReader().from_files( jplace_filenames );
 
     // Final output for jplace reading
     assert( sset.size() == jplace_filenames.size() );
@@ -374,7 +368,7 @@ int main( int argc, char** argv )
 
     LOG_INFO << "Starting squash clustering";
     // auto sc = tree::squash_clustering( std::move( mass_trees.first ));
-    auto sc = tree::SquashClustering();
+    auto sc = NnChainSquashClustering();
     sc.run( std::move( mass_trees.first ) );
     LOG_INFO << "Finished squash clustering";
 
@@ -23,9 +23,12 @@
 
 #include "genesis/genesis.hpp"
 
+#include "../common/edge_matrices.hpp"
+
 #include <fstream>
 #include <string>
 #include <unordered_map>
+#include <utility>
 
 using namespace genesis;
 using namespace genesis::placement;
@@ -409,9 +412,16 @@ int main( int argc, char** argv )
         // LOG_DBG << smp.name;
     }
 
+    // Mass trees, average tree and edge imbalances, all in one pass over the samples.
     LOG_INFO << "Converting Trees";
-    auto mass_trees = convert_sample_set_to_mass_trees( sset );
-    auto const avg_tree =average_branch_length_tree( sset );
+    auto edge_mats_settings = EdgeMatricesSettings();
+    edge_mats_settings.weights = false;
+    edge_mats_settings.mass_trees = true;
+    auto edge_mats = edge_matrices( sset, edge_mats_settings );
+    auto mass_trees = std::make_pair(
+        std::move( edge_mats.mass_trees ), std::move( edge_mats.total_masses )
+    );
+    auto const avg_tree = std::move( edge_mats.average_tree );
     // sset.clear();
 
     auto mt2 = mass_trees;
@@ -503,7 +513,7 @@ int main( int argc, char** argv )
 
     // Prepare
     LOG_INFO << "Calculating Matrix";
-    auto edge_imb_mat = epca_imbalance_matrix( sset, true );
+    auto edge_imb_mat = std::move( edge_mats.imbalances );
     auto const columns = epca_filter_constant_columns( edge_imb_mat, 0.001 );
 
     auto edge_imb_vec = std::vector<std::vector<double>>();